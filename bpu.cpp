@@ -9,6 +9,12 @@
 #include <iostream>
 #include <sstream>
 #include <fstream>
+#include <time.h>
+#include <map>
+#include <regex>
+#include <unordered_set>
+#include "bpu.h"
+#include "trace.h"
 
 
 // --------------------------
@@ -23,432 +29,732 @@
 KNOB<string> KnobOutputFile(KNOB_MODE_WRITEONCE, "pintool",
     "o", "btb.out", "specify output file name for BTB simulator");
 
-KNOB<UINT32> KnobMispredRate(KNOB_MODE_WRITEONCE, "pintool",
-    "mpr", "20", "specify direction misprediction rate for BTB simulator");
+KNOB<BOOL> KnobPerInstruction(KNOB_MODE_WRITEONCE, "pintool",
+    "ins", "0", "instrument every instruction instead of every basic block (slow)");
 
+KNOB<string> KnobRecordFile(KNOB_MODE_WRITEONCE, "pintool",
+    "record", "", "specify file name to record the branch trace for bpu_replay");
 
-// Add your KNOBs here
-///////////////////////////////////////////////////////////
-KNOB<UINT64> KnobBTBsize(KNOB_MODE_WRITEONCE, "pintool",
-    "btbs", "1024", "specify BTB size");
+KNOB<BOOL> KnobSharedBTB(KNOB_MODE_WRITEONCE, "pintool",
+    "sharedbtb", "0", "share one BTB per configuration between all threads (SMT)");
 
-KNOB<UINT64> KnobBTBassoc(KNOB_MODE_WRITEONCE, "pintool",
-    "btba", "4", "specify BTB associativity");
+KNOB<UINT32> KnobWorkers(KNOB_MODE_WRITEONCE, "pintool",
+    "workers", "0", "simulate on this many tool threads, fed by per-thread queues (0 = inline)");
 
-KNOB<UINT64> KnobBTBTagSize(KNOB_MODE_WRITEONCE, "pintool",
-    "tags", "12", "specify BTB tag size");
+KNOB<UINT32> KnobQueueSize(KNOB_MODE_WRITEONCE, "pintool",
+    "queue", "65536", "branch events per thread queue with -workers (rounded up to a power of 2)");
 
-KNOB<UINT64> KnobRASsize(KNOB_MODE_WRITEONCE, "pintool",
-    "ras", "10", "specify RAS size");
-		
-///////////////////////////////////////////////////////////
+// Code filters: only the code they leave is instrumented and simulated
+KNOB<string> KnobIncludeImage(KNOB_MODE_APPEND, "pintool",
+    "include-img", "", "simulate only images whose name contains this (may be repeated)");
 
-/* ===================================================================== */
-// Branch Target Buffer object & simulation methods
-/* ===================================================================== */
-class BPU {
-//Added class variables
-///////////////////////////////
-typedef struct btb_entry {
-	UINT64 tag;
-	bool FlagIsReturn;
-	ADDRINT BTA;
-	btb_entry* next;
-} BTB_ENTRY;
+KNOB<string> KnobExcludeImage(KNOB_MODE_APPEND, "pintool",
+    "exclude-img", "", "do not simulate images whose name contains this (may be repeated)");
+
+KNOB<string> KnobIncludeRoutine(KNOB_MODE_APPEND, "pintool",
+    "include-rtn", "", "simulate only routines whose name matches this regex (may be repeated)");
+
+KNOB<string> KnobExcludeRoutine(KNOB_MODE_APPEND, "pintool",
+    "exclude-rtn", "", "do not simulate routines whose name matches this regex (may be repeated)");
+
+KNOB<string> KnobIncludeRange(KNOB_MODE_APPEND, "pintool",
+    "include-range", "", "simulate only addresses in start-end, e.g. 0x400000-0x500000 (may be repeated)");
 
-BTB_ENTRY** BTB;
+KNOB<string> KnobExcludeRange(KNOB_MODE_APPEND, "pintool",
+    "exclude-range", "", "do not simulate addresses in start-end (may be repeated)");
 
-UINT64 BTBSetSize;
-UINT64 BTBNumberOfSets;
 
-ADDRINT* RAS; 
-UINT64 topRAS;
-UINT64 RASsize;
+/* ================================================================== */
+// Global variables 
+/* ================================================================== */
+std::ofstream *outFile;   // File for simulation output
+
+// A branch waiting in a queue to be simulated (-workers)
+struct BRANCH_EVENT {
+    UINT64 instructions;        // cnt_instr of the thread at this branch
+    ADDRINT PC;
+    ADDRINT targetPC;
+    UINT32 size;
+    bool brTaken;
+    bool isCall;
+    bool isReturn;
+    bool isIndirect;
+    bool isControlFlow;
+    bool warming;               // in a warm-up window
+    UINT32 slot;
+};
 
-///////////////////////////////
+// Single producer, single consumer ring of branch events. The application
+// thread only writes head and its stall counters, the worker only tail and
+// its occupancy counters, each group on a cache line of its own.
+struct BRANCH_QUEUE {
+    BRANCH_EVENT *events;
+    UINT64 mask;                // capacity - 1
 
-public:
-BPU();  // Make your own constructor!
+    UINT64 head __attribute__((aligned(CACHE_LINE)));
+    UINT64 cachedTail;          // last tail seen by the producer
+    UINT64 stalls;              // pushes that found the queue full
+    UINT64 stallNanos;          // time spent waiting on a full queue
 
-bool PredictDirection(ADDRINT PC,
-                      bool isControlFlow,
-                      bool brTaken);
+    UINT64 tail __attribute__((aligned(CACHE_LINE)));
+    UINT64 batches;             // non empty drains
+    UINT64 occupancySum;        // events found per drain
+    UINT64 occupancyMax;
+};
 
-ADDRINT PredictTarget(ADDRINT PC,
-                      ADDRINT fallThroughAddr,
-                      bool predictDir);
+// Everything an application thread updates: its own BPUs (BTB, RAS and
+// direction predictor) and counters, on cache lines of its own. With
+// -workers, sim belongs to the worker thread draining the queue.
+struct THREAD_DATA {
+    UINT64 cnt_instr;            // Instructions executed, copied to sim at the end
+    UINT64 cnt_instr_recorded;   // cnt_instr at the last recorded branch
+    TRACE_WRITER *traceWriter;   // Branch trace, if -record is given
+    BRANCH_QUEUE *queue;         // Branches to simulate, if -workers is given
+    SAMPLING_STATE sampling;     // skip, warm-up or detail (-skip, -warmup, ...)
 
-VOID UpdatePredictor(ADDRINT PC,         // address of instruction executing now
-                     bool brTaken,       // the actual direction
-                     ADDRINT targetPC,   // the next PC, **if taken**
-                     ADDRINT returnAddr, // return address for subroutine calls,
-                     bool isCall,        // is a subroutine call
-                     bool isReturn,      // is a return from subroutine
-                     bool correctDir,    // my direction prediction was correct
-                     bool correctTarg);  // my target prediction was correct
+    SIM_STATE sim __attribute__((aligned(CACHE_LINE)));
+};
 
-std::string ReportCounters();
+static TLS_KEY tlsKey;       // THREAD_DATA of each thread
+static REG threadDataReg;    // THREAD_DATA of the running thread, for analysis calls
+static PIN_LOCK threadsLock; // guards threads and sharedBTBs
+static std::vector<THREAD_DATA*> threads;
+static BTB **sharedBTBs = NULL;  // one per configuration with -sharedbtb
 
-}; // end class BPU 
+static UINT32 numThreads = 0;      // threads published to the workers
+static UINT32 numWorkers = 0;      // -workers
+static PIN_THREAD_UID *workerUids = NULL;
+static bool stopWorkers = false;   // set in PrepareForFini
+static bool workersStopped = false;
+
+static const UINT64 QUEUE_BATCH = 4096;  // events simulated per tail update
+
+static BRANCH_SITES sites;         // static branches profiled with -topn
+static SAMPLING_SCHEDULE *schedule; // skip, warm-up and detailed windows
+static STATE_READER *loadState = NULL; // -load-state checkpoint, loaded into every thread
+
+static LIVE_WRITER *live = NULL;   // -live counters file, opened by the first thread
+static PIN_THREAD_UID liveUid;
+static bool stopLive = false;      // set in PrepareForFini
+
+/* ===================================================================== */
+// Utilities
+/* ===================================================================== */
 
 /*!
- * Predicts the direction of instruction at address PC: true - branch is taken 
- *   Not a real predictor: randomly makes wrong predictions
- *   only for control flow instructions
- * This function is called for every instruction executed.
- * @param[in]   PC              address of current instruction
- * @param[in]   isControlFlow   true if instruction may change control flow
- * @param[in]   brTaken         true if instruction takes a branch
+ *  Print out help message.
  */
-bool BPU::PredictDirection(ADDRINT PC,
-                           bool isControlFlow,
-                           bool brTaken)
+INT32 Usage()
 {
-    if (!isControlFlow) {
-        // CHEAT: can't do this in real hardware!
-        // Don't make wrong predictions on normal instructions!
-        // Phantom branches may appear if this is modified:
-        //  normal instructions mistaken for branches because they are predicted
-        //  taken and have a target address in the BTB....
-        return brTaken; // should be false.
-    }
-    // --------------------------
-    // Get a random number up to 100
-    // http://stackoverflow.com/questions/822323/how-to-generate-a-random-number-in-c
-
-    // Chop off all of the values that would cause skew...
-    long end = RAND_MAX / 100; // truncate skew
-    end *= 100;
+    cerr << "This tool is a Branch Targer Simulator." << endl <<
+            "It runs an application and prints out the number of" << endl <<
+            "dynamically executed branches, their target prediction ratio," << endl <<
+            "and other metrics." << endl << endl;
+    cerr << KNOB_BASE::StringKnobSummary() << endl;
+    return -1;
+}
 
-    // ... and ignore results from rand() that fall above that limit.
-    // (Worst case the loop condition should succeed 50% of the time,
-    // so we can expect to bail out of this loop pretty quickly.)
-    UINT32 r;
-    while ((r = rand()) >= end)
-        ;
+/* ===================================================================== */
+// Analysis routines
+/* ===================================================================== */
 
-    // -------------------------
-    if (r % 100 > (100-KnobMispredRate.Value()))
-        return !brTaken;  // mispredict direction
-    return brTaken;
+/*!
+ * Append a branch to the -record trace of the thread.
+ * @param[in]   td              data of the thread
+ * @param[in]   PC              address of current instruction
+ * @param[in]   targetPC        the next PC, **if taken**
+ * @param[in]   brTaken         the branch direction, 0 - not taken, 1 - taken
+ * @param[in]   size            the instruction size in bytes
+ * @param[in]   isCall          true if the instruction is a subroutine call
+ * @param[in]   isReturn        true if the instruction is a subroutine return
+ * @param[in]   isIndirect      true if the instruction is an indirect jump or call
+ */
+static inline VOID RecordBranch(THREAD_DATA *td,
+                                ADDRINT PC,
+                                ADDRINT targetPC,
+                                bool brTaken,
+                                UINT32 size,
+                                bool isCall,
+                                bool isReturn,
+                                bool isIndirect)
+{
+    BRANCH_RECORD r;
+    r.PC = PC;
+    r.targetPC = targetPC;
+    r.instructions = td->cnt_instr - td->cnt_instr_recorded;
+    r.size = size;
+    r.brTaken = brTaken;
+    r.isCall = isCall;
+    r.isReturn = isReturn;
+    r.isIndirect = isIndirect;
+    td->traceWriter->Append(r);
+    td->cnt_instr_recorded = td->cnt_instr;
 }
 
+/* ===================================================================== */
+// Decoupled simulation (-workers)
+/* ===================================================================== */
+
+static inline UINT64 NowNanos()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (UINT64)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
 
 /*!
-// Initialize data structures for branch predictors here.
-// @note  Use KNOBs to pass parameters to the BPU, such as:
-//   number of entries, associativity, RAS entries, replacement policies, ...
+ * Simulate the branches waiting in the queue of a thread, in order.
+ * Called by the worker owning the thread, or by the application thread
+ *  itself once the workers have stopped.
+ * @param[in]   td              data of the thread
+ * @return                      number of branches simulated
  */
+static UINT64 DrainQueue(THREAD_DATA *td)
+{
+    BRANCH_QUEUE *q = td->queue;
+    UINT64 head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    UINT64 tail = q->tail;
+    if (head == tail)
+        return 0;
 
-// Constructor
-/////////////////////////////////////////////////////////////////////////////////////////////
-BPU::BPU(void) {
-	BTBNumberOfSets = KnobBTBsize.Value()/KnobBTBassoc.Value();	
-	BTBSetSize = KnobBTBassoc.Value();
-	RASsize = KnobRASsize.Value();
+    UINT64 occupancy = head - tail;
+    q->batches++;
+    q->occupancySum += occupancy;
+    if (occupancy > q->occupancyMax)
+        q->occupancyMax = occupancy;
 
-	//BTB: array of linked lists (sets)
-	BTB = (BTB_ENTRY**) malloc(BTBNumberOfSets*sizeof(BTB_ENTRY*));
-	for (UINT64 i=0; i<BTBNumberOfSets; i++){
-		BTB[i] = NULL;
-	}
-	
-	//RAS: array of instruction addresses
-	RAS = (ADDRINT*) malloc(RASsize*sizeof(ADDRINT));
-	topRAS = -1;
+    // Hand back the slots in batches, so the producer never waits for all
+    while (tail != head) {
+        UINT64 end = (head - tail > QUEUE_BATCH) ? tail + QUEUE_BATCH : head;
+        for (; tail != end; tail++) {
+            const BRANCH_EVENT &e = q->events[tail & q->mask];
+            td->sim.cnt_instr = e.instructions;
+            td->sim.warming = e.warming;
+            SimulateBranch(td->sim, e.PC, e.targetPC, e.brTaken, e.size,
+                           e.isCall, e.isReturn, e.isIndirect, e.isControlFlow, e.slot);
+        }
+        __atomic_store_n(&q->tail, tail, __ATOMIC_RELEASE);
+    }
+    return occupancy;
 }
 
+/*!
+ * Wait until the queue of the thread has a free slot. Drains the queue
+ *  in place if the workers are gone (application threads running past
+ *  PrepareForFini).
+ * @param[in]   td              data of the thread
+ */
+static VOID WaitForQueueSlot(THREAD_DATA *td)
+{
+    BRANCH_QUEUE *q = td->queue;
+    UINT64 start = NowNanos();
+    while (q->head - q->cachedTail > q->mask) {
+        if (__atomic_load_n(&workersStopped, __ATOMIC_ACQUIRE))
+            DrainQueue(td);
+        else
+            PIN_Yield();
+        q->cachedTail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+    }
+    q->stalls++;
+    q->stallNanos += NowNanos() - start;
+}
 
 /*!
-// Predict the target of the instruction at address PC by looking it up in 
-//  the BTB.  Use the direction prediction predictDir to decide between the
-//  target address in the BTB or the fallThroughAddr 
- * @param[in]   PC              address of current instruction
- * @param[in]   fallThroughAddr address of next, sequential instruction
- * @param[in]   predictDir      the predicted direction of this "branch"
- */
-ADDRINT BPU::PredictTarget(ADDRINT PC,
-                           ADDRINT fallThroughAddr,
-                           bool predictDir)
-{
-	if (!predictDir) {    
-		return fallThroughAddr;
-	}
-	
-	UINT64 index = PC & (BTBNumberOfSets-1);
-	UINT64 tag = (PC/BTBNumberOfSets) & ((1 << KnobBTBTagSize.Value()) - 1);
-	
-	BTB_ENTRY* BTBEntryCurrent = BTB[index];
-
-	//find tag in the set
-	while (BTBEntryCurrent != NULL){
-		if (BTBEntryCurrent->tag == tag){
-			if (BTBEntryCurrent->FlagIsReturn == true){				//if isReturn, pop a RAS entry
-				ADDRINT temp = RAS[topRAS];
-				topRAS = ((topRAS == 0) ? RASsize-1 : topRAS - 1);
-				return temp;
-			}
-			return BTBEntryCurrent->BTA;
-		}
-		BTBEntryCurrent = BTBEntryCurrent->next;
-	}
-	return fallThroughAddr;
-}
-
-/*!
-// Update the information in the BTB, RAS for the branch instruction
-// at address PC, using the fully available information now that it
-// has been executed.
- * @param[in]   PC           address of current instruction
- * @param[in]   brTaken      true if is actually taken
- * @param[in]   targetPC     the target, if it is taken
- * @param[in]   returnAddr   the return address, if it is a subroutine call
- * @param[in]   isCall       true if this is a subroutine call
- * @param[in]   isReturn     true if this is a subroutine return
- * @param[in]   correctDir   true if the direction was predicted correctly
- * @param[in]   correctTarg  true if the target was predicted correctly
-// @note Use KNOBs to pass parameters related to BTB prediction such as
-//   replacement policies, when to insert an entry, ...
-*/
-VOID BPU::UpdatePredictor(ADDRINT PC,           // address of instruction executing now
-                          bool brTaken,      // the actual direction
-                          ADDRINT targetPC,     // the next PC, **if taken**
-                          ADDRINT returnAddr,   // return address for subroutine calls,
-                          bool isCall,       // is a subroutine call
-                          bool isReturn,     // is a return from subroutine
-                          bool correctDir,   // my direction prediction was correct
-                          bool correctTarg)  // my target prediction was correct
-{
-	UINT64 counter = 0;  
-		
-	UINT64 index = PC & (BTBNumberOfSets-1);
-	UINT64 tag = (PC/BTBNumberOfSets) & ((1 << KnobBTBTagSize.Value()) - 1);
-
-	BTB_ENTRY* BTBEntryCurrent = BTB[index];
-	BTB_ENTRY* BTBEntryPrevious = NULL;
-
-	//Push a RAS entry
-	if (isCall){
-		topRAS = (topRAS + 1) % RASsize;
-		RAS[topRAS] = returnAddr;
-	}
-	
-	//Update BTB
-	if (brTaken && !correctTarg){
-		while (BTBEntryCurrent != NULL){
-			counter++;
-			
-			//Update an existing entry
-			if (BTBEntryCurrent->tag == tag){
-				BTBEntryCurrent->BTA = targetPC;
-				return;
-			}
-			
-			//Replace the only entry when the BTB is direct-mapped
-			if (BTBSetSize == 1){	
-				BTBEntryCurrent->tag = tag;
-				if (isReturn){
-					BTBEntryCurrent->FlagIsReturn = true;
-				}
-				else{
-					BTBEntryCurrent->FlagIsReturn = false;
-				}
-				BTBEntryCurrent->BTA = targetPC;
-				return;
-			}
-			
-			//Add a new entry in a set
-			if (BTBEntryCurrent->next == NULL){	
-				//Add new entry as the head of the set	
-				BTB_ENTRY* BTBNewEntry = (BTB_ENTRY*) malloc(sizeof(BTB_ENTRY));
-				BTBNewEntry->tag = tag;
-				if (isReturn){
-					BTBNewEntry->FlagIsReturn = true;
-				}
-				else{
-					BTBNewEntry->FlagIsReturn = false;
-				}
-				BTBNewEntry->BTA = targetPC;
-				BTBNewEntry->next = BTB[index];
-				
-				BTB[index] = BTBNewEntry;
-					
-				//Remove last entry when set is full
-				if (counter == BTBSetSize){
-					BTBEntryPrevious->next = NULL;
-					free(BTBEntryCurrent);
-				}
-				return;	
-			}
-			BTBEntryPrevious = BTBEntryCurrent;
-			BTBEntryCurrent = BTBEntryCurrent->next;
-		}
-		
-		//Add first entry in a set
-		BTB_ENTRY* BTBNewEntry = (BTB_ENTRY*) malloc(sizeof(BTB_ENTRY));
-		BTBNewEntry->tag = tag;
-		if (isReturn){
-			BTBNewEntry->FlagIsReturn = true;
-		}
-		else {		
-			BTBNewEntry->FlagIsReturn = false;
-		}
-		BTBNewEntry->BTA = targetPC;
-		BTBNewEntry->next = NULL;
-		
-		BTB[index] = BTBNewEntry;
-	}
-	return;
-}
-////////////////////////////////////////////////////////////////////////////////
-
-std::string BPU::ReportCounters()
-{
-    return std::string();
+ * Append a branch to the queue of the thread, for a worker to simulate.
+ * Arguments as for SimulateBranch.
+ * @param[in]   td              data of the thread
+ */
+static inline VOID EnqueueBranch(THREAD_DATA *td,
+                                 ADDRINT PC,
+                                 ADDRINT targetPC,
+                                 bool brTaken,
+                                 UINT32 size,
+                                 bool isCall,
+                                 bool isReturn,
+                                 bool isIndirect,
+                                 bool isControlFlow,
+                                 UINT32 slot)
+{
+    BRANCH_QUEUE *q = td->queue;
+    if (q->head - q->cachedTail > q->mask) {
+        q->cachedTail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+        if (q->head - q->cachedTail > q->mask)
+            WaitForQueueSlot(td);
+    }
+    BRANCH_EVENT &e = q->events[q->head & q->mask];
+    e.instructions = td->cnt_instr;
+    e.PC = PC;
+    e.targetPC = targetPC;
+    e.size = size;
+    e.brTaken = brTaken;
+    e.isCall = isCall;
+    e.isReturn = isReturn;
+    e.isIndirect = isIndirect;
+    e.isControlFlow = isControlFlow;
+    e.warming = (td->sampling.phase == PHASE_WARMUP);
+    e.slot = slot;
+    __atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE);
 }
 
-/* ================================================================== */
-// Global variables 
-/* ================================================================== */
-BPU  *myBPU; // The Branch Prediction Unit
-std::ofstream *outFile;   // File for simulation output
+/*!
+ * Worker thread: simulates the queues of application threads
+ *  w, w + workers, w + 2*workers, ... until PrepareForFini stops it.
+ * @param[in]   arg             index w of the worker
+ */
+static VOID Worker(VOID *arg)
+{
+    UINT32 w = (UINT32)(ADDRINT) arg;
+    std::vector<THREAD_DATA*> mine;
+    UINT32 known = 0;
 
-// Global counters for the simulator:
-static UINT64 cnt_instr = 0;
-static UINT64 cnt_branches = 0;
-static UINT64 cnt_branches_taken = 0;
-static UINT64 cnt_correctPredDir = 0;
-static UINT64 cnt_correctPredTarg = 0;
-static UINT64 cnt_correctPred     = 0;
+    for (;;) {
+        UINT32 n = __atomic_load_n(&numThreads, __ATOMIC_ACQUIRE);
+        if (n != known) {
+            PIN_GetLock(&threadsLock, 0);
+            for (UINT32 i = known; i < n; i++) {
+                if (i % numWorkers == w)
+                    mine.push_back(threads[i]);
+            }
+            PIN_ReleaseLock(&threadsLock);
+            known = n;
+        }
 
-//extra statistics
-//////////////////////////////////////////////////////////
-//static UINT64 isCallCounter = 0;
-//static UINT64 isReturnCounter = 0;
-//////////////////////////////////////////////////////////
+        // Read before draining, so the last pass sees everything
+        bool stop = __atomic_load_n(&stopWorkers, __ATOMIC_ACQUIRE);
+        UINT64 done = 0;
+        for (UINT32 i = 0; i < mine.size(); i++)
+            done += DrainQueue(mine[i]);
+        if (done == 0) {
+            if (stop)
+                break;
+            PIN_Yield();
+        }
+    }
+}
 
 /* ===================================================================== */
-// Utilities
+// Live counters (-live)
 /* ===================================================================== */
 
 /*!
- *  Print out help message.
+ * Publish a snapshot of the counters of all threads to the -live file.
+ * The application threads are never stopped: only the thread list is
+ *  locked, and the analysis path takes no lock.
+ * @param[in]   finished        true for the last snapshot of the run
  */
-INT32 Usage()
+static VOID PublishLive(bool finished)
 {
-    cerr << "This tool is a Branch Targer Simulator." << endl <<
-            "It runs an application and prints out the number of" << endl <<
-            "dynamically executed branches, their target prediction ratio," << endl <<
-            "and other metrics." << endl << endl;
-    cerr << KNOB_BASE::StringKnobSummary() << endl;
-    return -1;
+    std::vector<SIM_STATE*> streams;
+    std::vector<UINT64> values;
+    PIN_GetLock(&threadsLock, 0);
+    for (UINT32 i = 0; i < threads.size(); i++)
+        streams.push_back(&threads[i]->sim);
+    if (!streams.empty())
+        CollectLiveValues(streams, finished, values);
+    PIN_ReleaseLock(&threadsLock);
+    if (!streams.empty())
+        live->Publish(values);
 }
 
-
-/* ===================================================================== */
-// Analysis routines
-/* ===================================================================== */
+/*!
+ * Publisher thread: a snapshot every -live-period milliseconds, until
+ *  PrepareForFini stops it.
+ * @param[in]   arg             unused
+ */
+static VOID LivePublisher(VOID *arg)
+{
+    static const UINT32 SLICE_MS = 100;   // to notice stopLive quickly
+    for (;;) {
+        for (UINT32 slept = 0; slept < KnobLivePeriod.Value(); slept += SLICE_MS) {
+            if (__atomic_load_n(&stopLive, __ATOMIC_ACQUIRE))
+                return;
+            PIN_Sleep(std::min(SLICE_MS, KnobLivePeriod.Value() - slept));
+        }
+        PublishLive(false);
+    }
+}
 
 /*!
  * Process branches: predict all instructions at Fetch, check prediction
  *  and update prediction structures at Execute stage
- * This function is called for every instruction executed.
+ * This function is called for every instruction executed (-ins mode),
+ *  after CountBlock has counted it.
+ * @param[in]   td              data of the thread
  * @param[in]   PC              address of current instruction
  * @param[in]   targetPC        the next PC, **if taken**
  * @param[in]   brTaken         the branch direction, 0 - not taken, 1 - taken
  * @param[in]   size            the instruction size in bytes
  * @param[in]   isCall          true if the instruction is a subroutine call
  * @param[in]   isReturn        true if the instruction is a subroutine return
+ * @param[in]   isIndirect      true if the instruction is an indirect jump or call
  * @param[in]   isConstrolFlow  true if the instruction is branch, jump, return, ...
+ * @param[in]   slot            profile slot of the branch, or NO_BRANCH_SLOT
  */
-VOID ProcessBranch(ADDRINT PC,
+VOID ProcessBranch(THREAD_DATA *td,
+                   ADDRINT PC,
                    ADDRINT targetPC,
                    bool brTaken,
                    UINT32 size,
                    bool isCall,
                    bool isReturn,
-                   bool isControlFlow)
-{
-   /*
-   *outFile << "PC: "          << PC 
-            << " targetPC: "   << targetPC 
-            << " taken: "      << brTaken
-            << " isCall: "     << isCall
-            << " isRet: "      << isReturn
-            << " isBrOrCall: " << isControlFlow
-            << " PC+size: " << PC+size
-           << endl;
-    */
-    ADDRINT fallThroughAddr = PC + size;
-    bool    correctDir  = false;
-    bool    correctTarg = false;
-    bool    predictDir;
-    ADDRINT predictPC;
-
-    // ------------------------------------------
-    // Make your prediction:  (@ Fetch stage)
-    predictDir = myBPU->PredictDirection(PC, isControlFlow, brTaken);
-    predictPC  = myBPU->PredictTarget(PC, fallThroughAddr, predictDir);
-    // ------------------------------------------
-
-
-    // ------------------------------------------
-    // Update counters, check prediction
-    cnt_instr++;
-    if (isControlFlow) {
-        cnt_branches++; 
-        if (brTaken)
-            cnt_branches_taken++;
-    }
-
-    if (predictDir == brTaken) { // Correct prediction of branch direction
-        correctDir = true;
-        if (isControlFlow) {
-            cnt_correctPredDir++; // Count correct predictions for actual branches
+                   bool isIndirect,
+                   bool isControlFlow,
+                   UINT32 slot)
+{
+    if (td->traceWriter != NULL && isControlFlow)
+        RecordBranch(td, PC, targetPC, brTaken, size, isCall, isReturn, isIndirect);
+    if (td->queue != NULL)
+        EnqueueBranch(td, PC, targetPC, brTaken, size, isCall, isReturn, isIndirect,
+                      isControlFlow, slot);
+    else {
+        td->sim.cnt_instr = td->cnt_instr;
+        SimulateBranch(td->sim, PC, targetPC, brTaken, size, isCall, isReturn, isIndirect,
+                       isControlFlow, slot);
+    }
+}
+
+/*!
+ * Process the control flow instruction of a basic block. The instruction
+ *  itself has already been counted by CountBlock.
+ * This function is called for every branch executed (default mode).
+ * @param[in]   td              data of the thread
+ * @param[in]   PC              address of current instruction
+ * @param[in]   targetPC        the next PC, **if taken**
+ * @param[in]   brTaken         the branch direction, 0 - not taken, 1 - taken
+ * @param[in]   size            the instruction size in bytes
+ * @param[in]   isCall          true if the instruction is a subroutine call
+ * @param[in]   isReturn        true if the instruction is a subroutine return
+ * @param[in]   isIndirect      true if the instruction is an indirect jump or call
+ * @param[in]   slot            profile slot of the branch, or NO_BRANCH_SLOT
+ */
+VOID ProcessBlockBranch(THREAD_DATA *td,
+                        ADDRINT PC,
+                        ADDRINT targetPC,
+                        bool brTaken,
+                        UINT32 size,
+                        bool isCall,
+                        bool isReturn,
+                        bool isIndirect,
+                        UINT32 slot)
+{
+    if (td->traceWriter != NULL)
+        RecordBranch(td, PC, targetPC, brTaken, size, isCall, isReturn, isIndirect);
+    if (td->queue != NULL)
+        EnqueueBranch(td, PC, targetPC, brTaken, size, isCall, isReturn, isIndirect, true, slot);
+    else {
+        td->sim.cnt_instr = td->cnt_instr;
+        SimulateBranch(td->sim, PC, targetPC, brTaken, size, isCall, isReturn, isIndirect, true, slot);
+    }
+}
+
+/*!
+ * Count the instructions of a basic block.
+ * Non-branch instructions never change the predictor state, so they only
+ *  need to be counted, once per block instead of once per instruction.
+ * This function is called for every basic block executed (default mode).
+ * @param[in]   td              data of the thread
+ * @param[in]   numIns          number of instructions in the block
+ */
+VOID PIN_FAST_ANALYSIS_CALL CountBlock(THREAD_DATA *td, UINT32 numIns)
+{
+    td->cnt_instr += numIns;
+}
+
+/*!
+ * Count the instructions of a basic block with sampling enabled.
+ * Inlined by PIN: ChangePhase runs only when this returns true.
+ * @param[in]   td              data of the thread
+ * @param[in]   numIns          number of instructions in the block
+ */
+ADDRINT PIN_FAST_ANALYSIS_CALL CountBlockSampled(THREAD_DATA *td, UINT32 numIns)
+{
+    td->cnt_instr += numIns;
+    return td->cnt_instr >= td->sampling.nextPhase;
+}
+
+/*!
+ * Move the thread to the phase of its instruction count.
+ * @param[in]   td              data of the thread
+ */
+VOID ChangePhase(THREAD_DATA *td)
+{
+    td->sampling.Advance(*schedule, td->cnt_instr);
+    if (td->queue == NULL)
+        td->sim.warming = (td->sampling.phase == PHASE_WARMUP);
+}
+
+/*!
+ * Guard of the branch analysis routines: false while fast-forwarding.
+ * @param[in]   td              data of the thread
+ */
+ADDRINT PIN_FAST_ANALYSIS_CALL IsSimulating(THREAD_DATA *td)
+{
+    return td->sampling.phase != PHASE_SKIP;
+}
+
+/* ===================================================================== */
+// Code filters (-include-img, -exclude-rtn, -include-range, ...)
+/* ===================================================================== */
+
+// Images and routines are resolved once, when their image is loaded, into
+// address regions. Instrumentation then looks up each basic block (each
+// instruction with -ins) and gives filtered out code no analysis calls:
+// its instructions and branches are neither counted nor simulated.
+
+// A region [start, end) of loaded code and whether it is simulated
+struct CODE_REGION {
+    ADDRINT end;
+    bool simulated;
+};
+
+typedef std::map<ADDRINT, CODE_REGION> CODE_REGIONS;   // by start address
+
+struct ADDRESS_RANGE {
+    ADDRINT start;
+    ADDRINT end;        // exclusive
+};
+
+static bool filtering = false;          // any filter given
+static bool includeImages;              // -include-img given
+static CODE_REGIONS imageRegions;       // every loaded image
+static CODE_REGIONS routineRegions;     // routines of the simulated images, with -*-rtn
+static bool simulateOutsideImages;      // code of no image (JIT stubs, vDSO)
+static std::vector<std::regex> includeRoutines;
+static std::vector<std::regex> excludeRoutines;
+static std::vector<ADDRESS_RANGE> includeRanges;
+static std::vector<ADDRESS_RANGE> excludeRanges;
+
+// Static code seen by the instrumentation, and how much of it was filtered out
+static UINT64 cnt_staticIns = 0;
+static UINT64 cnt_staticBranches = 0;
+static UINT64 cnt_filteredIns = 0;
+static UINT64 cnt_filteredBranches = 0;
+static std::vector<std::string> filteredImages;
+static std::unordered_set<ADDRINT> staticPCs;   // instructions counted already
+
+/*!
+ * Count an instrumented instruction once: PIN instruments it again after a
+ * code cache flush, and in every trace that overlaps it.
+ * @param[in]   ins             instruction being instrumented
+ * @param[in]   filtered        true if it is not simulated
+ */
+static VOID CountStaticIns(INS ins, bool filtered)
+{
+    if (!staticPCs.insert(INS_Address(ins)).second)
+        return;
+    bool branch = INS_IsBranchOrCall(ins);
+    cnt_staticIns++;
+    cnt_staticBranches += branch;
+    if (filtered) {
+        cnt_filteredIns++;
+        cnt_filteredBranches += branch;
+    }
+}
+
+/*!
+ * Parse the values of an address range KNOB. Exits on malformed ranges.
+ * @param[in]   knob            -include-range or -exclude-range
+ * @param[out]  ranges          parsed ranges
+ */
+static VOID ParseRanges(KNOB<string> &knob, std::vector<ADDRESS_RANGE> &ranges)
+{
+    for (UINT32 i = 0; i < knob.NumberOfValues(); i++) {
+        const std::string &value = knob.Value(i);
+        if (value.empty())
+            continue;
+        const char *text = value.c_str();
+        char *dash, *end;
+        ADDRESS_RANGE range;
+        range.start = strtoull(text, &dash, 0);
+        range.end = (*dash == '-') ? strtoull(dash + 1, &end, 0) : 0;
+        if (*dash != '-' || *end != '\0' || range.end <= range.start) {
+            cerr << "ERROR: address range " << value << " is not start-end" << endl;
+            exit(-1);
         }
+        ranges.push_back(range);
     }
+}
 
-    if (brTaken) { // brach was actually taken
-        if (predictPC == targetPC) { // Target predicted
-            correctTarg = true;
-            if (isControlFlow) {
-                cnt_correctPredTarg++;
-            }
+/*!
+ * Compile the values of a routine regex KNOB. Exits on invalid expressions.
+ * @param[in]   knob            -include-rtn or -exclude-rtn
+ * @param[out]  patterns        compiled expressions
+ */
+static VOID ParseRoutines(KNOB<string> &knob, std::vector<std::regex> &patterns)
+{
+    for (UINT32 i = 0; i < knob.NumberOfValues(); i++) {
+        const std::string &value = knob.Value(i);
+        if (value.empty())
+            continue;
+        try {
+            patterns.push_back(std::regex(value, std::regex::extended | std::regex::nosubs));
+        } catch (const std::regex_error &) {
+            cerr << "ERROR: routine filter " << value << " is not a regular expression" << endl;
+            exit(-1);
         }
-    } else { // not actually taken
-        if (predictPC == fallThroughAddr) {
-            correctTarg = true;
-            if (isControlFlow) {
-                cnt_correctPredTarg++;
-            }
+    }
+}
+
+/*!
+ * True if the KNOB was given a non-empty value.
+ * @param[in]   knob            -include-img or -exclude-img
+ */
+static bool HasValues(KNOB<string> &knob)
+{
+    for (UINT32 i = 0; i < knob.NumberOfValues(); i++) {
+        if (!knob.Value(i).empty())
+            return true;
+    }
+    return false;
+}
+
+/*!
+ * Read the filter KNOBs. Returns true if any filter was given.
+ */
+static bool SetupFilters()
+{
+    ParseRanges(KnobIncludeRange, includeRanges);
+    ParseRanges(KnobExcludeRange, excludeRanges);
+    ParseRoutines(KnobIncludeRoutine, includeRoutines);
+    ParseRoutines(KnobExcludeRoutine, excludeRoutines);
+    includeImages = HasValues(KnobIncludeImage);
+    simulateOutsideImages = !includeImages && includeRoutines.empty();
+    return includeImages || HasValues(KnobExcludeImage)
+           || !includeRoutines.empty() || !excludeRoutines.empty()
+           || !includeRanges.empty() || !excludeRanges.empty();
+}
+
+/*!
+ * True if name contains one of the non-empty values of knob.
+ * @param[in]   knob            -include-img or -exclude-img
+ * @param[in]   name            image name
+ */
+static bool MatchesImage(KNOB<string> &knob, const std::string &name)
+{
+    for (UINT32 i = 0; i < knob.NumberOfValues(); i++) {
+        const std::string &value = knob.Value(i);
+        if (!value.empty() && name.find(value) != std::string::npos)
+            return true;
+    }
+    return false;
+}
+
+/*!
+ * True if name matches one of patterns.
+ * @param[in]   patterns        compiled routine filters
+ * @param[in]   name            routine name
+ */
+static bool MatchesRoutine(const std::vector<std::regex> &patterns, const std::string &name)
+{
+    for (UINT32 i = 0; i < patterns.size(); i++) {
+        if (std::regex_search(name, patterns[i]))
+            return true;
+    }
+    return false;
+}
+
+/*!
+ * Region of regions holding address, or NULL.
+ * @param[in]   regions         non-overlapping regions
+ * @param[in]   address         code address
+ */
+static const CODE_REGION* FindRegion(const CODE_REGIONS &regions, ADDRINT address)
+{
+    CODE_REGIONS::const_iterator it = regions.upper_bound(address);
+    if (it == regions.begin())
+        return NULL;
+    --it;
+    return (address < it->second.end) ? &it->second : NULL;
+}
+
+/*!
+ * True if the code at address is simulated by the filters.
+ * Called at instrumentation time only.
+ * @param[in]   address         code address
+ */
+static bool IsSimulatedCode(ADDRINT address)
+{
+    bool inRange = includeRanges.empty();
+    for (UINT32 i = 0; i < includeRanges.size(); i++)
+        inRange |= (address >= includeRanges[i].start && address < includeRanges[i].end);
+    for (UINT32 i = 0; i < excludeRanges.size(); i++)
+        inRange &= !(address >= excludeRanges[i].start && address < excludeRanges[i].end);
+    if (!inRange)
+        return false;
+
+    const CODE_REGION *image = FindRegion(imageRegions, address);
+    if (image == NULL)
+        return simulateOutsideImages;
+    if (!image->simulated)
+        return false;
+    const CODE_REGION *routine = FindRegion(routineRegions, address);
+    return (routine != NULL) ? routine->simulated : includeRoutines.empty();
+}
+
+/*!
+ * Resolve the filters for the image and its routines.
+ * This function is called every time an image is loaded.
+ * @param[in]   img      loaded image
+ * @param[in]   v        value specified by the tool in the IMG_AddInstrumentFunction
+ *                       function call
+ */
+VOID ImageLoad(IMG img, VOID *v)
+{
+    const std::string &name = IMG_Name(img);
+    CODE_REGION region;
+    region.end = IMG_HighAddress(img) + 1;
+    region.simulated = (!includeImages || MatchesImage(KnobIncludeImage, name))
+                       && !MatchesImage(KnobExcludeImage, name);
+    imageRegions[IMG_LowAddress(img)] = region;
+    if (!region.simulated) {
+        filteredImages.push_back(name.substr(name.find_last_of('/') + 1));
+        return;
+    }
+
+    if (includeRoutines.empty() && excludeRoutines.empty())
+        return;
+    for (SEC sec = IMG_SecHead(img); SEC_Valid(sec); sec = SEC_Next(sec)) {
+        for (RTN rtn = SEC_RtnHead(sec); RTN_Valid(rtn); rtn = RTN_Next(rtn)) {
+            const std::string &routine = RTN_Name(rtn);
+            CODE_REGION code;
+            code.end = RTN_Address(rtn) + RTN_Size(rtn);
+            code.simulated = (includeRoutines.empty() || MatchesRoutine(includeRoutines, routine))
+                             && !MatchesRoutine(excludeRoutines, routine);
+            routineRegions[RTN_Address(rtn)] = code;
         }
     }
-    if (correctTarg && correctDir && isControlFlow)
-        cnt_correctPred++;
-    // ------------------------------------------
-
-    // ------------------------------------------
-    if (isControlFlow) {
-        // Update the state of the predictor:  (@ execute stage only)
-        myBPU->UpdatePredictor(
-                PC,               // address of instruction executing now
-                brTaken,          // the actual direction
-                targetPC,         // the next PC, **if taken**
-                fallThroughAddr,  // return address for subroutine calls,
-                //     DO NOT STORE IN BTB!
-                isCall,           // is a subroutine call
-                isReturn,         // is a return from subroutine
-                correctDir,       // my direction prediction was correct
-                correctTarg       // my target prediction was correct
-        );
-        
-        //extra statistics
-        //////////////////////////////////////////////////////////////////////////////
-        //if (isCall){isCallCounter++;}
-        //if (isReturn && correctTarg){isReturnCounter++;}
-        /////////////////////////////////////////////////////////////////////////////
-    }
-    // ------------------------------------------
+}
+
+/*!
+ * Forget the regions of an unloaded image: its addresses may be reused.
+ * This function is called every time an image is unloaded.
+ * @param[in]   img      unloaded image
+ * @param[in]   v        value specified by the tool in the IMG_AddUnloadFunction
+ *                       function call
+ */
+VOID ImageUnload(IMG img, VOID *v)
+{
+    ADDRINT low = IMG_LowAddress(img);
+    ADDRINT high = IMG_HighAddress(img);
+    imageRegions.erase(low);
+    routineRegions.erase(routineRegions.lower_bound(low), routineRegions.upper_bound(high));
+}
+
+/*!
+ * Print the static code filtered out (-include-img, ...).
+ * @param[in]   out             output stream
+ */
+VOID ReportFilters(std::ostream &out)
+{
+    out << "Filtered out (static): " << cnt_filteredIns << " of " << cnt_staticIns
+        << " instrumented instructions, " << cnt_filteredBranches << " of "
+        << cnt_staticBranches << " branches" << endl;
+    if (!filteredImages.empty()) {
+        out << " Images:";
+        for (UINT32 i = 0; i < filteredImages.size(); i++)
+            out << " " << filteredImages[i];
+        out << endl;
+    }
 }
 
 /* ===================================================================== */
@@ -456,38 +762,289 @@ VOID ProcessBranch(ADDRINT PC,
 /* ===================================================================== */
 
 /*!
- * Insert call to the analysis routine before every branch instruction
- * of the trace.
- * This function is called every time a new trace is encountered.
- * @param[in]   trace    trace to be instrumented
- * @param[in]   v        value specified by the tool in the TRACE_AddInstrumentFunction
+ * Profile slot of a branch (-topn), named after its routine and image
+ *  the first time it is instrumented. NO_BRANCH_SLOT without -topn.
+ * Instrumentation is serialized by PIN, so no lock is needed.
+ * @param[in]   ins      branch instruction
+ */
+UINT32 BranchSlot(INS ins)
+{
+    if (KnobTopN.Value() == 0)
+        return NO_BRANCH_SLOT;
+    bool added;
+    ADDRINT PC = INS_Address(ins);
+    UINT32 slot = sites.Add(PC, added);
+    if (added && slot != NO_BRANCH_SLOT) {
+        sites.routines[slot] = RTN_FindNameByAddress(PC);
+        IMG img = IMG_FindByAddress(PC);
+        if (IMG_Valid(img)) {
+            const std::string &name = IMG_Name(img);
+            sites.images[slot] = name.substr(name.find_last_of('/') + 1);
+        }
+    }
+    return slot;
+}
+
+/*!
+ * Indirect jump or call: its target comes from a register or memory.
+ * Returns are indirect too, but are predicted by the RAS.
+ * @param[in]   ins      branch instruction
+ */
+BOOL IsIndirectBranch(INS ins)
+{
+    return INS_IsIndirectControlFlow(ins) && !INS_IsRet(ins);
+}
+
+/*!
+ * Insert call to the analysis routine before every instruction (-ins mode).
+ * This function is called every time a new instruction is encountered.
+ * @param[in]   ins      instruction to be instrumented
+ * @param[in]   v        value specified by the tool in the INS_AddInstrumentFunction
  *                       function call
  */
 VOID Instruction(INS ins, VOID *v)
 {
+    if (filtering) {
+        bool simulated = IsSimulatedCode(INS_Address(ins));
+        CountStaticIns(ins, !simulated);
+        if (!simulated)
+            return;
+    }
+
+    // In fetch-block mode the other instructions are only counted: their
+    // block is looked up once, at its branch
+    bool simulate = INS_IsBranchOrCall(ins) || KnobFetchBlock.Value() == 0;
+
+    // With sampling the instruction is counted first, and simulated only
+    // if the thread is not fast-forwarding
+    VOID (*insertCall)(INS, IPOINT, AFUNPTR, ...) = INS_InsertCall;
+    if (schedule->Enabled()) {
+        INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR) CountBlockSampled,
+                         IARG_FAST_ANALYSIS_CALL,
+                         IARG_REG_VALUE, threadDataReg,
+                         IARG_UINT32, 1,
+                         IARG_END);
+        INS_InsertThenCall(ins, IPOINT_BEFORE, (AFUNPTR) ChangePhase,
+                           IARG_REG_VALUE, threadDataReg,
+                           IARG_END);
+        if (simulate) {
+            INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR) IsSimulating,
+                             IARG_FAST_ANALYSIS_CALL,
+                             IARG_REG_VALUE, threadDataReg,
+                             IARG_END);
+            insertCall = INS_InsertThenCall;
+        }
+    } else {
+        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR) CountBlock,
+                       IARG_FAST_ANALYSIS_CALL,
+                       IARG_REG_VALUE, threadDataReg,
+                       IARG_UINT32, 1,
+                       IARG_END);
+    }
+
     if (INS_IsBranchOrCall(ins)) {   // Branch or call. Includes returns
-        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR) ProcessBranch,
+        insertCall(ins, IPOINT_BEFORE, (AFUNPTR) ProcessBranch,
+                       IARG_REG_VALUE, threadDataReg, // THREAD_DATA of the thread
                        IARG_INST_PTR,                 // The instruction address
                        IARG_BRANCH_TARGET_ADDR,       // target address of the branch, or return address
                        IARG_BRANCH_TAKEN,             // taken branch (0 - not taken. BOOL)
                        IARG_UINT32,  INS_Size(ins),   // instr. size - used to calculare return address for subroutine calls
                        IARG_BOOL, INS_IsCall(ins),    // is this a subroutine call (BOOL)
                        IARG_BOOL, INS_IsRet(ins),     // is this a subroutine return (BOOL)
+                       IARG_BOOL, IsIndirectBranch(ins), // is this an indirect jump or call (BOOL)
                        IARG_BOOL, INS_IsBranchOrCall(ins),
+                       IARG_UINT32, BranchSlot(ins),  // profile slot (-topn)
                        IARG_END);
-    } else {   //  not a flow-control instruction
-        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR) ProcessBranch,
+    } else if (simulate) {   //  not a flow-control instruction
+        insertCall(ins, IPOINT_BEFORE, (AFUNPTR) ProcessBranch,
+                       IARG_REG_VALUE, threadDataReg, // THREAD_DATA of the thread
                        IARG_INST_PTR,                 // The instruction address
                        IARG_ADDRINT, (ADDRINT) 0,     // target address of the branch, or return address
                        IARG_BOOL, false,              // taken branch (0 - not taken. BOOL)
                        IARG_UINT32,  INS_Size(ins),   // instr. size - used to calculare return address for subroutine calls
                        IARG_BOOL, INS_IsCall(ins),    // is this a subroutine call (BOOL)
                        IARG_BOOL, INS_IsRet(ins),     // is this a subroutine return (BOOL)
+                       IARG_BOOL, false,              // is this an indirect jump or call (BOOL)
                        IARG_BOOL, INS_IsBranchOrCall(ins),
+                       IARG_UINT32, NO_BRANCH_SLOT,
                        IARG_END);
     }
 }
 
+/*!
+ * Insert a call that counts the instructions of every basic block of the
+ * trace, and a call to the analysis routine before every branch instruction.
+ * This function is called every time a new trace is encountered.
+ * @param[in]   trace    trace to be instrumented
+ * @param[in]   v        value specified by the tool in the TRACE_AddInstrumentFunction
+ *                       function call
+ */
+VOID Trace(TRACE trace, VOID *v)
+{
+    bool sampling = schedule->Enabled();
+    for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)) {
+        if (filtering) {
+            bool simulated = IsSimulatedCode(BBL_Address(bbl));
+            for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins))
+                CountStaticIns(ins, !simulated);
+            if (!simulated)
+                continue;
+        }
+
+        if (sampling) {
+            // Leave the fast path only at phase boundaries
+            BBL_InsertIfCall(bbl, IPOINT_BEFORE, (AFUNPTR) CountBlockSampled,
+                             IARG_FAST_ANALYSIS_CALL,
+                             IARG_REG_VALUE, threadDataReg, // THREAD_DATA of the thread
+                             IARG_UINT32, BBL_NumIns(bbl),  // instructions in the block
+                             IARG_END);
+            BBL_InsertThenCall(bbl, IPOINT_BEFORE, (AFUNPTR) ChangePhase,
+                               IARG_REG_VALUE, threadDataReg,
+                               IARG_END);
+        } else {
+            BBL_InsertCall(bbl, IPOINT_BEFORE, (AFUNPTR) CountBlock,
+                           IARG_FAST_ANALYSIS_CALL,
+                           IARG_REG_VALUE, threadDataReg, // THREAD_DATA of the thread
+                           IARG_UINT32, BBL_NumIns(bbl),  // instructions in the block
+                           IARG_END);
+        }
+
+        // Only the tail of a block can change control flow
+        for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins)) {
+            if (!INS_IsBranchOrCall(ins))
+                continue;
+            VOID (*insertCall)(INS, IPOINT, AFUNPTR, ...) = INS_InsertCall;
+            if (sampling) {
+                // Skipped regions run without calling the simulator
+                INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR) IsSimulating,
+                                 IARG_FAST_ANALYSIS_CALL,
+                                 IARG_REG_VALUE, threadDataReg,
+                                 IARG_END);
+                insertCall = INS_InsertThenCall;
+            }
+            insertCall(ins, IPOINT_BEFORE, (AFUNPTR) ProcessBlockBranch,
+                           IARG_REG_VALUE, threadDataReg, // THREAD_DATA of the thread
+                           IARG_INST_PTR,                 // The instruction address
+                           IARG_BRANCH_TARGET_ADDR,       // target address of the branch, or return address
+                           IARG_BRANCH_TAKEN,             // taken branch (0 - not taken. BOOL)
+                           IARG_UINT32,  INS_Size(ins),   // instr. size - used to calculare return address for subroutine calls
+                           IARG_BOOL, INS_IsCall(ins),    // is this a subroutine call (BOOL)
+                           IARG_BOOL, INS_IsRet(ins),     // is this a subroutine return (BOOL)
+                           IARG_BOOL, IsIndirectBranch(ins), // is this an indirect jump or call (BOOL)
+                           IARG_UINT32, BranchSlot(ins),  // profile slot (-topn)
+                           IARG_END);
+        }
+    }
+}
+
+/*!
+ * Create the BPUs and counters of a new application thread.
+ * This function is called every time a thread starts.
+ * @param[in]   tid      id of the new thread
+ * @param[in]   ctxt     initial register state of the thread
+ * @param[in]   flags    OS specific thread flags
+ * @param[in]   v        value specified by the tool in the
+ *                       PIN_AddThreadStartFunction function call
+ */
+VOID ThreadStart(THREADID tid, CONTEXT *ctxt, INT32 flags, VOID *v)
+{
+    THREAD_DATA *td = (THREAD_DATA*) AllocateCacheAligned(sizeof(THREAD_DATA));
+
+    if (numWorkers > 0) {
+        UINT64 capacity = 1;
+        while (capacity < KnobQueueSize.Value())
+            capacity <<= 1;
+        td->queue = (BRANCH_QUEUE*) AllocateCacheAligned(sizeof(BRANCH_QUEUE));
+        td->queue->events = (BRANCH_EVENT*) AllocateCacheAligned(capacity*sizeof(BRANCH_EVENT));
+        td->queue->mask = capacity - 1;
+    }
+
+    PIN_GetLock(&threadsLock, tid+1);
+    bool newBTBs = (sharedBTBs == NULL || sharedBTBs[0] == NULL);
+    CreateBPUs(td->sim, sharedBTBs);
+    if (loadState != NULL)
+        LoadBPUState(*loadState, td->sim, newBTBs);
+    if (live != NULL && !live->IsOpen() && !live->Open(KnobLive.Value(), LiveNames(td->sim)))
+        PIN_ExitProcess(-1);
+    threads.push_back(td);
+    __atomic_store_n(&numThreads, threads.size(), __ATOMIC_RELEASE);
+    PIN_ReleaseLock(&threadsLock);
+
+    // Thread 0 records to the -record file, thread N to <file>.N
+    if (!KnobRecordFile.Value().empty()) {
+        std::ostringstream name;
+        name << KnobRecordFile.Value();
+        if (tid != 0)
+            name << "." << tid;
+        td->traceWriter = new TRACE_WRITER();
+        if (!td->traceWriter->Open(name.str())) {
+            cerr << "ERROR: cannot open trace file " << name.str() << endl;
+            PIN_ExitProcess(-1);
+        }
+    }
+
+    td->sampling.Start(*schedule);
+    td->sim.warming = (td->sampling.phase == PHASE_WARMUP);
+
+    PIN_SetThreadData(tlsKey, td, tid);
+    PIN_SetContextReg(ctxt, threadDataReg, (ADDRINT) td);
+}
+
+/*!
+ * Close the branch trace of an exiting thread. Its counters are kept
+ *  until Fini.
+ * This function is called every time a thread exits.
+ * @param[in]   tid      id of the thread
+ * @param[in]   ctxt     register state of the thread
+ * @param[in]   code     exit code of the thread
+ * @param[in]   v        value specified by the tool in the
+ *                       PIN_AddThreadFiniFunction function call
+ */
+VOID ThreadFini(THREADID tid, const CONTEXT *ctxt, INT32 code, VOID *v)
+{
+    THREAD_DATA *td = (THREAD_DATA*) PIN_GetThreadData(tlsKey, tid);
+    if (td->traceWriter != NULL) {
+        td->traceWriter->Close(td->cnt_instr - td->cnt_instr_recorded);
+        td->traceWriter = NULL;
+    }
+}
+
+/*!
+ * Stop the workers once they have drained every queue, and the -live
+ *  publisher. Internal threads cannot be waited for in Fini.
+ * This function is called when the application starts to exit.
+ * @param[in]   v               value specified by the tool in the
+ *                              PIN_AddPrepareForFiniFunction function call
+ */
+VOID PrepareForFini(VOID *v)
+{
+    __atomic_store_n(&stopWorkers, true, __ATOMIC_RELEASE);
+    for (UINT32 w = 0; w < numWorkers; w++)
+        PIN_WaitForThreadTermination(workerUids[w], PIN_INFINITE_TIMEOUT, NULL);
+    __atomic_store_n(&workersStopped, true, __ATOMIC_RELEASE);
+
+    if (live != NULL) {
+        __atomic_store_n(&stopLive, true, __ATOMIC_RELEASE);
+        PIN_WaitForThreadTermination(liveUid, PIN_INFINITE_TIMEOUT, NULL);
+    }
+}
+
+/*!
+ * Print the producer stalls and queue occupancy of every thread (-workers).
+ * @param[in]   out             output stream
+ */
+VOID ReportQueues(std::ostream &out)
+{
+    out << "Workers: " << numWorkers << ", queue: "
+        << threads[0]->queue->mask + 1 << " events per thread" << endl;
+    for (UINT32 i = 0; i < threads.size(); i++) {
+        BRANCH_QUEUE *q = threads[i]->queue;
+        out << " Thread " << i
+            << " stalls: " << q->stalls << " (" << q->stallNanos / 1000000.0 << " ms)"
+            << " occupancy: avg " << (q->batches ? q->occupancySum / q->batches : 0)
+            << " max " << q->occupancyMax << endl;
+    }
+}
 
 /*!
  * Print out analysis results.
@@ -502,29 +1059,59 @@ VOID Fini(INT32 code, VOID *v)
     *outFile <<  "===================================================" << endl;
     *outFile <<  "This application is instrumented by BTBsim PIN tool" << endl;
 
-    *outFile << "Instructions: " << cnt_instr << endl;
-    *outFile << "Branches: " << cnt_branches << endl;
-    *outFile << " taken: " << cnt_branches_taken << "(" << cnt_branches_taken*100.0/cnt_branches << "%)" << endl;
-    *outFile << " Predicted (direction & target): " << cnt_correctPred << "(" << cnt_correctPred*100.0 /cnt_branches << "%)" << endl;
-    *outFile << " Predicted direction: " << cnt_correctPredDir << "(" << cnt_correctPredDir*100.0 /cnt_branches << "%)" << endl;
-    *outFile << " Predicted target: " << cnt_correctPredTarg << "(" << cnt_correctPredTarg*100.0 /cnt_branches << "%)" << endl;
-    
-    // -------------------------------------------
-    //  Output any extra counters/statistics here
-    // -------------------------------------------
-    /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-    //*outFile << "\n Calls: " << isCallCounter  << endl;
-    //*outFile << " Correct TargetPredicted Returns: " << isReturnCounter << endl;
-	/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    // Simulate whatever the workers left behind
+    for (UINT32 i = 0; i < threads.size(); i++) {
+        THREAD_DATA *td = threads[i];
+        if (td->queue != NULL)
+            DrainQueue(td);
+        td->sim.cnt_instr = td->cnt_instr;
+        td->sim.cnt_instr_detail = td->sampling.Detailed(td->cnt_instr);
+        FinishIntervals(td->sim);
+    }
 
+    // Last live snapshot, before the counters are merged
+    if (live != NULL && live->IsOpen())
+        PublishLive(true);
 
-    //  Report any predictor internal counters
-    std::string s = myBPU->ReportCounters();
-    if (!s.empty())
-        *outFile << s;
+    // Predictor state of the first thread (and the shared BTBs)
+    if (!KnobSaveState.Value().empty())
+        SaveBPUState(KnobSaveState.Value(), threads[0]->sim);
+
+    // Interval series of every thread, before they are merged
+    if (KnobInterval.Value() > 0) {
+        std::vector<SIM_STATE*> streams;
+        for (UINT32 i = 0; i < threads.size(); i++)
+            streams.push_back(&threads[i]->sim);
+        const std::string &name = KnobIntervalFile.Value();
+        bool json = name.size() >= 5 && name.compare(name.size() - 5, 5, ".json") == 0;
+        std::ofstream intervalFile(name.c_str());
+        WriteIntervals(intervalFile, json, streams);
+    }
+
+    // Merge the counters of all threads into the first one
+    SIM_STATE &total = threads[0]->sim;
+    for (UINT32 i = 1; i < threads.size(); i++)
+        MergeResults(total, threads[i]->sim, sites.Size());
+    if (threads.size() > 1)
+        *outFile << "Threads: " << threads.size()
+                 << (KnobSharedBTB.Value() ? " (shared BTB)" : "") << endl;
+    if (numWorkers > 0)
+        ReportQueues(*outFile);
+    if (filtering)
+        ReportFilters(*outFile);
+
+    ReportResults(*outFile, total);
+    ReportBranchProfile(*outFile, total, sites);
 
     *outFile <<  "===================================================" << endl;
     outFile->close();
+
+    // Threads still running at exit did not close their traces
+    for (UINT32 i = 0; i < threads.size(); i++) {
+        THREAD_DATA *td = threads[i];
+        if (td->traceWriter != NULL)
+            td->traceWriter->Close(td->cnt_instr - td->cnt_instr_recorded);
+    }
 }
 
 /*!
@@ -550,10 +1137,80 @@ int main(int argc, char * argv[])
     }
     outFile = new std::ofstream(fileName.c_str());
 
-    myBPU = new BPU(); // Initialise Branch Prediction Unit
+    // Fast-forward, warm-up and detailed windows
+    schedule = new SAMPLING_SCHEDULE();
 
-    // Register Instruction to be called to instrument instructions
-    INS_AddInstrumentFunction(Instruction, 0);
+    // Warmed predictors to start from
+    if (!KnobLoadState.Value().empty()) {
+        loadState = new STATE_READER();
+        if (!loadState->Open(KnobLoadState.Value()))
+            exit(-1);
+    }
+
+    // Images and routines to simulate, resolved as images load
+    filtering = SetupFilters();
+    if (filtering) {
+        IMG_AddInstrumentFunction(ImageLoad, 0);
+        IMG_AddUnloadFunction(ImageUnload, 0);
+    }
+
+    // Routine names for the -topn report and the routine filters
+    if (KnobTopN.Value() > 0 || !includeRoutines.empty() || !excludeRoutines.empty())
+        PIN_InitSymbols();
+
+    // Every thread gets its own Branch Prediction Units in ThreadStart
+    PIN_InitLock(&threadsLock);
+    tlsKey = PIN_CreateThreadDataKey(NULL);
+    threadDataReg = PIN_ClaimToolRegister();
+    if (!REG_valid(threadDataReg)) {
+        cerr << "ERROR: no tool register left for the thread data";
+        exit(-1);
+    }
+    if (KnobSharedBTB.Value()) {
+        UINT32 n = NumberOfConfigurations();
+        sharedBTBs = new BTB*[n];
+        for (UINT32 i = 0; i < n; i++)
+            sharedBTBs[i] = NULL;
+    }
+    PIN_AddThreadStartFunction(ThreadStart, 0);
+    PIN_AddThreadFiniFunction(ThreadFini, 0);
+
+    // Decoupled simulation: the application threads only queue branches.
+    // A shared BTB would make results depend on worker interleaving.
+    numWorkers = KnobWorkers.Value();
+    if (numWorkers > 0) {
+        if (KnobSharedBTB.Value()) {
+            cerr << "ERROR: -workers cannot be combined with -sharedbtb";
+            exit(-1);
+        }
+        workerUids = new PIN_THREAD_UID[numWorkers];
+        for (UINT32 w = 0; w < numWorkers; w++) {
+            if (PIN_SpawnInternalThread(Worker, (VOID*)(ADDRINT) w, 0, &workerUids[w])
+                == INVALID_THREADID) {
+                cerr << "ERROR: cannot create worker thread";
+                exit(-1);
+            }
+        }
+    }
+
+    // Live counters, published by a tool thread of their own
+    if (!KnobLive.Value().empty()) {
+        live = new LIVE_WRITER();
+        if (PIN_SpawnInternalThread(LivePublisher, NULL, 0, &liveUid) == INVALID_THREADID) {
+            cerr << "ERROR: cannot create live counters thread";
+            exit(-1);
+        }
+    }
+    if (numWorkers > 0 || live != NULL)
+        PIN_AddPrepareForFiniFunction(PrepareForFini, 0);
+
+    if (KnobPerInstruction.Value()) {
+        // Register Instruction to be called to instrument instructions
+        INS_AddInstrumentFunction(Instruction, 0);
+    } else {
+        // Register Trace to be called to instrument basic blocks
+        TRACE_AddInstrumentFunction(Trace, 0);
+    }
 
     // Register Fini to be called when the application exits
     PIN_AddFiniFunction(Fini, 0);
@@ -0,0 +1,4144 @@
+//Tsalesis Evangelos
+//AM: 1779
+/*! @file
+ *  Branch Prediction Unit simulator core, shared by the PIN tool (bpu.cpp)
+ *  and the standalone tools. Include pin.H (or pin_shim.h outside PIN)
+ *  before this file. Each tool includes it from exactly one source file.
+ */
+
+#ifndef BPU_H
+#define BPU_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "live.h"
+
+/* ===================================================================== */
+// Command line switches
+/* ===================================================================== */
+KNOB<UINT32> KnobMispredRate(KNOB_MODE_WRITEONCE, "pintool",
+    "mpr", "20", "specify direction misprediction rate for BTB simulator");
+
+// Add your KNOBs here
+// -btbs, -btba, -tags, -ras and -repl may be repeated: every combination of their
+// values is simulated by its own BPU in the same run
+///////////////////////////////////////////////////////////
+KNOB<UINT64> KnobBTBsize(KNOB_MODE_APPEND, "pintool",
+    "btbs", "1024", "specify BTB size (may be repeated)");
+
+KNOB<UINT64> KnobBTBassoc(KNOB_MODE_APPEND, "pintool",
+    "btba", "4", "specify BTB associativity (may be repeated)");
+
+KNOB<UINT64> KnobBTBTagSize(KNOB_MODE_APPEND, "pintool",
+    "tags", "12", "specify BTB tag size (may be repeated)");
+
+KNOB<UINT64> KnobRASsize(KNOB_MODE_APPEND, "pintool",
+    "ras", "10", "specify RAS size (may be repeated)");
+
+KNOB<string> KnobBTBRepl(KNOB_MODE_APPEND, "pintool",
+    "repl", "fifo", "specify BTB replacement policy: fifo, lru, plru, srrip, brrip, random (may be repeated)");
+
+KNOB<UINT32> KnobTargetBits(KNOB_MODE_WRITEONCE, "pintool",
+    "tgtbits", "0", "store BTB targets as this many offset bits and a region table index (0 = full targets)");
+
+KNOB<UINT32> KnobRegions(KNOB_MODE_WRITEONCE, "pintool",
+    "regions", "64", "specify entries of the target region table of every BTB (with -tgtbits)");
+
+KNOB<UINT32> KnobBudgetKB(KNOB_MODE_WRITEONCE, "pintool",
+    "budget-kb", "0", "size the BTB to the most entries that fit this storage budget in KB, instead of -btbs (0 = off)");
+
+KNOB<BOOL> KnobBTBStorage(KNOB_MODE_WRITEONCE, "pintool",
+    "storage", "0", "bit-accurate BTB storage mode: report bits and false hits of partial tags (implied by -tgtbits, -budget-kb)");
+
+KNOB<string> KnobRASMode(KNOB_MODE_WRITEONCE, "pintool",
+    "rasmode", "circular", "specify RAS recovery: circular (none), repair (top checkpoint), linked");
+
+KNOB<BOOL> KnobRASFromBTB(KNOB_MODE_WRITEONCE, "pintool",
+    "rasbtb", "0", "recognise calls and returns by their BTB entry only, not by predecode");
+
+KNOB<string> KnobDirPredictor(KNOB_MODE_WRITEONCE, "pintool",
+    "dp", "random", "specify direction predictor: random, bimodal, gshare, tage, perceptron");
+
+KNOB<UINT32> KnobBimodalSize(KNOB_MODE_WRITEONCE, "pintool",
+    "bims", "12", "specify log2 of bimodal predictor entries");
+
+KNOB<UINT32> KnobGshareSize(KNOB_MODE_WRITEONCE, "pintool",
+    "gshs", "14", "specify log2 of gshare predictor entries");
+
+KNOB<UINT32> KnobGshareHistory(KNOB_MODE_WRITEONCE, "pintool",
+    "gshh", "14", "specify gshare global history length");
+
+KNOB<UINT32> KnobTageTables(KNOB_MODE_WRITEONCE, "pintool",
+    "tagen", "7", "specify number of TAGE tagged tables");
+
+KNOB<UINT32> KnobTageSize(KNOB_MODE_WRITEONCE, "pintool",
+    "tages", "10", "specify log2 of entries per TAGE tagged table");
+
+KNOB<UINT32> KnobTageTagSize(KNOB_MODE_WRITEONCE, "pintool",
+    "taget", "9", "specify TAGE tag size");
+
+KNOB<UINT32> KnobTageMinHistory(KNOB_MODE_WRITEONCE, "pintool",
+    "tagehmin", "4", "specify shortest TAGE history length");
+
+KNOB<UINT32> KnobTageMaxHistory(KNOB_MODE_WRITEONCE, "pintool",
+    "tagehmax", "640", "specify longest TAGE history length");
+
+KNOB<UINT32> KnobPerceptronTables(KNOB_MODE_WRITEONCE, "pintool",
+    "percn", "8", "specify number of hashed perceptron weight tables");
+
+KNOB<UINT32> KnobPerceptronSize(KNOB_MODE_WRITEONCE, "pintool",
+    "percs", "10", "specify log2 of weights per hashed perceptron table");
+
+KNOB<UINT32> KnobPerceptronHistory(KNOB_MODE_WRITEONCE, "pintool",
+    "perch", "64", "specify hashed perceptron global history length (max 64)");
+
+KNOB<string> KnobIndirectPredictor(KNOB_MODE_WRITEONCE, "pintool",
+    "ind", "btb", "specify indirect target predictor: btb (BTB only), ittage");
+
+KNOB<UINT32> KnobIndirectTables(KNOB_MODE_WRITEONCE, "pintool",
+    "indn", "4", "specify number of ITTAGE tagged tables");
+
+KNOB<UINT32> KnobIndirectSize(KNOB_MODE_WRITEONCE, "pintool",
+    "inds", "9", "specify log2 of entries per ITTAGE tagged table");
+
+KNOB<UINT32> KnobIndirectMaxHistory(KNOB_MODE_WRITEONCE, "pintool",
+    "indhmax", "64", "specify longest ITTAGE history length (2 bits per branch)");
+
+KNOB<UINT64> KnobBTBL0Size(KNOB_MODE_WRITEONCE, "pintool",
+    "btbl0", "0", "specify entries of the fully associative L0 BTB (0 = none)");
+
+KNOB<UINT64> KnobBTBL2Size(KNOB_MODE_WRITEONCE, "pintool",
+    "btbl2", "0", "specify entries of the L2 BTB behind the -btbs BTB (0 = none)");
+
+KNOB<UINT64> KnobBTBL2Assoc(KNOB_MODE_WRITEONCE, "pintool",
+    "btbl2a", "8", "specify L2 BTB associativity");
+
+KNOB<UINT32> KnobL0Latency(KNOB_MODE_WRITEONCE, "pintool",
+    "lat0", "0", "fetch bubble cycles of a taken branch predicted by the L0 BTB");
+
+KNOB<UINT32> KnobL1Latency(KNOB_MODE_WRITEONCE, "pintool",
+    "lat1", "1", "fetch bubble cycles of a taken branch predicted by the -btbs BTB");
+
+KNOB<UINT32> KnobL2Latency(KNOB_MODE_WRITEONCE, "pintool",
+    "lat2", "4", "fetch bubble cycles of a taken branch predicted by the L2 BTB");
+
+KNOB<UINT32> KnobTargetPenalty(KNOB_MODE_WRITEONCE, "pintool",
+    "tpen", "6", "cycles lost by a direct branch target miss (redirected at decode)");
+
+KNOB<UINT32> KnobDirPenalty(KNOB_MODE_WRITEONCE, "pintool",
+    "dpen", "15", "cycles lost by a direction misprediction or indirect target miss");
+
+KNOB<UINT32> KnobRASPenalty(KNOB_MODE_WRITEONCE, "pintool",
+    "rpen", "15", "cycles lost by a mispredicted return");
+
+KNOB<UINT32> KnobFetchWidth(KNOB_MODE_WRITEONCE, "pintool",
+    "fetchw", "4", "instructions fetched per cycle by the front-end model");
+
+KNOB<UINT32> KnobFetchBlock(KNOB_MODE_WRITEONCE, "pintool",
+    "fetchblock", "0", "fetch-block mode: bytes of the aligned block fetched per cycle, with one BTB lookup per block (0 = off)");
+
+KNOB<UINT64> KnobInterval(KNOB_MODE_WRITEONCE, "pintool",
+    "interval", "0", "snapshot all counters every N instructions (0 = off)");
+
+KNOB<string> KnobIntervalFile(KNOB_MODE_WRITEONCE, "pintool",
+    "intervalo", "btb.intervals.csv", "specify file name for the -interval series (JSON if it ends in .json)");
+
+KNOB<UINT64> KnobSkip(KNOB_MODE_WRITEONCE, "pintool",
+    "skip", "0", "fast-forward this many instructions before simulating");
+
+KNOB<UINT64> KnobWarmup(KNOB_MODE_WRITEONCE, "pintool",
+    "warmup", "0", "train the predictors for this many instructions before every detailed window");
+
+KNOB<UINT64> KnobDetail(KNOB_MODE_WRITEONCE, "pintool",
+    "detail", "0", "simulate and count this many instructions per window (0 = until the end)");
+
+KNOB<UINT64> KnobPeriod(KNOB_MODE_WRITEONCE, "pintool",
+    "period", "0", "repeat the warm-up and detailed window every N instructions (0 = once)");
+
+KNOB<string> KnobSimPoints(KNOB_MODE_WRITEONCE, "pintool",
+    "simpoints", "", "specify SimPoint file (interval cluster) of the detailed windows");
+
+KNOB<UINT64> KnobSimPointLength(KNOB_MODE_WRITEONCE, "pintool",
+    "simpointlen", "100000000", "specify instructions per SimPoint interval");
+
+KNOB<UINT32> KnobTopN(KNOB_MODE_WRITEONCE, "pintool",
+    "topn", "0", "profile every static branch and report the N most mispredicted (0 = off)");
+
+KNOB<string> KnobLive(KNOB_MODE_WRITEONCE, "pintool",
+    "live", "", "publish live counters in this shared file for bpu_monitor, e.g. /dev/shm/bpu.live");
+
+KNOB<UINT32> KnobLivePeriod(KNOB_MODE_WRITEONCE, "pintool",
+    "live-period", "1000", "milliseconds between -live snapshots");
+
+KNOB<string> KnobSaveState(KNOB_MODE_WRITEONCE, "pintool",
+    "save-state", "", "save the predictor state of every BPU to this file at the end");
+
+KNOB<string> KnobLoadState(KNOB_MODE_WRITEONCE, "pintool",
+    "load-state", "", "start every BPU from the predictor state saved in this file");
+		
+///////////////////////////////////////////////////////////
+
+/* ===================================================================== */
+// Predictor state checkpoints (-save-state, -load-state)
+/* ===================================================================== */
+//A checkpoint holds the raw contents of every predictor structure, BPU by
+//BPU in creation order, so a warmed predictor is restored with one read of
+//the file and one copy per table:
+//
+//  STATE_FILE_HEADER
+//  per BPU: its configuration (checked on load), BTB section, L0 and L2
+//           BTB sections, RAS mode and stack, direction predictor,
+//           indirect predictor
+//
+//A BTB section ends with its target region table and, in storage mode, the
+//full PC of every way.
+//
+//Counters are not part of the state: a loaded BPU starts counting from zero.
+
+static const char STATE_MAGIC[8] = { 'B', 'P', 'U', 'S', 'T', 'A', 'T', 'E' };
+static const UINT32 STATE_VERSION = 7;   // 7: valid bits in TAGE and ITTAGE entries
+
+struct STATE_FILE_HEADER {
+    char magic[8];
+    UINT32 version;
+    UINT32 numBPUs;
+};
+
+/*!
+ * Collects a checkpoint in memory and writes it with a single write.
+ */
+class STATE_WRITER {
+std::vector<UINT8> buffer;
+
+public:
+VOID PutBytes(const VOID* p, size_t bytes)
+{
+    const UINT8* b = (const UINT8*) p;
+    buffer.insert(buffer.end(), b, b + bytes);
+}
+
+template <class T> VOID Put(const T& value) { PutBytes(&value, sizeof(T)); }
+template <class T> VOID PutArray(const T* p, UINT64 n) { PutBytes(p, n*sizeof(T)); }
+
+VOID PutString(const std::string& s)
+{
+    Put((UINT32) s.size());
+    PutBytes(s.data(), s.size());
+}
+
+// A section is prefixed with its size, so a reader may skip it
+size_t BeginSection()
+{
+    Put((UINT64) 0);
+    return buffer.size();
+}
+
+VOID EndSection(size_t start)
+{
+    UINT64 bytes = buffer.size() - start;
+    memcpy(&buffer[start - sizeof(bytes)], &bytes, sizeof(bytes));
+}
+
+bool Write(const std::string& fileName) const
+{
+    std::ofstream file(fileName.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+    file.write((const char*) &buffer[0], buffer.size());
+    return file.good();
+}
+};
+
+/*!
+ * Reads a whole checkpoint file at once and copies it out in order.
+ * Reads past the end copy nothing and clear Ok().
+ */
+class STATE_READER {
+std::vector<UINT8> buffer;
+size_t cursor;
+size_t sectionEnd;
+bool ok;
+
+public:
+STATE_READER() : cursor(0), sectionEnd(0), ok(false) {}
+
+/*!
+ * Read the checkpoint file. Prints the reason and returns false on failure.
+ */
+bool Open(const std::string& fileName)
+{
+    std::ifstream file(fileName.c_str(), std::ios::in | std::ios::binary);
+    if (!file) {
+        cerr << "ERROR: cannot open predictor state " << fileName << endl;
+        return false;
+    }
+    file.seekg(0, std::ios::end);
+    buffer.resize((size_t) file.tellg());
+    file.seekg(0);
+    if (buffer.size() < sizeof(STATE_FILE_HEADER)
+        || !file.read((char*) &buffer[0], buffer.size())) {
+        cerr << "ERROR: " << fileName << " is not a predictor state" << endl;
+        return false;
+    }
+    ok = true;
+    return true;
+}
+
+// Start again from the header, for the next thread
+VOID Rewind()
+{
+    cursor = 0;
+    ok = !buffer.empty();
+}
+
+bool Ok() const { return ok; }
+bool AtEnd() const { return cursor == buffer.size(); }
+
+bool GetBytes(VOID* p, size_t bytes)
+{
+    if (!ok || bytes > buffer.size() - cursor) {
+        ok = false;
+        return false;
+    }
+    memcpy(p, buffer.data() + cursor, bytes);
+    cursor += bytes;
+    return true;
+}
+
+template <class T> bool Get(T& value) { return GetBytes(&value, sizeof(T)); }
+template <class T> bool GetArray(T* p, UINT64 n) { return GetBytes(p, n*sizeof(T)); }
+
+bool GetString(std::string& s)
+{
+    UINT32 size;
+    if (!Get(size) || size > buffer.size() - cursor) {
+        ok = false;
+        return false;
+    }
+    s.assign((const char*) buffer.data() + cursor, size);
+    cursor += size;
+    return true;
+}
+
+VOID BeginSection()
+{
+    UINT64 bytes = 0;
+    Get(bytes);
+    sectionEnd = cursor + bytes;
+}
+
+// The section must have been read exactly
+VOID EndSection()
+{
+    if (cursor != sectionEnd)
+        ok = false;
+}
+
+VOID SkipSection()
+{
+    UINT64 bytes = 0;
+    if (Get(bytes) && bytes <= buffer.size() - cursor)
+        cursor += bytes;
+    else
+        ok = false;
+}
+};
+
+/* ===================================================================== */
+// Direction predictors
+/* ===================================================================== */
+
+/*!
+ * Small, fast pseudo-random number generator (xorshift64*).
+ * Each predictor owns one, so no global state is shared.
+ */
+class FAST_RNG {
+UINT64 state;
+
+public:
+FAST_RNG(UINT64 seed = 1) : state(seed ? seed : 0x9E3779B97F4A7C15ULL) {}
+
+UINT64 Next()
+{
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	return state * 0x2545F4914F6CDD1DULL;
+}
+
+//uniform number in [0, n)
+UINT32 Below(UINT32 n)
+{
+	return (UINT32)(((Next() >> 32) * n) >> 32);
+}
+};
+
+/*!
+ * Interface of the direction predictors used by the BPU.
+ * Predict and Update are called in pairs for every control flow instruction,
+ *  so a predictor may keep the state of its last prediction for the update.
+ */
+class DIRECTION_PREDICTOR {
+public:
+virtual ~DIRECTION_PREDICTOR() {}
+
+// brTaken is only used by the random baseline
+virtual bool Predict(ADDRINT PC, bool brTaken) = 0;
+virtual VOID Update(ADDRINT PC, bool brTaken, bool predictDir) = 0;
+
+virtual std::string Name() const = 0;
+virtual UINT64 StorageBits() const = 0;
+
+// Tables and histories, for -save-state and -load-state
+virtual VOID SaveState(STATE_WRITER& out) const = 0;
+virtual VOID LoadState(STATE_READER& in) = 0;
+};
+
+//n-bit saturating counter helpers
+static inline VOID SatInc(INT8& ctr, INT8 max) { if (ctr < max) ctr++; }
+static inline VOID SatDec(INT8& ctr, INT8 min) { if (ctr > min) ctr--; }
+
+/*!
+ * Not a real predictor: randomly makes wrong predictions (-mpr percent)
+ */
+class RANDOM_DP : public DIRECTION_PREDICTOR {
+UINT32 mispredRate;
+FAST_RNG rng;
+
+public:
+RANDOM_DP(UINT32 rate) : mispredRate(rate) {}
+
+bool Predict(ADDRINT PC, bool brTaken)
+{
+	if (rng.Below(100) > (100-mispredRate))
+		return !brTaken;  // mispredict direction
+	return brTaken;
+}
+
+VOID Update(ADDRINT PC, bool brTaken, bool predictDir) {}
+
+std::string Name() const { return "random"; }
+UINT64 StorageBits() const { return 0; }
+
+VOID SaveState(STATE_WRITER& out) const { out.Put(rng); }
+VOID LoadState(STATE_READER& in) { in.Get(rng); }
+};
+
+/*!
+ * Table of 2-bit counters indexed by PC
+ */
+class BIMODAL_DP : public DIRECTION_PREDICTOR {
+INT8* table;	//counters in [-2, 1], taken if >= 0
+UINT64 mask;
+
+public:
+BIMODAL_DP(UINT32 logSize)
+{
+	mask = (1ULL << logSize) - 1;
+	table = (INT8*) malloc((mask+1)*sizeof(INT8));
+	for (UINT64 i=0; i<=mask; i++){
+		table[i] = 0;
+	}
+}
+
+bool Predict(ADDRINT PC, bool brTaken)
+{
+	return table[PC & mask] >= 0;
+}
+
+VOID Update(ADDRINT PC, bool brTaken, bool predictDir)
+{
+	if (brTaken)
+		SatInc(table[PC & mask], 1);
+	else
+		SatDec(table[PC & mask], -2);
+}
+
+std::string Name() const { return "bimodal"; }
+UINT64 StorageBits() const { return (mask+1)*2; }
+
+VOID SaveState(STATE_WRITER& out) const { out.PutArray(table, mask+1); }
+VOID LoadState(STATE_READER& in) { in.GetArray(table, mask+1); }
+};
+
+/*!
+ * Table of 2-bit counters indexed by PC xor global history
+ */
+class GSHARE_DP : public DIRECTION_PREDICTOR {
+INT8* table;	//counters in [-2, 1], taken if >= 0
+UINT64 mask;
+UINT64 history;
+UINT64 historyMask;
+
+public:
+GSHARE_DP(UINT32 logSize, UINT32 historyLength)
+{
+	mask = (1ULL << logSize) - 1;
+	historyMask = (historyLength >= 64) ? ~0ULL : (1ULL << historyLength) - 1;
+	history = 0;
+	table = (INT8*) malloc((mask+1)*sizeof(INT8));
+	for (UINT64 i=0; i<=mask; i++){
+		table[i] = 0;
+	}
+}
+
+bool Predict(ADDRINT PC, bool brTaken)
+{
+	return table[(PC ^ history) & mask] >= 0;
+}
+
+VOID Update(ADDRINT PC, bool brTaken, bool predictDir)
+{
+	UINT64 index = (PC ^ history) & mask;
+	if (brTaken)
+		SatInc(table[index], 1);
+	else
+		SatDec(table[index], -2);
+	history = ((history << 1) | brTaken) & historyMask;
+}
+
+std::string Name() const { return "gshare"; }
+UINT64 StorageBits() const { return (mask+1)*2 + __builtin_popcountll(historyMask); }
+
+VOID SaveState(STATE_WRITER& out) const
+{
+	out.PutArray(table, mask+1);
+	out.Put(history);
+}
+
+VOID LoadState(STATE_READER& in)
+{
+	in.GetArray(table, mask+1);
+	in.Get(history);
+}
+};
+
+//global history of length origLength folded into compLength bits
+struct FOLDED_HISTORY {
+	UINT32 comp;
+	UINT32 compLength;
+	UINT32 origLength;
+	UINT32 outPoint;
+
+	VOID Init(UINT32 orig, UINT32 compressed)
+	{
+		comp = 0;
+		origLength = orig;
+		compLength = compressed;
+		outPoint = orig % compressed;
+	}
+
+	//h(i) is the i-th most recent outcome, h(0) was just inserted
+	VOID Update(UINT32 in, UINT32 out)
+	{
+		comp = (comp << 1) ^ in;
+		comp ^= out << outPoint;
+		comp ^= comp >> compLength;
+		comp &= (1U << compLength) - 1;
+	}
+};
+
+/*!
+ * TAGE-style predictor: a bimodal base predictor and tagged tables indexed
+ *  with geometrically increasing global history lengths. The longest
+ *  matching table provides the prediction.
+ */
+class TAGE_DP : public DIRECTION_PREDICTOR {
+struct TAGE_ENTRY {
+	INT8 ctr;	//3-bit counter in [-4, 3], taken if >= 0
+	UINT8 u : 7;	//2-bit usefulness
+	UINT8 valid : 1;	//allocated once: a cold entry matches no tag
+	UINT16 tag;
+};
+
+static const INT32 U_RESET_PERIOD = 1 << 18;
+
+UINT32 numTables;
+UINT32 logSize;
+UINT32 tagBits;
+UINT32* historyLength;
+TAGE_ENTRY** tables;
+INT8* base;	//2-bit counters in [-2, 1]
+UINT64 baseMask;
+
+//global history, ghist[(ghistPtr + i) & ghistMask] is the i-th most recent
+UINT8* ghist;
+UINT32 ghistPtr;
+UINT32 ghistMask;
+FOLDED_HISTORY* indexFold;
+FOLDED_HISTORY* tagFold0;
+FOLDED_HISTORY* tagFold1;
+
+INT8 useAltOnNewAlloc;	//4-bit counter in [-8, 7]
+INT32 tick;
+FAST_RNG rng;
+
+//state of the last prediction
+UINT32* index;
+UINT16* tag;
+INT32 provider;
+INT32 altProvider;
+bool providerPred;
+bool altPred;
+bool finalPred;
+
+public:
+TAGE_DP(UINT32 n, UINT32 logEntries, UINT32 tagSize, UINT32 minHistory, UINT32 maxHistory)
+{
+	numTables = (n < 1) ? 1 : n;
+	logSize = (logEntries < 1) ? 1 : logEntries;
+	tagBits = (tagSize < 2) ? 2 : (tagSize > 16) ? 16 : tagSize;
+	if (minHistory < 1)
+		minHistory = 1;
+	if (maxHistory < minHistory)
+		maxHistory = minHistory;
+
+	historyLength = (UINT32*) malloc(numTables*sizeof(UINT32));
+	tables = (TAGE_ENTRY**) malloc(numTables*sizeof(TAGE_ENTRY*));
+	indexFold = (FOLDED_HISTORY*) malloc(numTables*sizeof(FOLDED_HISTORY));
+	tagFold0 = (FOLDED_HISTORY*) malloc(numTables*sizeof(FOLDED_HISTORY));
+	tagFold1 = (FOLDED_HISTORY*) malloc(numTables*sizeof(FOLDED_HISTORY));
+	index = (UINT32*) malloc(numTables*sizeof(UINT32));
+	tag = (UINT16*) malloc(numTables*sizeof(UINT16));
+
+	for (UINT32 t=0; t<numTables; t++){
+		//geometric series from minHistory to maxHistory
+		double ratio = (numTables == 1) ? 1.0 : (double)t / (numTables - 1);
+		historyLength[t] = (UINT32)(minHistory * pow((double)maxHistory / minHistory, ratio) + 0.5);
+
+		tables[t] = (TAGE_ENTRY*) malloc((1ULL << logSize)*sizeof(TAGE_ENTRY));
+		for (UINT64 i=0; i<(1ULL << logSize); i++){
+			tables[t][i].ctr = 0;
+			tables[t][i].u = 0;
+			tables[t][i].valid = 0;
+			tables[t][i].tag = 0;
+		}
+		indexFold[t].Init(historyLength[t], logSize);
+		tagFold0[t].Init(historyLength[t], tagBits);
+		tagFold1[t].Init(historyLength[t], tagBits - 1);
+	}
+
+	baseMask = (1ULL << (logSize + 2)) - 1;
+	base = (INT8*) malloc((baseMask+1)*sizeof(INT8));
+	for (UINT64 i=0; i<=baseMask; i++){
+		base[i] = 0;
+	}
+
+	ghistMask = 1;
+	while (ghistMask <= maxHistory)
+		ghistMask <<= 1;
+	ghist = (UINT8*) malloc(ghistMask*sizeof(UINT8));
+	for (UINT32 i=0; i<ghistMask; i++){
+		ghist[i] = 0;
+	}
+	ghistMask--;
+	ghistPtr = 0;
+
+	useAltOnNewAlloc = 0;
+	tick = 0;
+}
+
+bool Predict(ADDRINT PC, bool brTaken)
+{
+	UINT64 indexMask = (1ULL << logSize) - 1;
+	UINT32 tagMask = (1U << tagBits) - 1;
+
+	provider = -1;
+	altProvider = -1;
+	for (INT32 t=numTables-1; t>=0; t--){
+		index[t] = (PC ^ (PC >> (logSize - (t % logSize))) ^ indexFold[t].comp) & indexMask;
+		tag[t] = (PC ^ tagFold0[t].comp ^ (tagFold1[t].comp << 1)) & tagMask;
+		if (tables[t][index[t]].valid && tables[t][index[t]].tag == tag[t]){
+			if (provider < 0)
+				provider = t;
+			else if (altProvider < 0)
+				altProvider = t;
+		}
+	}
+
+	bool basePred = base[PC & baseMask] >= 0;
+	altPred = (altProvider >= 0) ? tables[altProvider][index[altProvider]].ctr >= 0 : basePred;
+	if (provider < 0){
+		finalPred = basePred;
+		return finalPred;
+	}
+
+	TAGE_ENTRY& entry = tables[provider][index[provider]];
+	providerPred = entry.ctr >= 0;
+	bool newAlloc = (entry.ctr == 0 || entry.ctr == -1) && entry.u == 0;
+	finalPred = (newAlloc && useAltOnNewAlloc >= 0) ? altPred : providerPred;
+	return finalPred;
+}
+
+VOID Update(ADDRINT PC, bool brTaken, bool predictDir)
+{
+	if (provider >= 0){
+		TAGE_ENTRY& entry = tables[provider][index[provider]];
+		bool newAlloc = (entry.ctr == 0 || entry.ctr == -1) && entry.u == 0;
+		if (newAlloc && providerPred != altPred){
+			if (altPred == brTaken)
+				SatInc(useAltOnNewAlloc, 7);
+			else
+				SatDec(useAltOnNewAlloc, -8);
+		}
+	}
+
+	//allocate an entry in a longer history table on a misprediction
+	if (finalPred != brTaken && provider < (INT32)numTables-1){
+		INT32 first = provider + 1;
+		//randomly skip the first candidate to spread allocations
+		if (first < (INT32)numTables-1 && rng.Below(2))
+			first++;
+		bool allocated = false;
+		for (INT32 t=first; t<(INT32)numTables; t++){
+			TAGE_ENTRY& entry = tables[t][index[t]];
+			if (entry.u == 0){
+				entry.valid = 1;
+				entry.tag = tag[t];
+				entry.ctr = brTaken ? 0 : -1;
+				allocated = true;
+				break;
+			}
+		}
+		if (!allocated){
+			for (INT32 t=provider+1; t<(INT32)numTables; t++){
+				if (tables[t][index[t]].u > 0)
+					tables[t][index[t]].u--;
+			}
+		}
+	}
+
+	//update the provider (or base) counter and usefulness
+	if (provider >= 0){
+		TAGE_ENTRY& entry = tables[provider][index[provider]];
+		if (brTaken)
+			SatInc(entry.ctr, 3);
+		else
+			SatDec(entry.ctr, -4);
+		if (providerPred != altPred){
+			if (providerPred == brTaken){
+				if (entry.u < 3)
+					entry.u++;
+			}
+			else if (entry.u > 0){
+				entry.u--;
+			}
+		}
+	}
+	else {
+		if (brTaken)
+			SatInc(base[PC & baseMask], 1);
+		else
+			SatDec(base[PC & baseMask], -2);
+	}
+
+	//graceful aging of the usefulness counters
+	if (++tick == U_RESET_PERIOD){
+		tick = 0;
+		for (UINT32 t=0; t<numTables; t++){
+			for (UINT64 i=0; i<(1ULL << logSize); i++){
+				tables[t][i].u >>= 1;
+			}
+		}
+	}
+
+	//insert the outcome in the global history
+	ghistPtr = (ghistPtr - 1) & ghistMask;
+	ghist[ghistPtr] = brTaken;
+	for (UINT32 t=0; t<numTables; t++){
+		UINT32 out = ghist[(ghistPtr + historyLength[t]) & ghistMask];
+		indexFold[t].Update(brTaken, out);
+		tagFold0[t].Update(brTaken, out);
+		tagFold1[t].Update(brTaken, out);
+	}
+}
+
+std::string Name() const { return "tage"; }
+UINT64 StorageBits() const
+{
+	return numTables * (1ULL << logSize) * (3 + 2 + 1 + tagBits)
+	     + (baseMask+1)*2 + historyLength[numTables-1];
+}
+
+//the state of the last prediction is not saved: it is rebuilt by Predict
+VOID SaveState(STATE_WRITER& out) const
+{
+	for (UINT32 t=0; t<numTables; t++){
+		out.PutArray(tables[t], 1ULL << logSize);
+	}
+	out.PutArray(base, baseMask+1);
+	out.PutArray(ghist, ghistMask+1);
+	out.Put(ghistPtr);
+	out.PutArray(indexFold, numTables);
+	out.PutArray(tagFold0, numTables);
+	out.PutArray(tagFold1, numTables);
+	out.Put(useAltOnNewAlloc);
+	out.Put(tick);
+	out.Put(rng);
+}
+
+VOID LoadState(STATE_READER& in)
+{
+	for (UINT32 t=0; t<numTables; t++){
+		in.GetArray(tables[t], 1ULL << logSize);
+	}
+	in.GetArray(base, baseMask+1);
+	in.GetArray(ghist, ghistMask+1);
+	in.Get(ghistPtr);
+	in.GetArray(indexFold, numTables);
+	in.GetArray(tagFold0, numTables);
+	in.GetArray(tagFold1, numTables);
+	in.Get(useAltOnNewAlloc);
+	in.Get(tick);
+	in.Get(rng);
+}
+};
+
+/*!
+ * Hashed perceptron: every table hashes the PC with a longer prefix of the
+ *  global history to select a weight; the prediction is the sign of the sum.
+ */
+class PERCEPTRON_DP : public DIRECTION_PREDICTOR {
+UINT32 numTables;
+UINT64 mask;
+INT8** weights;
+UINT32* historyLength;
+UINT64 history;
+INT32 theta;
+
+//state of the last prediction
+UINT64* index;
+INT32 sum;
+
+public:
+PERCEPTRON_DP(UINT32 n, UINT32 logSize, UINT32 historyBits)
+{
+	numTables = (n < 1) ? 1 : n;
+	if (historyBits > 64)
+		historyBits = 64;
+	mask = (1ULL << logSize) - 1;
+	theta = (INT32)(1.93 * historyBits + 14);
+	history = 0;
+
+	weights = (INT8**) malloc(numTables*sizeof(INT8*));
+	historyLength = (UINT32*) malloc(numTables*sizeof(UINT32));
+	index = (UINT64*) malloc(numTables*sizeof(UINT64));
+	for (UINT32 t=0; t<numTables; t++){
+		//table 0 is indexed by PC only; Predict shifts by 64 - length
+		historyLength[t] = std::min(historyBits * t / numTables, (UINT32)64);
+		weights[t] = (INT8*) malloc((mask+1)*sizeof(INT8));
+		for (UINT64 i=0; i<=mask; i++){
+			weights[t][i] = 0;
+		}
+	}
+}
+
+bool Predict(ADDRINT PC, bool brTaken)
+{
+	sum = 0;
+	for (UINT32 t=0; t<numTables; t++){
+		UINT64 h = (historyLength[t] == 0) ? 0 : history << (64 - historyLength[t]);
+		h = (h ^ (h >> 29)) * 0x9E3779B97F4A7C15ULL;
+		index[t] = (PC ^ (PC >> 17) ^ (h >> 32) ^ t) & mask;
+		sum += weights[t][index[t]];
+	}
+	return sum >= 0;
+}
+
+VOID Update(ADDRINT PC, bool brTaken, bool predictDir)
+{
+	if (predictDir != brTaken || abs(sum) <= theta){
+		for (UINT32 t=0; t<numTables; t++){
+			if (brTaken)
+				SatInc(weights[t][index[t]], 127);
+			else
+				SatDec(weights[t][index[t]], -128);
+		}
+	}
+	history = (history << 1) | brTaken;
+}
+
+std::string Name() const { return "perceptron"; }
+UINT64 StorageBits() const { return numTables * (mask+1) * 8 + historyLength[numTables-1]; }
+
+VOID SaveState(STATE_WRITER& out) const
+{
+	for (UINT32 t=0; t<numTables; t++){
+		out.PutArray(weights[t], mask+1);
+	}
+	out.Put(history);
+}
+
+VOID LoadState(STATE_READER& in)
+{
+	for (UINT32 t=0; t<numTables; t++){
+		in.GetArray(weights[t], mask+1);
+	}
+	in.Get(history);
+}
+};
+
+/*!
+ * Create the direction predictor selected with -dp, sized by its KNOBs.
+ * Returns NULL if the name is unknown.
+ * @param[in]   name            predictor name
+ */
+DIRECTION_PREDICTOR* NewDirectionPredictor(const std::string& name)
+{
+	if (name == "random")
+		return new RANDOM_DP(KnobMispredRate.Value());
+	if (name == "bimodal")
+		return new BIMODAL_DP(KnobBimodalSize.Value());
+	if (name == "gshare")
+		return new GSHARE_DP(KnobGshareSize.Value(), KnobGshareHistory.Value());
+	if (name == "tage")
+		return new TAGE_DP(KnobTageTables.Value(), KnobTageSize.Value(), KnobTageTagSize.Value(),
+		                   KnobTageMinHistory.Value(), KnobTageMaxHistory.Value());
+	if (name == "perceptron")
+		return new PERCEPTRON_DP(KnobPerceptronTables.Value(), KnobPerceptronSize.Value(),
+		                         KnobPerceptronHistory.Value());
+	return NULL;
+}
+
+/* ===================================================================== */
+// Indirect target predictor (-ind)
+/* ===================================================================== */
+
+/*!
+ * ITTAGE-style indirect target predictor: tagged tables of targets indexed
+ *  with the PC and geometrically increasing lengths of a global history of
+ *  branch directions and taken targets. The longest matching table provides
+ *  the target of an indirect jump or call; without a match the BTB does.
+ */
+class ITTAGE {
+struct ITTAGE_ENTRY {
+	ADDRINT target;
+	UINT16 tag;
+	UINT8 ctr;	//2-bit confidence in the target
+	UINT8 u : 7;	//1-bit usefulness
+	UINT8 valid : 1;	//allocated once: a cold entry matches no tag
+};
+
+static const UINT32 TAG_BITS = 12;
+static const UINT32 MIN_HISTORY = 8;
+static const INT32 U_RESET_PERIOD = 1 << 18;
+
+UINT32 numTables;
+UINT32 logSize;
+UINT32* historyLength;
+ITTAGE_ENTRY** tables;
+
+//global history, 2 bits per branch: its direction and a bit of its target,
+//ghist[(ghistPtr + i) & ghistMask] is the i-th most recent
+UINT8* ghist;
+UINT32 ghistPtr;
+UINT32 ghistMask;
+FOLDED_HISTORY* indexFold;
+FOLDED_HISTORY* tagFold0;
+FOLDED_HISTORY* tagFold1;
+
+INT32 tick;
+FAST_RNG rng;
+
+//state of the last lookup
+UINT32* index;
+UINT16* tag;
+INT32 provider;
+INT32 altProvider;
+
+//counters
+UINT64 cnt_provided;	//predictions made by a tagged table
+
+//find the longest and second longest matching tables of PC
+VOID Lookup(ADDRINT PC)
+{
+	UINT64 indexMask = (1ULL << logSize) - 1;
+	UINT32 tagMask = (1U << TAG_BITS) - 1;
+
+	provider = -1;
+	altProvider = -1;
+	for (INT32 t=numTables-1; t>=0; t--){
+		index[t] = (PC ^ (PC >> (logSize - (t % logSize))) ^ indexFold[t].comp) & indexMask;
+		tag[t] = (PC ^ tagFold0[t].comp ^ (tagFold1[t].comp << 1)) & tagMask;
+		if (tables[t][index[t]].valid && tables[t][index[t]].tag == tag[t]){
+			if (provider < 0)
+				provider = t;
+			else if (altProvider < 0)
+				altProvider = t;
+		}
+	}
+}
+
+VOID InsertHistory(UINT32 bit)
+{
+	ghistPtr = (ghistPtr - 1) & ghistMask;
+	ghist[ghistPtr] = bit;
+	for (UINT32 t=0; t<numTables; t++){
+		UINT32 out = ghist[(ghistPtr + historyLength[t]) & ghistMask];
+		indexFold[t].Update(bit, out);
+		tagFold0[t].Update(bit, out);
+		tagFold1[t].Update(bit, out);
+	}
+}
+
+public:
+ITTAGE(UINT32 n, UINT32 logEntries, UINT32 maxHistory) : rng(logEntries*17 + n)
+{
+	numTables = (n < 1) ? 1 : n;
+	logSize = (logEntries < 1) ? 1 : (logEntries > 24) ? 24 : logEntries;
+	if (maxHistory < MIN_HISTORY)
+		maxHistory = MIN_HISTORY;
+
+	historyLength = (UINT32*) malloc(numTables*sizeof(UINT32));
+	tables = (ITTAGE_ENTRY**) malloc(numTables*sizeof(ITTAGE_ENTRY*));
+	indexFold = (FOLDED_HISTORY*) malloc(numTables*sizeof(FOLDED_HISTORY));
+	tagFold0 = (FOLDED_HISTORY*) malloc(numTables*sizeof(FOLDED_HISTORY));
+	tagFold1 = (FOLDED_HISTORY*) malloc(numTables*sizeof(FOLDED_HISTORY));
+	index = (UINT32*) malloc(numTables*sizeof(UINT32));
+	tag = (UINT16*) malloc(numTables*sizeof(UINT16));
+
+	for (UINT32 t=0; t<numTables; t++){
+		//geometric series from MIN_HISTORY to maxHistory
+		double ratio = (numTables == 1) ? 1.0 : (double)t / (numTables - 1);
+		historyLength[t] = (UINT32)(MIN_HISTORY * pow((double)maxHistory / MIN_HISTORY, ratio) + 0.5);
+
+		tables[t] = (ITTAGE_ENTRY*) malloc((1ULL << logSize)*sizeof(ITTAGE_ENTRY));
+		for (UINT64 i=0; i<(1ULL << logSize); i++){
+			tables[t][i].target = 0;
+			tables[t][i].tag = 0;
+			tables[t][i].ctr = 0;
+			tables[t][i].u = 0;
+			tables[t][i].valid = 0;
+		}
+		indexFold[t].Init(historyLength[t], logSize);
+		tagFold0[t].Init(historyLength[t], TAG_BITS);
+		tagFold1[t].Init(historyLength[t], TAG_BITS - 1);
+	}
+
+	ghistMask = 1;
+	while (ghistMask <= maxHistory)
+		ghistMask <<= 1;
+	ghist = (UINT8*) malloc(ghistMask*sizeof(UINT8));
+	for (UINT32 i=0; i<ghistMask; i++){
+		ghist[i] = 0;
+	}
+	ghistMask--;
+	ghistPtr = 0;
+
+	tick = 0;
+	cnt_provided = 0;
+}
+
+/*!
+// Predict the target of the indirect branch at address PC.
+// Returns false if no table matches: the BTB predicts the target.
+ * @param[in]   PC              address of the indirect branch
+ * @param[out]  target          the predicted target
+ */
+bool Predict(ADDRINT PC, ADDRINT& target)
+{
+	Lookup(PC);
+	if (provider < 0)
+		return false;
+	const ITTAGE_ENTRY& entry = tables[provider][index[provider]];
+	//a new entry is not trusted over a matching shorter history
+	if (entry.ctr == 0 && altProvider >= 0)
+		target = tables[altProvider][index[altProvider]].target;
+	else
+		target = entry.target;
+	cnt_provided++;
+	return true;
+}
+
+/*!
+// Train the tables with the target of the taken indirect branch at PC.
+ * @param[in]   PC              address of the indirect branch
+ * @param[in]   targetPC        its actual target
+ * @param[in]   correctTarg     the BPU predicted the target correctly
+ */
+VOID Update(ADDRINT PC, ADDRINT targetPC, bool correctTarg)
+{
+	Lookup(PC);
+
+	//update the provider target and its confidence
+	if (provider >= 0){
+		ITTAGE_ENTRY& entry = tables[provider][index[provider]];
+		bool altCorrect = altProvider >= 0
+		                  && tables[altProvider][index[altProvider]].target == targetPC;
+		if (entry.target == targetPC){
+			if (entry.ctr < 3)
+				entry.ctr++;
+			if (!altCorrect)
+				entry.u = 1;
+		}
+		else if (entry.ctr > 0){
+			entry.ctr--;
+		}
+		else {
+			entry.target = targetPC;
+			if (altCorrect)
+				entry.u = 0;
+		}
+	}
+
+	//allocate an entry in a longer history table on a misprediction
+	if (!correctTarg && provider < (INT32)numTables-1){
+		INT32 first = provider + 1;
+		//randomly skip the first candidate to spread allocations
+		if (first < (INT32)numTables-1 && rng.Below(2))
+			first++;
+		bool allocated = false;
+		for (INT32 t=first; t<(INT32)numTables; t++){
+			ITTAGE_ENTRY& entry = tables[t][index[t]];
+			if (entry.u == 0){
+				entry.valid = 1;
+				entry.tag = tag[t];
+				entry.target = targetPC;
+				entry.ctr = 0;
+				allocated = true;
+				break;
+			}
+		}
+		if (!allocated){
+			for (INT32 t=provider+1; t<(INT32)numTables; t++){
+				tables[t][index[t]].u = 0;
+			}
+		}
+	}
+
+	//periodic reset of the usefulness bits
+	if (++tick == U_RESET_PERIOD){
+		tick = 0;
+		for (UINT32 t=0; t<numTables; t++){
+			for (UINT64 i=0; i<(1ULL << logSize); i++){
+				tables[t][i].u = 0;
+			}
+		}
+	}
+}
+
+/*!
+// Insert a control flow instruction in the global history.
+ * @param[in]   brTaken         its direction
+ * @param[in]   targetPC        its target, if taken
+ */
+VOID UpdateHistory(bool brTaken, ADDRINT targetPC)
+{
+	InsertHistory(brTaken);
+	InsertHistory(brTaken ? ((targetPC >> 2) ^ (targetPC >> 7)) & 1 : 0);
+}
+
+UINT64 StorageBits() const
+{
+	return numTables * (1ULL << logSize) * (8*sizeof(ADDRINT) + TAG_BITS + 2 + 1 + 1)
+	     + historyLength[numTables-1];
+}
+
+UINT64 Provided() const { return cnt_provided; }
+
+VOID SaveState(STATE_WRITER& out) const
+{
+	for (UINT32 t=0; t<numTables; t++){
+		out.PutArray(tables[t], 1ULL << logSize);
+	}
+	out.PutArray(ghist, ghistMask+1);
+	out.Put(ghistPtr);
+	out.PutArray(indexFold, numTables);
+	out.PutArray(tagFold0, numTables);
+	out.PutArray(tagFold1, numTables);
+	out.Put(tick);
+	out.Put(rng);
+}
+
+VOID LoadState(STATE_READER& in)
+{
+	for (UINT32 t=0; t<numTables; t++){
+		in.GetArray(tables[t], 1ULL << logSize);
+	}
+	in.GetArray(ghist, ghistMask+1);
+	in.Get(ghistPtr);
+	in.GetArray(indexFold, numTables);
+	in.GetArray(tagFold0, numTables);
+	in.GetArray(tagFold1, numTables);
+	in.Get(tick);
+	in.Get(rng);
+}
+};
+
+/*!
+ * Create the indirect target predictor selected with -ind, sized by its
+ *  KNOBs. Returns NULL for "btb": the BTB alone predicts indirect targets.
+ *  Exits if the name is unknown.
+ */
+ITTAGE* NewIndirectPredictor()
+{
+	const std::string name = KnobIndirectPredictor.Value();
+	if (name == "btb")
+		return NULL;
+	if (name == "ittage")
+		return new ITTAGE(KnobIndirectTables.Value(), KnobIndirectSize.Value(),
+		                  KnobIndirectMaxHistory.Value());
+	cerr << "ERROR: unknown indirect target predictor " << name << endl;
+	exit(-1);
+}
+
+/* ===================================================================== */
+// Branch Target Buffer
+/* ===================================================================== */
+//BTB: one flat table of BTBNumberOfSets x BTBSetSize ways, stored set by set.
+//Tags of a set are contiguous so the whole set is compared at once.
+//Lookup and Update are templates on the replacement policy (REPL_* below)
+//and on the geometry (BTB_GEOMETRY below), so every configuration runs a hot
+//path compiled for its own policy and, if it is a common one, its own size.
+static const UINT32 BTB_REUSE_BUCKETS = 16;   // reuse distances 1, 2-3, 4-7, ... 2^15+
+
+//Kind of branch of an entry, from the instruction that filled it
+static const UINT8 BTB_FLAG_RETURN = 0x1;
+static const UINT8 BTB_FLAG_CALL = 0x2;
+
+//Storage of an entry: valid bit, tag, target and the BTB_FLAG_* bits.
+//A full target has BTB_VA_BITS bits; with -tgtbits it is the low bits of
+//the target and the index of its upper bits in a region table shared by
+//all the entries of the BTB.
+static const UINT32 BTB_VA_BITS = 48;
+static const UINT32 BTB_FLAG_BITS = 2;
+static const ADDRINT BTB_INVALID_REGION = ~(ADDRINT)0;
+
+//replacement state bits of a set of ways (REPL_*::StateBits)
+typedef UINT64 (*REPL_BITS_FN)(UINT64 ways);
+
+static inline UINT32 CeilLog2(UINT64 n) { return (n <= 1) ? 0 : 64 - __builtin_clzll(n - 1); }
+
+//log2(-fetchblock): the BTB is indexed by fetch block; 0 without fetch-block mode
+static inline UINT32 FetchBlockBits()
+{
+	return (KnobFetchBlock.Value() == 0) ? 0 : __builtin_ctz(KnobFetchBlock.Value());
+}
+
+//Fetch-block mode: an entry read by the one lookup of a fetch block
+struct BTB_BLOCK_ENTRY {
+	ADDRINT PC;			//of the branch
+	ADDRINT target;
+	UINT8 flags;		//BTB_FLAG_*
+};
+
+static inline bool BTBStorageMode()
+{
+	return KnobBTBStorage.Value() || KnobTargetBits.Value() > 0 || KnobBudgetKB.Value() > 0;
+}
+
+//bits of the target of an entry
+static inline UINT64 BTBTargetBits()
+{
+	UINT32 offsetBits = KnobTargetBits.Value();
+	return (offsetBits == 0) ? BTB_VA_BITS : offsetBits + CeilLog2(KnobRegions.Value());
+}
+
+/*!
+// Storage of a BTB, in bits: its entries, the replacement state of its
+// sets and its target region table.
+ * @param[in]   entries         BTB entries
+ * @param[in]   ways            BTB associativity
+ * @param[in]   tagSize         tag bits
+ * @param[in]   replBits        replacement state bits of a set
+ */
+static UINT64 BTBStorageBits(UINT64 entries, UINT64 ways, UINT64 tagSize, REPL_BITS_FN replBits)
+{
+	UINT64 bits = entries * (1 + tagSize + BTBTargetBits() + BTB_FLAG_BITS)
+	            + entries/ways * replBits(ways);
+	UINT32 offsetBits = KnobTargetBits.Value();
+	if (offsetBits > 0)
+		bits += KnobRegions.Value() * (1 + BTB_VA_BITS - offsetBits) + CeilLog2(KnobRegions.Value());
+	return bits;
+}
+
+class BTB {
+friend struct REPL_FIFO;
+friend struct REPL_LRU;
+friend struct REPL_PLRU;
+friend struct REPL_SRRIP;
+friend struct REPL_BRRIP;
+friend struct REPL_RANDOM;
+friend struct BTB_ANY_GEOMETRY;
+friend struct BTB_BLOCK_GEOMETRY;
+template <UINT32 LOG_SETS, UINT32 WAYS, UINT32 TAG_BITS> friend struct BTB_GEOMETRY;
+
+static const UINT64 BTB_INVALID_TAG = ~(UINT64)0;  // never equal to a masked tag
+static const UINT64 BTB_CHUNK = 8;                 // ways compared per step
+
+UINT64* BTBTags;        // tag of each way, BTB_INVALID_TAG if empty
+ADDRINT* BTBTargets;    // BTA of each way
+UINT8* BTBFlags;        // BTB_FLAG_* of each way
+UINT64* BTBStamps;      // set access count at the last use of each way
+UINT8* BTBRepl;         // policy state of each way: RRPV, or PLRU tree node
+UINT64* BTBSetClock;    // accesses to each set
+UINT32* BTBNextWay;     // FIFO replacement: next way to fill in each set
+FAST_RNG rng;           // random and BRRIP replacement
+ADDRINT* BTBFullPCs;    // storage mode: PC that wrote each way, to tell false hits; NULL otherwise
+ADDRINT* BTBRegions;    // -tgtbits: upper target bits of each region, NULL for full targets
+UINT32 BTBRegionCount;
+UINT32 BTBNextRegion;   // round robin region replacement
+UINT32 BTBOffsetBits;   // -tgtbits: target bits kept in the entry
+ADDRINT BTBOffsetMask;
+REPL_BITS_FN BTBReplBits;
+
+UINT64 BTBSetSize;
+UINT64 BTBNumberOfSets;
+UINT64 BTBSetMask;      // BTBNumberOfSets-1: the set is PC & BTBSetMask
+UINT32 BTBSetShift;     // log2(BTBNumberOfSets): the tag is PC >> BTBSetShift
+UINT64 BTBTagMask;
+UINT64 BTBSetStride;    // ways allocated per set (BTBSetSize rounded up to BTB_CHUNK)
+UINT32 BTBBlockBits;    // fetch-block mode: log2(-fetchblock), the set is (PC >> BTBBlockBits) & BTBSetMask
+ADDRINT BTBBlockMask;   // and the tag keeps the offset of the branch in its block
+UINT32 BTBSetLevels;    // log2(BTBSetSize), for tree PLRU
+
+//counters
+UINT64 cnt_hits;
+UINT64 cnt_fills;
+UINT64 cnt_evictions;   // fills that replaced a valid entry
+UINT64 cnt_valid;       // valid entries now
+UINT64 cnt_reuse[BTB_REUSE_BUCKETS];
+UINT64 cnt_falseHits;   // hits on the entry of another branch with the same partial tag
+UINT64 cnt_regionFills; // region table entries replaced
+
+//a shared BTB is accessed by all application threads (SMT)
+bool shared;
+bool lockFlag;
+
+template <class GEOMETRY> INT64 FindWay(UINT64 index, UINT64 tag) const;
+template <class POLICY, class GEOMETRY> VOID Write(ADDRINT PC, ADDRINT targetPC, UINT8 flags, bool access);
+
+VOID Lock()
+{
+	if (shared){
+		while (__atomic_test_and_set(&lockFlag, __ATOMIC_ACQUIRE))
+			;
+	}
+}
+
+VOID Unlock()
+{
+	if (shared)
+		__atomic_clear(&lockFlag, __ATOMIC_RELEASE);
+}
+
+//count a hit on a way and its distance, in accesses to the set, from its last use
+VOID Touch(UINT64 index, UINT64 entry)
+{
+	UINT64 distance = BTBSetClock[index] - BTBStamps[entry];
+	UINT32 bucket = 63 - __builtin_clzll(distance | 1);
+	cnt_reuse[bucket < BTB_REUSE_BUCKETS ? bucket : BTB_REUSE_BUCKETS-1]++;
+	cnt_hits++;
+	BTBStamps[entry] = BTBSetClock[index];
+}
+
+//the value kept in an entry for the target: the target itself, or its
+//offset and the index of its region, which may replace another region
+ADDRINT EncodeTarget(ADDRINT target)
+{
+	if (BTBRegions == NULL)
+		return target;
+	ADDRINT region = target >> BTBOffsetBits;
+	UINT32 r = 0;
+	while (r < BTBRegionCount && BTBRegions[r] != region)
+		r++;
+	if (r == BTBRegionCount){
+		r = BTBNextRegion;
+		BTBNextRegion = (r + 1 == BTBRegionCount) ? 0 : r + 1;
+		if (BTBRegions[r] != BTB_INVALID_REGION)
+			cnt_regionFills++;
+		BTBRegions[r] = region;
+	}
+	return ((ADDRINT)r << BTBOffsetBits) | (target & BTBOffsetMask);
+}
+
+//the target of an entry; wrong if its region was replaced since
+ADDRINT DecodeTarget(ADDRINT stored) const
+{
+	if (BTBRegions == NULL)
+		return stored;
+	return (BTBRegions[stored >> BTBOffsetBits] << BTBOffsetBits) | (stored & BTBOffsetMask);
+}
+
+public:
+BTB(UINT64 btbSize, UINT64 btbAssoc, UINT64 tagSize, REPL_BITS_FN replBits);
+
+VOID Share() { shared = true; }
+bool IsShared() const { return shared; }
+
+template <class POLICY, class GEOMETRY> bool Lookup(ADDRINT PC, ADDRINT& target, UINT8& flags);
+template <class POLICY> UINT32 LookupBlock(ADDRINT PC, BTB_BLOCK_ENTRY* entries);
+template <class POLICY, class GEOMETRY> VOID Update(ADDRINT PC, ADDRINT targetPC, UINT8 flags)
+{
+	Write<POLICY, GEOMETRY>(PC, targetPC, flags, true);
+}
+
+//install an entry found in another level, after the Lookup here missed:
+//the same access to the set, and no hit
+template <class POLICY, class GEOMETRY> VOID Fill(ADDRINT PC, ADDRINT targetPC, UINT8 flags)
+{
+	Write<POLICY, GEOMETRY>(PC, targetPC, flags, false);
+}
+
+//read by the -live publisher while the simulation runs
+UINT64 ValidEntries() const { return __atomic_load_n(&cnt_valid, __ATOMIC_RELAXED); }
+UINT64 Hits() const { return __atomic_load_n(&cnt_hits, __ATOMIC_RELAXED); }
+UINT64 Fills() const { return __atomic_load_n(&cnt_fills, __ATOMIC_RELAXED); }
+UINT64 Evictions() const { return __atomic_load_n(&cnt_evictions, __ATOMIC_RELAXED); }
+UINT64 Capacity() const { return BTBNumberOfSets*BTBSetSize; }
+UINT64 StorageBits() const;
+
+VOID MergeCounters(const BTB& other);
+std::string ReportCounters() const;
+
+VOID SaveState(STATE_WRITER& out) const;
+VOID LoadState(STATE_READER& in);
+}; // end class BTB
+
+// Constructor
+/////////////////////////////////////////////////////////////////////////////////////////////
+BTB::BTB(UINT64 btbSize, UINT64 btbAssoc, UINT64 tagSize, REPL_BITS_FN replBits)
+	: rng(btbSize*31 + btbAssoc) {
+	BTBNumberOfSets = btbSize/btbAssoc;	//a power of two, checked by CreateBPUs
+	BTBSetSize = btbAssoc;
+	BTBSetMask = BTBNumberOfSets - 1;
+	BTBSetShift = __builtin_ctzll(BTBNumberOfSets);
+	BTBTagMask = ((UINT64)1 << tagSize) - 1;
+	BTBBlockBits = FetchBlockBits();
+	BTBBlockMask = ((ADDRINT)1 << BTBBlockBits) - 1;
+	BTBSetLevels = 0;
+	while (((UINT64)2 << BTBSetLevels) <= BTBSetSize)
+		BTBSetLevels++;
+	BTBReplBits = replBits;
+	shared = false;
+	lockFlag = false;
+
+	cnt_hits = 0;
+	cnt_fills = 0;
+	cnt_evictions = 0;
+	cnt_valid = 0;
+	for (UINT32 i=0; i<BTB_REUSE_BUCKETS; i++)
+		cnt_reuse[i] = 0;
+	cnt_falseHits = 0;
+	cnt_regionFills = 0;
+
+	//BTB: all sets allocated once, nothing is allocated while simulating.
+	//Sets with at least BTB_CHUNK ways are padded with never-matching tags
+	//so FindWay always compares whole chunks.
+	BTBSetStride = (BTBSetSize < BTB_CHUNK) ? BTBSetSize
+	             : (BTBSetSize + BTB_CHUNK - 1) / BTB_CHUNK * BTB_CHUNK;
+	BTBTags = (UINT64*) malloc(BTBNumberOfSets*BTBSetStride*sizeof(UINT64));
+	BTBTargets = (ADDRINT*) malloc(BTBNumberOfSets*BTBSetStride*sizeof(ADDRINT));
+	BTBFlags = (UINT8*) malloc(BTBNumberOfSets*BTBSetStride*sizeof(UINT8));
+	BTBStamps = (UINT64*) malloc(BTBNumberOfSets*BTBSetStride*sizeof(UINT64));
+	BTBRepl = (UINT8*) malloc(BTBNumberOfSets*BTBSetStride*sizeof(UINT8));
+	BTBSetClock = (UINT64*) malloc(BTBNumberOfSets*sizeof(UINT64));
+	BTBNextWay = (UINT32*) malloc(BTBNumberOfSets*sizeof(UINT32));
+	for (UINT64 i=0; i<BTBNumberOfSets*BTBSetStride; i++){
+		BTBTags[i] = BTB_INVALID_TAG;
+		BTBTargets[i] = 0;
+		BTBFlags[i] = 0;
+		BTBStamps[i] = 0;
+		BTBRepl[i] = 0;
+	}
+	for (UINT64 i=0; i<BTBNumberOfSets; i++){
+		BTBSetClock[i] = 0;
+		BTBNextWay[i] = 0;
+	}
+
+	//storage mode: targets compressed by -tgtbits, false hits counted
+	BTBFullPCs = NULL;
+	if (BTBStorageMode()){
+		BTBFullPCs = (ADDRINT*) malloc(BTBNumberOfSets*BTBSetStride*sizeof(ADDRINT));
+		for (UINT64 i=0; i<BTBNumberOfSets*BTBSetStride; i++)
+			BTBFullPCs[i] = 0;
+	}
+	BTBOffsetBits = KnobTargetBits.Value();
+	BTBOffsetMask = ((ADDRINT)1 << BTBOffsetBits) - 1;
+	BTBRegionCount = (BTBOffsetBits > 0) ? KnobRegions.Value() : 0;
+	BTBNextRegion = 0;
+	BTBRegions = NULL;
+	if (BTBRegionCount > 0){
+		BTBRegions = (ADDRINT*) malloc(BTBRegionCount*sizeof(ADDRINT));
+		for (UINT32 i=0; i<BTBRegionCount; i++)
+			BTBRegions[i] = BTB_INVALID_REGION;
+	}
+}
+
+/*!
+// Find the way of set index holding tag.
+// Returns -1 on a BTB miss.
+ * @param[in]   index           BTB set
+ * @param[in]   tag             tag of the branch
+ */
+template <class GEOMETRY>
+inline INT64 BTB::FindWay(UINT64 index, UINT64 tag) const
+{
+	const UINT64 stride = GEOMETRY::Stride(*this);
+	const UINT64* tags = BTBTags + index*stride;
+
+	if (stride < BTB_CHUNK){
+		for (UINT64 way = 0; way < stride; way++){
+			if (tags[way] == tag)
+				return way;
+		}
+		return -1;
+	}
+
+	//compare a whole chunk of ways at once (vectorized by the compiler)
+	for (UINT64 base = 0; base < stride; base += BTB_CHUNK){
+		UINT32 hits = 0;
+		for (UINT64 way = 0; way < BTB_CHUNK; way++){
+			hits |= (UINT32)(tags[base + way] == tag) << way;
+		}
+		if (hits)
+			return base + __builtin_ctz(hits);
+	}
+	return -1;
+}
+
+/*!
+// Look up the branch at address PC.
+// Returns true on a hit, with the BTA and flags of the entry.
+ * @param[in]   PC              address of current instruction
+ * @param[out]  target          BTA of the entry
+ * @param[out]  flags           BTB_FLAG_* of the entry
+ */
+template <class POLICY, class GEOMETRY>
+inline bool BTB::Lookup(ADDRINT PC, ADDRINT& target, UINT8& flags)
+{
+	UINT64 index = GEOMETRY::Index(*this, PC);
+	UINT64 tag = GEOMETRY::Tag(*this, PC);
+
+	Lock();
+	BTBSetClock[index]++;
+	INT64 way = FindWay<GEOMETRY>(index, tag);
+	if (way >= 0){
+		UINT64 entry = index*GEOMETRY::Stride(*this) + way;
+		target = DecodeTarget(BTBTargets[entry]);
+		flags = BTBFlags[entry];
+		if (BTBFullPCs != NULL && BTBFullPCs[entry] != PC)
+			cnt_falseHits++;
+		Touch(index, entry);
+		POLICY::Hit(*this, index, way);
+	}
+	Unlock();
+	return way >= 0;
+}
+
+/*!
+// Fetch-block mode: read, in one access to the set of the fetch block of
+// PC, the entries of the branches of the block at or after PC. The first
+// of them counts the hit; all of them are used for the replacement policy.
+// Returns the number of entries, at most the associativity.
+ * @param[in]   PC              fetch address: the first branch fetched in the block
+ * @param[out]  entries         the entries found
+ */
+template <class POLICY>
+inline UINT32 BTB::LookupBlock(ADDRINT PC, BTB_BLOCK_ENTRY* entries)
+{
+	//as BTB_BLOCK_GEOMETRY
+	UINT64 index = (PC >> BTBBlockBits) & BTBSetMask;
+	UINT64 blockTag = ((PC >> BTBBlockBits >> BTBSetShift) & BTBTagMask) << BTBBlockBits;
+	ADDRINT block = PC & ~BTBBlockMask;
+	const UINT64* tags = BTBTags + index*BTBSetStride;
+
+	Lock();
+	BTBSetClock[index]++;
+	UINT32 found = 0;
+	INT64 first = -1;
+	for (UINT64 way = 0; way < BTBSetSize; way++){
+		if (tags[way] == BTB_INVALID_TAG || (tags[way] & ~(UINT64)BTBBlockMask) != blockTag
+		    || (tags[way] & BTBBlockMask) < (PC & BTBBlockMask))
+			continue;
+		UINT64 entry = index*BTBSetStride + way;
+		BTB_BLOCK_ENTRY& e = entries[found++];
+		e.PC = block | (tags[way] & BTBBlockMask);
+		e.target = DecodeTarget(BTBTargets[entry]);
+		e.flags = BTBFlags[entry];
+		if (BTBFullPCs != NULL && BTBFullPCs[entry] != e.PC)
+			cnt_falseHits++;
+		if (first < 0 || tags[way] < tags[first])
+			first = way;
+	}
+	if (first >= 0)
+		Touch(index, index*BTBSetStride + first);
+
+	//the policy sees every way read, after Touch took the distance
+	for (UINT64 way = 0; way < BTBSetSize && found != 0; way++){
+		if (tags[way] != BTB_INVALID_TAG && (tags[way] & ~(UINT64)BTBBlockMask) == blockTag
+		    && (tags[way] & BTBBlockMask) >= (PC & BTBBlockMask))
+			POLICY::Hit(*this, index, way);
+	}
+	Unlock();
+	return found;
+}
+
+/*!
+// Write the BTA of the taken branch at address PC: update its entry,
+// or replace the entry of the set chosen by the replacement policy.
+// Only Lookup counts hits and reuse distances: an entry found here is
+// just refreshed for the replacement policy.
+ * @param[in]   PC              address of current instruction
+ * @param[in]   targetPC        the target of the branch
+ * @param[in]   flags           BTB_FLAG_* of the branch, kept by a new entry
+ * @param[in]   access          false for Fill: the Lookup counted the access to the set
+ */
+template <class POLICY, class GEOMETRY>
+inline VOID BTB::Write(ADDRINT PC, ADDRINT targetPC, UINT8 flags, bool access)
+{
+	UINT64 index = GEOMETRY::Index(*this, PC);
+	UINT64 tag = GEOMETRY::Tag(*this, PC);
+
+	Lock();
+	BTBSetClock[index] += access;
+	INT64 way = FindWay<GEOMETRY>(index, tag);
+
+	//Update an existing entry
+	if (way >= 0){
+		UINT64 entry = index*GEOMETRY::Stride(*this) + way;
+		if (DecodeTarget(BTBTargets[entry]) != targetPC)
+			BTBTargets[entry] = EncodeTarget(targetPC);
+		if (BTBFullPCs != NULL)
+			BTBFullPCs[entry] = PC;	//the entry now belongs to this branch
+		POLICY::Hit(*this, index, way);
+		Unlock();
+		return;
+	}
+
+	//Add a new entry in place of the victim of the policy
+	way = POLICY::Victim(*this, index);
+	POLICY::Fill(*this, index, way);
+
+	UINT64 entry = index*GEOMETRY::Stride(*this) + way;
+	cnt_fills++;
+	if (BTBTags[entry] != BTB_INVALID_TAG)
+		cnt_evictions++;
+	else
+		cnt_valid++;
+	BTBTags[entry] = tag;
+	BTBFlags[entry] = flags;
+	BTBTargets[entry] = EncodeTarget(targetPC);
+	if (BTBFullPCs != NULL)
+		BTBFullPCs[entry] = PC;
+	BTBStamps[entry] = BTBSetClock[index];
+	Unlock();
+}
+
+/*!
+// Add the counters of another BTB of the same configuration.
+ * @param[in]   other           BTB of another thread
+ */
+VOID BTB::MergeCounters(const BTB& other)
+{
+	cnt_hits += other.cnt_hits;
+	cnt_fills += other.cnt_fills;
+	cnt_evictions += other.cnt_evictions;
+	for (UINT32 i=0; i<BTB_REUSE_BUCKETS; i++)
+		cnt_reuse[i] += other.cnt_reuse[i];
+	cnt_falseHits += other.cnt_falseHits;
+	cnt_regionFills += other.cnt_regionFills;
+}
+
+/*!
+// Bits of the BTB as hardware: entries, replacement state and region table.
+ */
+UINT64 BTB::StorageBits() const
+{
+	return BTBStorageBits(Capacity(), BTBSetSize, __builtin_popcountll(BTBTagMask) + BTBBlockBits, BTBReplBits);
+}
+
+/*!
+// Save the entries and replacement state of all sets (-save-state).
+// The padding ways of the sets are saved too, so every array is one copy.
+ * @param[out]  out             checkpoint being written
+ */
+VOID BTB::SaveState(STATE_WRITER& out) const
+{
+	UINT64 ways = BTBNumberOfSets*BTBSetStride;
+	out.PutArray(BTBTags, ways);
+	out.PutArray(BTBTargets, ways);
+	out.PutArray(BTBFlags, ways);
+	out.PutArray(BTBStamps, ways);
+	out.PutArray(BTBRepl, ways);
+	out.PutArray(BTBSetClock, BTBNumberOfSets);
+	out.PutArray(BTBNextWay, BTBNumberOfSets);
+	out.Put(rng);
+	out.Put(cnt_valid);
+
+	out.Put(BTBOffsetBits);
+	out.Put(BTBRegionCount);
+	out.Put((UINT8)(BTBFullPCs != NULL));
+	if (BTBRegions != NULL){
+		out.PutArray(BTBRegions, BTBRegionCount);
+		out.Put(BTBNextRegion);
+	}
+	if (BTBFullPCs != NULL)
+		out.PutArray(BTBFullPCs, ways);
+}
+
+/*!
+// Restore the state saved by SaveState for a BTB of the same geometry.
+ * @param[in]   in              checkpoint being read
+ */
+VOID BTB::LoadState(STATE_READER& in)
+{
+	UINT64 ways = BTBNumberOfSets*BTBSetStride;
+	in.GetArray(BTBTags, ways);
+	in.GetArray(BTBTargets, ways);
+	in.GetArray(BTBFlags, ways);
+	in.GetArray(BTBStamps, ways);
+	in.GetArray(BTBRepl, ways);
+	in.GetArray(BTBSetClock, BTBNumberOfSets);
+	in.GetArray(BTBNextWay, BTBNumberOfSets);
+	in.Get(rng);
+	in.Get(cnt_valid);
+
+	UINT32 offsetBits = 0, regionCount = 0;
+	UINT8 fullPCs = 0;
+	in.Get(offsetBits);
+	in.Get(regionCount);
+	in.Get(fullPCs);
+	if (in.Ok() && (offsetBits != BTBOffsetBits || regionCount != BTBRegionCount
+	                || (fullPCs != 0) != (BTBFullPCs != NULL))){
+		cerr << "ERROR: predictor state has BTB targets of " << offsetBits << " offset bits and "
+		     << regionCount << " regions" << (fullPCs ? " in storage mode" : "") << ", not "
+		     << BTBOffsetBits << " and " << BTBRegionCount
+		     << (BTBFullPCs != NULL ? " in storage mode" : "") << endl;
+		exit(-1);
+	}
+	if (BTBRegions != NULL){
+		in.GetArray(BTBRegions, BTBRegionCount);
+		in.Get(BTBNextRegion);
+	}
+	if (BTBFullPCs != NULL)
+		in.GetArray(BTBFullPCs, ways);
+}
+
+std::string BTB::ReportCounters() const
+{
+    std::ostringstream out;
+    out << " BTB hits: " << cnt_hits << " fills: " << cnt_fills
+        << " evictions: " << cnt_evictions << endl;
+    if (BTBFullPCs != NULL) {
+        UINT64 bits = StorageBits();
+        out << " BTB storage: " << bits << " bits (" << std::fixed << std::setprecision(2)
+            << bits / 8192.0 << " KB), " << 1 + __builtin_popcountll(BTBTagMask)
+            + BTBTargetBits() + BTB_FLAG_BITS << " bits per entry";
+        if (BTBRegions != NULL)
+            out << ", " << BTBRegionCount << " target regions of "
+                << ((ADDRINT)1 << BTBOffsetBits) << " bytes";
+        out << endl;
+        out << " BTB false hits: " << cnt_falseHits << " ("
+            << (cnt_hits ? cnt_falseHits*100.0/cnt_hits : 0.0) << "% of hits)";
+        if (BTBRegions != NULL)
+            out << " region replacements: " << cnt_regionFills;
+        out << endl;
+    }
+    out << " BTB reuse distance (set accesses):";
+    UINT32 last = BTB_REUSE_BUCKETS;
+    while (last > 0 && cnt_reuse[last-1] == 0)
+        last--;
+    for (UINT32 i = 0; i < last; i++) {
+        out << " " << (1 << i);
+        if (i == BTB_REUSE_BUCKETS-1)
+            out << "+";
+        else if (i > 0)
+            out << "-" << (2 << i) - 1;
+        out << ":" << cnt_reuse[i];
+    }
+    out << endl;
+    return out.str();
+}
+
+/* ===================================================================== */
+// BTB replacement policies (-repl)
+/* ===================================================================== */
+//Hit:       a way of the set was used
+//Victim:    the way to replace on a miss
+//Fill:      a new entry was written to way
+//StateBits: bits of replacement state of a set, for the storage report
+
+//replace the ways of a set in turn, whether they are used or not
+struct REPL_FIFO {
+	static VOID Hit(BTB& btb, UINT64 index, UINT64 way) {}
+	static UINT64 Victim(BTB& btb, UINT64 index)
+	{
+		UINT64 way = btb.BTBNextWay[index];
+		btb.BTBNextWay[index] = (way + 1 == btb.BTBSetSize) ? 0 : way + 1;
+		return way;
+	}
+	static VOID Fill(BTB& btb, UINT64 index, UINT64 way) {}
+	static UINT64 StateBits(UINT64 ways) { return CeilLog2(ways); }
+};
+
+//replace the least recently used way, by the stamps kept for reuse distances
+struct REPL_LRU {
+	static VOID Hit(BTB& btb, UINT64 index, UINT64 way)
+	{
+		btb.BTBStamps[index*btb.BTBSetStride + way] = btb.BTBSetClock[index];
+	}
+	static UINT64 Victim(BTB& btb, UINT64 index)
+	{
+		const UINT64* stamps = btb.BTBStamps + index*btb.BTBSetStride;
+		const UINT64* tags = btb.BTBTags + index*btb.BTBSetStride;
+		UINT64 victim = 0;
+		for (UINT64 way = 0; way < btb.BTBSetSize; way++){
+			if (tags[way] == BTB::BTB_INVALID_TAG)
+				return way;
+			if (stamps[way] < stamps[victim])
+				victim = way;
+		}
+		return victim;
+	}
+	static VOID Fill(BTB& btb, UINT64 index, UINT64 way) {}
+	static UINT64 StateBits(UINT64 ways) { return ways * CeilLog2(ways); }	//age of each way
+};
+
+//binary tree of BTBSetSize-1 bits per set, each pointing away from the
+//half used last (requires a power of two associativity)
+struct REPL_PLRU {
+	static VOID Hit(BTB& btb, UINT64 index, UINT64 way)
+	{
+		UINT8* tree = btb.BTBRepl + index*btb.BTBSetStride;
+		UINT64 node = 0;
+		for (INT32 level = btb.BTBSetLevels-1; level >= 0; level--){
+			UINT64 bit = (way >> level) & 1;
+			tree[node] = !bit;
+			node = 2*node + 1 + bit;
+		}
+	}
+	static UINT64 Victim(BTB& btb, UINT64 index)
+	{
+		const UINT8* tree = btb.BTBRepl + index*btb.BTBSetStride;
+		UINT64 node = 0, way = 0;
+		for (UINT32 level = 0; level < btb.BTBSetLevels; level++){
+			UINT64 bit = tree[node];
+			way = 2*way + bit;
+			node = 2*node + 1 + bit;
+		}
+		return way;
+	}
+	static VOID Fill(BTB& btb, UINT64 index, UINT64 way) { Hit(btb, index, way); }
+	static UINT64 StateBits(UINT64 ways) { return ways - 1; }
+};
+
+//2-bit re-reference prediction values: evict a way predicted for the
+//distant future (RRPV 3), insert with a long one (RRPV 2)
+struct REPL_SRRIP {
+	static const UINT8 RRPV_MAX = 3;
+	static VOID Hit(BTB& btb, UINT64 index, UINT64 way)
+	{
+		btb.BTBRepl[index*btb.BTBSetStride + way] = 0;
+	}
+	static UINT64 Victim(BTB& btb, UINT64 index)
+	{
+		UINT8* rrpv = btb.BTBRepl + index*btb.BTBSetStride;
+		const UINT64* tags = btb.BTBTags + index*btb.BTBSetStride;
+		for (;;){
+			for (UINT64 way = 0; way < btb.BTBSetSize; way++){
+				if (tags[way] == BTB::BTB_INVALID_TAG || rrpv[way] >= RRPV_MAX)
+					return way;
+			}
+			for (UINT64 way = 0; way < btb.BTBSetSize; way++)
+				rrpv[way]++;
+		}
+	}
+	static VOID Fill(BTB& btb, UINT64 index, UINT64 way)
+	{
+		btb.BTBRepl[index*btb.BTBSetStride + way] = RRPV_MAX - 1;
+	}
+	static UINT64 StateBits(UINT64 ways) { return 2*ways; }
+};
+
+//SRRIP that inserts with a distant RRPV, except 1 in 32 fills,
+//so branches used once do not flush the set
+struct REPL_BRRIP {
+	static VOID Hit(BTB& btb, UINT64 index, UINT64 way) { REPL_SRRIP::Hit(btb, index, way); }
+	static UINT64 Victim(BTB& btb, UINT64 index) { return REPL_SRRIP::Victim(btb, index); }
+	static VOID Fill(BTB& btb, UINT64 index, UINT64 way)
+	{
+		btb.BTBRepl[index*btb.BTBSetStride + way] =
+			(btb.rng.Below(32) == 0) ? REPL_SRRIP::RRPV_MAX - 1 : REPL_SRRIP::RRPV_MAX;
+	}
+	static UINT64 StateBits(UINT64 ways) { return 2*ways; }
+};
+
+struct REPL_RANDOM {
+	static VOID Hit(BTB& btb, UINT64 index, UINT64 way) {}
+	static UINT64 Victim(BTB& btb, UINT64 index) { return btb.rng.Below(btb.BTBSetSize); }
+	static VOID Fill(BTB& btb, UINT64 index, UINT64 way) {}
+	static UINT64 StateBits(UINT64 ways) { return 0; }	//one LFSR for the whole BTB
+};
+
+/* ===================================================================== */
+// BTB geometry
+/* ===================================================================== */
+//Is:     the geometry fits -btbs entries, -btba ways and -tags bits
+//Index:  the set of the branch at PC
+//Tag:    its tag
+//Stride: ways allocated per set
+
+//any size: shift and mask by the values of the BTB
+struct BTB_ANY_GEOMETRY {
+	static bool Is(UINT64 entries, UINT64 ways, UINT64 tagBits) { return true; }
+	static UINT64 Index(const BTB& btb, ADDRINT PC) { return PC & btb.BTBSetMask; }
+	static UINT64 Tag(const BTB& btb, ADDRINT PC) { return (PC >> btb.BTBSetShift) & btb.BTBTagMask; }
+	static UINT64 Stride(const BTB& btb) { return btb.BTBSetStride; }
+};
+
+//fetch-block mode (-fetchblock): sets indexed by fetch block, tags with the
+//offset of the branch in its block, so the branches of a block share a set
+struct BTB_BLOCK_GEOMETRY {
+	static bool Is(UINT64 entries, UINT64 ways, UINT64 tagBits) { return FetchBlockBits() != 0; }
+	static UINT64 Index(const BTB& btb, ADDRINT PC) { return (PC >> btb.BTBBlockBits) & btb.BTBSetMask; }
+	static UINT64 Tag(const BTB& btb, ADDRINT PC)
+	{
+		return ((PC >> btb.BTBBlockBits >> btb.BTBSetShift) & btb.BTBTagMask) << btb.BTBBlockBits
+		     | (PC & btb.BTBBlockMask);
+	}
+	static UINT64 Stride(const BTB& btb) { return btb.BTBSetStride; }
+};
+
+//2^LOG_SETS sets of WAYS ways with TAG_BITS tags, all compile time constants
+//(the set loop of FindWay is unrolled)
+template <UINT32 LOG_SETS, UINT32 WAYS, UINT32 TAG_BITS>
+struct BTB_GEOMETRY {
+	static const UINT64 STRIDE = (WAYS < BTB::BTB_CHUNK) ? WAYS
+	                           : (WAYS + BTB::BTB_CHUNK - 1) / BTB::BTB_CHUNK * BTB::BTB_CHUNK;
+	static bool Is(UINT64 entries, UINT64 ways, UINT64 tagBits)
+	{
+		return entries == ((UINT64)WAYS << LOG_SETS) && ways == WAYS && tagBits == TAG_BITS;
+	}
+	static UINT64 Index(const BTB& btb, ADDRINT PC) { return PC & (((UINT64)1 << LOG_SETS) - 1); }
+	static UINT64 Tag(const BTB& btb, ADDRINT PC) { return (PC >> LOG_SETS) & (((UINT64)1 << TAG_BITS) - 1); }
+	static UINT64 Stride(const BTB& btb) { return STRIDE; }
+};
+
+/* ===================================================================== */
+// Return address stack (-ras, -rasmode)
+/* ===================================================================== */
+//circular: calls push when they execute, predicted returns pop at fetch and
+//          nothing is repaired. A full stack overwrites its oldest entry.
+//repair:   predicted calls push and predicted returns pop at fetch. The top
+//          pointer and top entry are checkpointed first, and restored if
+//          the branch is not the call or return it was predicted to be.
+//linked:   as repair, but every push takes a new entry linked to the one
+//          below it, so only the top pointer is checkpointed and a wrong
+//          path pop loses no entry to the pushes after it.
+//A trace holds only the correct path: the wrong path operations modelled
+//are those of the mispredicted branches themselves.
+enum RAS_MODE {
+	RAS_CIRCULAR,
+	RAS_REPAIR,
+	RAS_LINKED,
+	RAS_MODES
+};
+
+static const char *RAS_MODE_NAMES[RAS_MODES] = { "circular", "repair", "linked" };
+
+static const UINT32 RAS_DEPTH_BUCKETS = 65;		//call depths 0 to 63, 64+
+
+class RETURN_STACK {
+ADDRINT* entries;
+UINT64* links;		//linked: the entry below each entry
+UINT64 size;
+UINT64 top;			//entry at the top of the stack
+UINT64 depth;		//valid entries
+UINT64 next;		//linked: next entry to take
+UINT32 mode;
+
+//checkpoint of the last speculative push or pop
+UINT64 savedTop;
+UINT64 savedDepth;
+ADDRINT savedEntry;
+
+UINT64 callDepth;	//calls minus returns executed: the depth of the next return
+
+//counters
+UINT64 cnt_overflows;	//pushes that overwrote the oldest entry
+UINT64 cnt_underflows;	//pops of an empty stack
+UINT64 cnt_repairs;		//checkpoints restored
+UINT64 cnt_returns[RAS_DEPTH_BUCKETS];		//executed returns by call depth
+UINT64 cnt_correct[RAS_DEPTH_BUCKETS];		//of them, predicted correctly
+
+public:
+RETURN_STACK(UINT64 rasSize, UINT32 rasMode);
+
+UINT32 Mode() const { return mode; }
+UINT64 Overflows() const { return __atomic_load_n(&cnt_overflows, __ATOMIC_RELAXED); }
+
+/*!
+// Push the return address of a call.
+ * @param[in]   returnAddr      address of the instruction after the call
+ */
+inline VOID Push(ADDRINT returnAddr)
+{
+	if (mode == RAS_LINKED){
+		links[next] = top;
+		top = next;
+		next = (next + 1) % size;
+	}
+	else {
+		top = (top + 1) % size;
+	}
+	entries[top] = returnAddr;
+	if (depth == size)
+		cnt_overflows++;
+	else
+		depth++;
+}
+
+/*!
+// Pop the predicted return address. An empty stack still returns its
+// stale top entry, as the hardware would.
+ */
+inline ADDRINT Pop()
+{
+	ADDRINT returnAddr = entries[top];
+	if (depth == 0)
+		cnt_underflows++;
+	else
+		depth--;
+	if (mode == RAS_LINKED)
+		top = links[top];
+	else
+		top = (top == 0) ? size-1 : top-1;
+	return returnAddr;
+}
+
+//save the state a speculative push or pop changes
+inline VOID Checkpoint()
+{
+	savedTop = top;
+	savedDepth = depth;
+	savedEntry = entries[top];
+}
+
+//undo the speculative push or pop since the checkpoint
+inline VOID Repair()
+{
+	top = savedTop;
+	depth = savedDepth;
+	if (mode == RAS_REPAIR)
+		entries[top] = savedEntry;
+	cnt_repairs++;
+}
+
+/*!
+// Count an executed branch: calls and returns give the call depth, and
+// returns are counted at their depth.
+ * @param[in]   isCall          true if this is a subroutine call
+ * @param[in]   isReturn        true if this is a subroutine return
+ * @param[in]   correct         true if direction and target were predicted
+ */
+inline VOID CountBranch(bool isCall, bool isReturn, bool correct)
+{
+	if (isCall)
+		callDepth++;
+	if (isReturn){
+		UINT32 bucket = (callDepth < RAS_DEPTH_BUCKETS-1) ? callDepth : RAS_DEPTH_BUCKETS-1;
+		cnt_returns[bucket]++;
+		cnt_correct[bucket] += correct;
+		if (callDepth > 0)
+			callDepth--;
+	}
+}
+
+VOID MergeCounters(const RETURN_STACK& other);
+std::string ReportCounters() const;
+
+VOID SaveState(STATE_WRITER& out) const;
+VOID LoadState(STATE_READER& in);
+}; // end class RETURN_STACK
+
+// Constructor
+/////////////////////////////////////////////////////////////////////////////////////////////
+RETURN_STACK::RETURN_STACK(UINT64 rasSize, UINT32 rasMode) {
+	size = rasSize;
+	mode = rasMode;
+	entries = (ADDRINT*) malloc(size*sizeof(ADDRINT));
+	links = (UINT64*) malloc(size*sizeof(UINT64));
+	for (UINT64 i=0; i<size; i++){
+		entries[i] = 0;
+		links[i] = (i == 0) ? size-1 : i-1;
+	}
+	top = size-1;		//the first push takes entry 0
+	depth = 0;
+	next = 0;
+	Checkpoint();
+	callDepth = 0;
+
+	cnt_overflows = 0;
+	cnt_underflows = 0;
+	cnt_repairs = 0;
+	for (UINT32 i=0; i<RAS_DEPTH_BUCKETS; i++){
+		cnt_returns[i] = 0;
+		cnt_correct[i] = 0;
+	}
+}
+
+/*!
+// Add the counters of the RAS of the same configuration of another thread.
+ * @param[in]   other           RAS of another thread
+ */
+VOID RETURN_STACK::MergeCounters(const RETURN_STACK& other)
+{
+	cnt_overflows += other.cnt_overflows;
+	cnt_underflows += other.cnt_underflows;
+	cnt_repairs += other.cnt_repairs;
+	for (UINT32 i=0; i<RAS_DEPTH_BUCKETS; i++){
+		cnt_returns[i] += other.cnt_returns[i];
+		cnt_correct[i] += other.cnt_correct[i];
+	}
+}
+
+/*!
+// Save the entries, pointers and call depth (-save-state).
+ * @param[out]  out             checkpoint being written
+ */
+VOID RETURN_STACK::SaveState(STATE_WRITER& out) const
+{
+	out.PutArray(entries, size);
+	out.PutArray(links, size);
+	out.Put(top);
+	out.Put(depth);
+	out.Put(next);
+	out.Put(callDepth);
+}
+
+/*!
+// Restore the state saved by SaveState for a RAS of the same size and mode.
+ * @param[in]   in              checkpoint being read
+ */
+VOID RETURN_STACK::LoadState(STATE_READER& in)
+{
+	in.GetArray(entries, size);
+	in.GetArray(links, size);
+	in.Get(top);
+	in.Get(depth);
+	in.Get(next);
+	in.Get(callDepth);
+	Checkpoint();
+}
+
+std::string RETURN_STACK::ReportCounters() const
+{
+    std::ostringstream out;
+    out << " RAS (" << RAS_MODE_NAMES[mode] << ") overflows: " << cnt_overflows
+        << " underflows: " << cnt_underflows << " repairs: " << cnt_repairs << endl;
+    out << " RAS returns predicted by call depth:";
+    for (UINT32 i = 0; i < RAS_DEPTH_BUCKETS; i++) {
+        if (cnt_returns[i] == 0)
+            continue;
+        out << " " << i << (i == RAS_DEPTH_BUCKETS-1 ? "+:" : ":")
+            << cnt_correct[i] << "/" << cnt_returns[i];
+    }
+    out << endl;
+    return out.str();
+}
+
+/*!
+// Create the RAS of the -rasmode recovery. Exits on unknown modes.
+ * @param[in]   rasSize         entries
+ */
+RETURN_STACK* NewReturnStack(UINT64 rasSize)
+{
+	for (UINT32 i=0; i<RAS_MODES; i++){
+		if (KnobRASMode.Value() == RAS_MODE_NAMES[i])
+			return new RETURN_STACK(rasSize, i);
+	}
+	cerr << "ERROR: unknown RAS mode " << KnobRASMode.Value() << endl;
+	exit(-1);
+}
+
+/* ===================================================================== */
+// Branch Prediction Unit object & simulation methods
+/* ===================================================================== */
+//BTB hierarchy: an optional tiny L0 (-btbl0), the -btbs BTB as L1 and an
+//optional large L2 (-btbl2) behind it. A taken branch is predicted by the
+//closest level holding it, and costs the fetch bubbles of that level.
+enum BTB_LEVEL {
+	BTB_L0,
+	BTB_L1,
+	BTB_L2,
+	BTB_LEVELS		//no BTB level predicted the target
+};
+
+static const char *BTB_LEVEL_NAMES[BTB_LEVELS] = { "L0", "L1", "L2" };
+
+//Speculative RAS operation of a prediction, checked when the branch executes
+enum RAS_OP {
+	RAS_OP_NONE,
+	RAS_OP_PUSH,
+	RAS_OP_POP
+};
+
+class BPU {
+//Added class variables
+///////////////////////////////
+BTB* btb;	//L1: private, or shared between the threads of the application
+BTB* btbL0;	//private, NULL without -btbl0
+BTB* btbL2;	//private, NULL without -btbl2
+UINT32 targetLevel;			//BTB_LEVEL of the last PredictTarget
+UINT64 cnt_levelHits[BTB_LEVELS];
+
+RETURN_STACK* RAS;
+bool rasBTB;				//-rasbtb: calls and returns known only from the BTB
+UINT32 rasOp;				//RAS_OP of the last PredictTarget
+
+DIRECTION_PREDICTOR* DP;
+ITTAGE* IND;	//indirect target predictor, NULL with -ind btb
+
+//fetch-block mode (-fetchblock): the entries of the block being fetched,
+//read by its one BTB lookup, serve all of its branches
+UINT32 fetchBlockBits;		//0 without fetch-block mode
+BTB_BLOCK_ENTRY* blockEntries;
+UINT32 blockEntryCount;
+ADDRINT fetchBlock;			//block of blockEntries
+bool blockFetched;			//false after a taken or mispredicted branch
+UINT32 blockLookups;		//lookups for the last branch, read by BlockLookups
+
+template <class POLICY, class GEOMETRY>
+bool LookupBTB(ADDRINT PC, ADDRINT& target, UINT8& flags);
+template <class POLICY>
+VOID FetchBlock(ADDRINT PC);
+bool LookupFetchedBlock(ADDRINT PC, ADDRINT& target, UINT8& flags);
+
+///////////////////////////////
+
+public:
+BPU(UINT64 btbSize, UINT64 btbAssoc, UINT64 tagSize, UINT64 rasSize,
+    REPL_BITS_FN replBits, BTB* sharedBTB = NULL);
+
+BTB* GetBTB() const { return btb; }
+UINT64 RASOverflows() const { return RAS->Overflows(); }
+UINT32 TargetLevel() const { return targetLevel; }
+UINT32 BlockLookups() const { return blockLookups; }
+
+bool PredictDirection(ADDRINT PC,
+                      bool isControlFlow,
+                      bool brTaken);
+
+template <class POLICY, class GEOMETRY>
+ADDRINT PredictTarget(ADDRINT PC,
+                      ADDRINT fallThroughAddr,
+                      bool predictDir,
+                      bool isCall,
+                      bool isReturn,
+                      bool isIndirect);
+
+template <class POLICY, class GEOMETRY>
+VOID UpdatePredictor(ADDRINT PC,         // address of instruction executing now
+                     bool brTaken,       // the actual direction
+                     ADDRINT targetPC,   // the next PC, **if taken**
+                     ADDRINT returnAddr, // return address for subroutine calls,
+                     bool isCall,        // is a subroutine call
+                     bool isReturn,      // is a return from subroutine
+                     bool isIndirect,    // is an indirect jump or call
+                     bool correctDir,    // my direction prediction was correct
+                     bool correctTarg);  // my target prediction was correct
+
+VOID MergeCounters(const BPU& other);
+std::string ReportCounters();
+
+VOID SaveState(STATE_WRITER& out) const;
+VOID LoadState(STATE_READER& in, bool loadBTB);
+
+}; // end class BPU 
+
+/*!
+ * Predicts the direction of instruction at address PC: true - branch is taken 
+ *   Control flow instructions are predicted by the -dp direction predictor
+ * This function is called for every instruction executed.
+ * @param[in]   PC              address of current instruction
+ * @param[in]   isControlFlow   true if instruction may change control flow
+ * @param[in]   brTaken         true if instruction takes a branch
+ */
+bool BPU::PredictDirection(ADDRINT PC,
+                           bool isControlFlow,
+                           bool brTaken)
+{
+    if (!isControlFlow) {
+        // CHEAT: can't do this in real hardware!
+        // Don't make wrong predictions on normal instructions!
+        // Phantom branches may appear if this is modified:
+        //  normal instructions mistaken for branches because they are predicted
+        //  taken and have a target address in the BTB....
+        return brTaken; // should be false.
+    }
+    return DP->Predict(PC, brTaken);
+}
+
+
+/*!
+// Initialize data structures for branch predictors here.
+// @note  Use KNOBs to pass parameters to the BPU, such as:
+//   number of entries, associativity, RAS entries, replacement policies, ...
+ */
+
+// Constructor
+/////////////////////////////////////////////////////////////////////////////////////////////
+BPU::BPU(UINT64 btbSize, UINT64 btbAssoc, UINT64 tagSize, UINT64 rasSize,
+         REPL_BITS_FN replBits, BTB* sharedBTB) {
+	btb = (sharedBTB != NULL) ? sharedBTB : new BTB(btbSize, btbAssoc, tagSize, replBits);
+	UINT64 l0Size = KnobBTBL0Size.Value();
+	UINT64 l2Size = KnobBTBL2Size.Value();
+	//the fully associative L0 has no set bits: its tags keep the PC bits
+	//of the L1 index too, so branches the L1 tells apart do not alias
+	UINT64 l0TagSize = std::min(CeilLog2(btbSize/btbAssoc) + tagSize, (UINT64)63);
+	btbL0 = (l0Size > 0) ? new BTB(l0Size, l0Size, l0TagSize, replBits) : NULL;
+	btbL2 = (l2Size > 0) ? new BTB(l2Size, KnobBTBL2Assoc.Value(), tagSize, replBits) : NULL;
+	targetLevel = BTB_LEVELS;
+	for (UINT32 i=0; i<BTB_LEVELS; i++)
+		cnt_levelHits[i] = 0;
+
+	RAS = NewReturnStack(rasSize);
+	rasBTB = KnobRASFromBTB.Value();
+	rasOp = RAS_OP_NONE;
+
+	DP = NewDirectionPredictor(KnobDirPredictor.Value());
+	if (DP == NULL){
+		cerr << "ERROR: unknown direction predictor " << KnobDirPredictor.Value() << endl;
+		exit(-1);
+	}
+	IND = NewIndirectPredictor();
+
+	fetchBlockBits = FetchBlockBits();
+	blockEntries = (BTB_BLOCK_ENTRY*) malloc(btbAssoc*sizeof(BTB_BLOCK_ENTRY));
+	blockEntryCount = 0;
+	fetchBlock = 0;
+	blockFetched = false;
+	blockLookups = 0;
+}
+
+
+/*!
+// Look up the branch at address PC in the BTB levels, the closest first.
+// A hit in a farther level fills the levels before it, as its entry moves
+// toward the front-end. Sets targetLevel to the level that hit.
+ * @param[in]   PC              address of current instruction
+ * @param[out]  target          BTA of the entry found
+ * @param[out]  flags           BTB_FLAG_* of the entry found
+ */
+template <class POLICY, class GEOMETRY>
+inline bool BPU::LookupBTB(ADDRINT PC, ADDRINT& target, UINT8& flags)
+{
+	if (btbL0 != NULL && btbL0->Lookup<POLICY, BTB_ANY_GEOMETRY>(PC, target, flags)){
+		targetLevel = BTB_L0;
+		cnt_levelHits[BTB_L0]++;
+		return true;
+	}
+	if (btb->Lookup<POLICY, GEOMETRY>(PC, target, flags))
+		targetLevel = BTB_L1;
+	else if (btbL2 != NULL && btbL2->Lookup<POLICY, BTB_ANY_GEOMETRY>(PC, target, flags)){
+		targetLevel = BTB_L2;
+		btb->Fill<POLICY, GEOMETRY>(PC, target, flags);
+	}
+	else {
+		targetLevel = BTB_LEVELS;
+		return false;
+	}
+	cnt_levelHits[targetLevel]++;
+	if (btbL0 != NULL)
+		btbL0->Fill<POLICY, BTB_ANY_GEOMETRY>(PC, target, flags);
+	return true;
+}
+
+/*!
+// Fetch-block mode: look up the fetch block of PC in the BTB, unless its
+// entries are still those of the last lookup.
+ * @param[in]   PC              address of the first branch fetched in the block
+ */
+template <class POLICY>
+inline VOID BPU::FetchBlock(ADDRINT PC)
+{
+	if (blockFetched && (PC >> fetchBlockBits) == fetchBlock)
+		return;
+	fetchBlock = PC >> fetchBlockBits;
+	blockEntryCount = btb->LookupBlock<POLICY>(PC, blockEntries);
+	blockFetched = true;
+	blockLookups++;
+}
+
+/*!
+// Fetch-block mode: find the branch at address PC in the entries of its
+// fetched block. Sets targetLevel as LookupBTB.
+ * @param[in]   PC              address of current instruction
+ * @param[out]  target          BTA of the entry found
+ * @param[out]  flags           BTB_FLAG_* of the entry found
+ */
+inline bool BPU::LookupFetchedBlock(ADDRINT PC, ADDRINT& target, UINT8& flags)
+{
+	for (UINT32 i=0; i<blockEntryCount; i++){
+		if (blockEntries[i].PC == PC){
+			target = blockEntries[i].target;
+			flags = blockEntries[i].flags;
+			targetLevel = BTB_L1;
+			cnt_levelHits[BTB_L1]++;
+			return true;
+		}
+	}
+	targetLevel = BTB_LEVELS;
+	return false;
+}
+
+/*!
+// Predict the target of the instruction at address PC by looking it up in 
+//  the BTB.  Use the direction prediction predictDir to decide between the
+//  target address in the BTB or the fallThroughAddr 
+ * @param[in]   PC              address of current instruction
+ * @param[in]   fallThroughAddr address of next, sequential instruction
+ * @param[in]   predictDir      the predicted direction of this "branch"
+ * @param[in]   isCall          true for subroutine calls, as predecoded
+ * @param[in]   isReturn        true for subroutine returns, as predecoded
+ * @param[in]   isIndirect      true for indirect jumps and calls (not returns)
+ */
+template <class POLICY, class GEOMETRY>
+ADDRINT BPU::PredictTarget(ADDRINT PC,
+                           ADDRINT fallThroughAddr,
+                           bool predictDir,
+                           bool isCall,
+                           bool isReturn,
+                           bool isIndirect)
+{
+	rasOp = RAS_OP_NONE;
+	//a fetch block is looked up once, whatever its branches predict
+	blockLookups = 0;
+	if (fetchBlockBits != 0)
+		FetchBlock<POLICY>(PC);
+	if (!predictDir) {    
+		targetLevel = BTB_LEVELS;
+		return fallThroughAddr;
+	}
+	
+	//find the branch in the BTB levels, or in its fetched block: the first
+	//branch predicted taken ends the block
+	ADDRINT target;
+	UINT8 flags = 0;
+	bool hit = (fetchBlockBits != 0) ? LookupFetchedBlock(PC, target, flags)
+	                                 : LookupBTB<POLICY, GEOMETRY>(PC, target, flags);
+
+	//calls and returns are predecoded, or with -rasbtb known from their BTB entry
+	bool predictCall = rasBTB ? (hit && (flags & BTB_FLAG_CALL)) : isCall;
+	bool predictReturn = rasBTB ? (hit && (flags & BTB_FLAG_RETURN)) : isReturn;
+
+	if (predictReturn){			//pop a RAS entry, even without a BTB hit
+		if (!hit)
+			targetLevel = BTB_L1;
+		if (RAS->Mode() != RAS_CIRCULAR)
+			RAS->Checkpoint();
+		rasOp = RAS_OP_POP;
+		return RAS->Pop();
+	}
+	if (predictCall && RAS->Mode() != RAS_CIRCULAR){	//push at fetch, repaired if wrong
+		RAS->Checkpoint();
+		RAS->Push(fallThroughAddr);
+		rasOp = RAS_OP_PUSH;
+	}
+
+	//an indirect branch takes the target of the indirect predictor, if it has one;
+	//it is read with the L1 BTB
+	ADDRINT indirectTarget;
+	if (isIndirect && IND != NULL && IND->Predict(PC, indirectTarget)){
+		if (!hit || targetLevel == BTB_L2)
+			targetLevel = BTB_L1;
+		return indirectTarget;
+	}
+
+	return hit ? target : fallThroughAddr;
+}
+
+/*!
+// Update the information in the BTB, RAS for the branch instruction
+// at address PC, using the fully available information now that it
+// has been executed.
+ * @param[in]   PC           address of current instruction
+ * @param[in]   brTaken      true if is actually taken
+ * @param[in]   targetPC     the target, if it is taken
+ * @param[in]   returnAddr   the return address, if it is a subroutine call
+ * @param[in]   isCall       true if this is a subroutine call
+ * @param[in]   isReturn     true if this is a subroutine return
+ * @param[in]   isIndirect   true if this is an indirect jump or call
+ * @param[in]   correctDir   true if the direction was predicted correctly
+ * @param[in]   correctTarg  true if the target was predicted correctly
+// @note Use KNOBs to pass parameters related to BTB prediction such as
+//   replacement policies, when to insert an entry, ...
+*/
+template <class POLICY, class GEOMETRY>
+VOID BPU::UpdatePredictor(ADDRINT PC,           // address of instruction executing now
+                          bool brTaken,      // the actual direction
+                          ADDRINT targetPC,     // the next PC, **if taken**
+                          ADDRINT returnAddr,   // return address for subroutine calls,
+                          bool isCall,       // is a subroutine call
+                          bool isReturn,     // is a return from subroutine
+                          bool isIndirect,   // is an indirect jump or call
+                          bool correctDir,   // my direction prediction was correct
+                          bool correctTarg)  // my target prediction was correct
+{
+	//Train the direction predictor
+	DP->Update(PC, brTaken, correctDir ? brTaken : !brTaken);
+
+	//Train the indirect target predictor, its history follows every branch
+	if (IND != NULL){
+		if (isIndirect && brTaken)
+			IND->Update(PC, targetPC, correctTarg);
+		IND->UpdateHistory(brTaken, targetPC);
+	}
+
+	//Return address stack
+	RAS->CountBranch(isCall, isReturn, correctDir && correctTarg);
+	if (RAS->Mode() == RAS_CIRCULAR){
+		if (isCall)		//push a RAS entry
+			RAS->Push(returnAddr);
+	}
+	else {
+		//undo a push or pop at fetch that was not for a call or return,
+		//and do the one that fetch missed
+		UINT32 rasExpected = isCall ? RAS_OP_PUSH : isReturn ? RAS_OP_POP : RAS_OP_NONE;
+		if (rasOp != rasExpected){
+			if (rasOp != RAS_OP_NONE)
+				RAS->Repair();
+			if (rasExpected == RAS_OP_PUSH)
+				RAS->Push(returnAddr);
+			else if (rasExpected == RAS_OP_POP)
+				RAS->Pop();
+		}
+	}
+	
+	//Update BTB, all levels
+	if (brTaken && !correctTarg){
+		UINT8 flags = (isReturn ? BTB_FLAG_RETURN : 0) | (isCall ? BTB_FLAG_CALL : 0);
+		btb->Update<POLICY, GEOMETRY>(PC, targetPC, flags);
+		if (btbL0 != NULL)
+			btbL0->Update<POLICY, BTB_ANY_GEOMETRY>(PC, targetPC, flags);
+		if (btbL2 != NULL)
+			btbL2->Update<POLICY, BTB_ANY_GEOMETRY>(PC, targetPC, flags);
+	}
+
+	//fetch-block mode: a taken branch ends the block, the next branch looks
+	//up its own; a not taken branch predicted taken restarts the fetch at
+	//its fall through, with a new lookup
+	if (fetchBlockBits != 0 && (brTaken || !(correctDir && correctTarg))){
+		blockFetched = false;
+		if (!brTaken)
+			FetchBlock<POLICY>(returnAddr);
+	}
+	return;
+}
+////////////////////////////////////////////////////////////////////////////////
+
+std::string BPU::ReportCounters()
+{
+    std::ostringstream out;
+    out << " Direction predictor: " << DP->Name()
+        << " (" << DP->StorageBits() << " bits)" << endl;
+    if (IND != NULL)
+        out << " Indirect predictor: ittage (" << IND->StorageBits() << " bits), "
+            << IND->Provided() << " targets from tagged tables" << endl;
+    out << btb->ReportCounters();
+    if (btbL0 != NULL || btbL2 != NULL) {
+        out << " BTB level hits:";
+        for (UINT32 i = 0; i < BTB_LEVELS; i++)
+            out << " " << BTB_LEVEL_NAMES[i] << " " << cnt_levelHits[i];
+        out << endl;
+        if (btbL0 != NULL)
+            out << " L0 BTB (" << btbL0->Capacity() << " entries):" << endl << btbL0->ReportCounters();
+        if (btbL2 != NULL)
+            out << " L2 BTB (" << btbL2->Capacity() << " entries):" << endl << btbL2->ReportCounters();
+    }
+    out << RAS->ReportCounters();
+    return out.str();
+}
+
+/*!
+// Add the counters of the BPU of the same configuration of another thread.
+ * @param[in]   other           BPU of another thread
+ */
+VOID BPU::MergeCounters(const BPU& other)
+{
+	RAS->MergeCounters(*other.RAS);
+	for (UINT32 i=0; i<BTB_LEVELS; i++)
+		cnt_levelHits[i] += other.cnt_levelHits[i];
+	if (btb != other.btb)	//a shared BTB counts for all threads
+		btb->MergeCounters(*other.btb);
+	if (btbL0 != NULL)
+		btbL0->MergeCounters(*other.btbL0);
+	if (btbL2 != NULL)
+		btbL2->MergeCounters(*other.btbL2);
+}
+
+/*!
+// Save the BTBs, RAS and direction predictor (-save-state).
+ * @param[out]  out             checkpoint being written
+ */
+VOID BPU::SaveState(STATE_WRITER& out) const
+{
+	size_t section = out.BeginSection();
+	btb->SaveState(out);
+	out.EndSection(section);
+
+	//L0 and L2: their entries, then their section if they exist
+	BTB* const levels[2] = { btbL0, btbL2 };
+	for (UINT32 i=0; i<2; i++){
+		out.Put((UINT64)(levels[i] != NULL ? levels[i]->Capacity() : 0));
+		if (levels[i] != NULL){
+			section = out.BeginSection();
+			levels[i]->SaveState(out);
+			out.EndSection(section);
+		}
+	}
+
+	out.PutString(RAS_MODE_NAMES[RAS->Mode()]);
+	RAS->SaveState(out);
+
+	out.PutString(DP->Name());
+	out.Put(DP->StorageBits());
+	DP->SaveState(out);
+
+	out.Put((UINT64)(IND != NULL ? IND->StorageBits() : 0));
+	if (IND != NULL)
+		IND->SaveState(out);
+}
+
+/*!
+// Restore the state saved by SaveState for a BPU of the same configuration.
+// Exits if the L0 or L2 BTB, the RAS mode or the direction predictor differs.
+ * @param[in]   in              checkpoint being read
+ * @param[in]   loadBTB         false to keep the BTB, if it is shared and
+ *                              was already loaded by another thread
+ */
+VOID BPU::LoadState(STATE_READER& in, bool loadBTB)
+{
+	blockFetched = false;
+	if (loadBTB){
+		in.BeginSection();
+		btb->LoadState(in);
+		in.EndSection();
+	}
+	else {
+		in.SkipSection();
+	}
+
+	BTB* const levels[2] = { btbL0, btbL2 };
+	for (UINT32 i=0; i<2; i++){
+		UINT64 entries = 0;
+		in.Get(entries);
+		if (in.Ok() && entries != (levels[i] != NULL ? levels[i]->Capacity() : 0)){
+			cerr << "ERROR: predictor state has an " << (i == 0 ? "L0" : "L2") << " BTB of "
+			     << entries << " entries, not " << (levels[i] != NULL ? levels[i]->Capacity() : 0) << endl;
+			exit(-1);
+		}
+		if (levels[i] != NULL){
+			in.BeginSection();
+			levels[i]->LoadState(in);
+			in.EndSection();
+		}
+	}
+
+	std::string name;
+	in.GetString(name);
+	if (in.Ok() && name != RAS_MODE_NAMES[RAS->Mode()]){
+		cerr << "ERROR: predictor state has a " << name << " RAS, not "
+		     << RAS_MODE_NAMES[RAS->Mode()] << endl;
+		exit(-1);
+	}
+	RAS->LoadState(in);
+
+	UINT64 bits = 0;
+	in.GetString(name);
+	in.Get(bits);
+	if (in.Ok() && (name != DP->Name() || bits != DP->StorageBits())){
+		cerr << "ERROR: predictor state is for a " << name << " direction predictor of "
+		     << bits << " bits, not " << DP->Name() << " of " << DP->StorageBits() << endl;
+		exit(-1);
+	}
+	DP->LoadState(in);
+
+	bits = 0;
+	in.Get(bits);
+	if (in.Ok() && bits != (IND != NULL ? IND->StorageBits() : 0)){
+		cerr << "ERROR: predictor state has an indirect predictor of " << bits
+		     << " bits, not " << (IND != NULL ? IND->StorageBits() : 0) << endl;
+		exit(-1);
+	}
+	if (IND != NULL)
+		IND->LoadState(in);
+}
+
+/* ================================================================== */
+// Simulated configurations & counters
+/* ================================================================== */
+static const size_t CACHE_LINE = 64;
+
+/*!
+ * Allocate zeroed memory that starts and ends on cache line boundaries,
+ *  so state updated by different threads never shares a line.
+ * @param[in]   bytes           size of the allocation
+ */
+static VOID* AllocateCacheAligned(size_t bytes)
+{
+    VOID* p = NULL;
+    bytes = (bytes + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    if (posix_memalign(&p, CACHE_LINE, bytes) != 0) {
+        cerr << "ERROR: out of memory" << endl;
+        exit(-1);
+    }
+    memset(p, 0, bytes);
+    return p;
+}
+
+struct BPU_INSTANCE;
+struct BRANCH_STATS;
+
+// Control flow instructions by where their target comes from
+enum BRANCH_CLASS {
+    BRANCH_DIRECT,      // encoded in the instruction
+    BRANCH_INDIRECT,    // jumps and calls through a register or memory
+    BRANCH_RETURN,      // subroutine returns
+    BRANCH_CLASSES
+};
+
+static const char *BRANCH_CLASS_NAMES[BRANCH_CLASSES] = { "direct", "indirect", "return" };
+
+static inline UINT32 ClassOfBranch(bool isReturn, bool isIndirect)
+{
+    return isReturn ? BRANCH_RETURN : isIndirect ? BRANCH_INDIRECT : BRANCH_DIRECT;
+}
+
+// Front-end cycles lost to control flow, by cause
+enum LOST_CYCLES {
+    LOST_BUBBLES,       // taken branches predicted correctly: the BTB level latency
+    LOST_TARGET,        // target misses: direct ones redirected at decode, indirect at execute
+    LOST_DIRECTION,     // direction mispredictions, redirected at execute
+    LOST_RAS,           // mispredicted returns
+    LOST_KINDS
+};
+
+static const char *LOST_CYCLES_NAMES[LOST_KINDS] = { "bubbles", "target", "direction", "RAS" };
+
+// Costs of the front-end model (-lat0, -lat1, -lat2, -tpen, -dpen, -rpen, -fetchw),
+// read once from the KNOBs by CreateBPUs
+struct FRONT_END_MODEL {
+    UINT32 levelLatency[BTB_LEVELS+1];  // by BTB_LEVEL; 0 for BTB_LEVELS
+    UINT32 targetPenalty;
+    UINT32 directionPenalty;
+    UINT32 rasPenalty;
+    UINT32 fetchWidth;
+    UINT32 fetchBlockBits;  // log2(-fetchblock), 0 without fetch-block mode
+};
+
+static FRONT_END_MODEL frontEnd;
+
+// Simulates one branch on one configuration, compiled for its BTB replacement
+// policy and geometry, counting or only training
+// (SimulateInstance<POLICY, GEOMETRY, COUNT>)
+typedef VOID (*SIMULATE_INSTANCE_FN)(BPU_INSTANCE &instance, BRANCH_STATS *stats,
+                                     ADDRINT PC, ADDRINT targetPC, bool brTaken,
+                                     ADDRINT fallThroughAddr, bool isCall,
+                                     bool isReturn, bool isIndirect,
+                                     bool isControlFlow);
+
+// One simulated configuration: a Branch Prediction Unit and its counters.
+// All instances sit in one array so every branch is simulated by a single
+// analysis call that walks it, with one indirect call per instance.
+struct BPU_INSTANCE {
+    BPU *bpu;
+    SIMULATE_INSTANCE_FN simulate;
+    SIMULATE_INSTANCE_FN warm;      // warm-up: train without counting
+    UINT64 btbSize;
+    UINT64 btbAssoc;
+    UINT64 tagSize;
+    UINT64 rasSize;
+    const char *repl;   // BTB replacement policy
+    UINT64 cnt_correctPredDir;
+    UINT64 cnt_correctPredTarg;
+    UINT64 cnt_correctPred;
+    UINT64 cnt_correctPredClass[BRANCH_CLASSES];    // cnt_correctPred by BRANCH_CLASS
+    UINT64 cnt_lostCycles[LOST_KINDS];              // front-end cycles lost, by LOST_CYCLES
+    UINT64 cnt_blockLookups;                        // -fetchblock: BTB lookups of blocks with branches
+};
+
+/* ================================================================== */
+// Per static branch profile (-topn)
+/* ================================================================== */
+
+// Static branches get consecutive slots, assigned once (at instrumentation
+// time in the PIN tool), so the analysis path indexes instead of hashing.
+static const UINT32 NO_BRANCH_SLOT = 0xffffffff;
+static const UINT32 PROFILE_CHUNK_BITS = 12;
+static const UINT32 PROFILE_CHUNKS = 4096;   // up to 16M static branches
+
+// Counters of one static branch, for the first configuration
+struct BRANCH_STATS {
+    UINT64 executed;
+    UINT64 taken;
+    UINT64 dirMisses;
+    UINT64 targMisses;
+    UINT64 mispredicted;  // direction or target wrong
+};
+
+/*!
+ * Branch counters of one instruction stream, indexed by slot. Stored in
+ *  chunks allocated on first use, so slots can be handed out while the
+ *  stream runs without ever moving the counters.
+ */
+class BRANCH_PROFILE {
+BRANCH_STATS *chunks[PROFILE_CHUNKS];
+
+public:
+BRANCH_PROFILE() { memset(chunks, 0, sizeof(chunks)); }
+
+inline BRANCH_STATS& Slot(UINT32 slot)
+{
+	BRANCH_STATS *&chunk = chunks[slot >> PROFILE_CHUNK_BITS];
+	if (chunk == NULL)
+		chunk = (BRANCH_STATS*) AllocateCacheAligned(sizeof(BRANCH_STATS) << PROFILE_CHUNK_BITS);
+	return chunk[slot & ((1 << PROFILE_CHUNK_BITS) - 1)];
+}
+
+// NULL if the slot was never executed
+const BRANCH_STATS* Find(UINT32 slot) const
+{
+	const BRANCH_STATS *chunk = chunks[slot >> PROFILE_CHUNK_BITS];
+	return chunk ? &chunk[slot & ((1 << PROFILE_CHUNK_BITS) - 1)] : NULL;
+}
+
+VOID Merge(const BRANCH_PROFILE &other, UINT32 numSlots)
+{
+	for (UINT32 slot = 0; slot < numSlots; slot++) {
+		const BRANCH_STATS *s = other.Find(slot);
+		if (s == NULL || s->executed == 0)
+			continue;
+		BRANCH_STATS &t = Slot(slot);
+		t.executed     += s->executed;
+		t.taken        += s->taken;
+		t.dirMisses    += s->dirMisses;
+		t.targMisses   += s->targMisses;
+		t.mispredicted += s->mispredicted;
+	}
+}
+};
+
+/*!
+ * The static branches seen so far: their slots, looked up by PC in an
+ *  open addressing hash table, and their names for the report.
+ */
+class BRANCH_SITES {
+std::vector<ADDRINT> keys;     // PC of each hash table entry, 0 if free
+std::vector<UINT32> values;    // slot of each hash table entry
+
+VOID Grow()
+{
+	std::vector<ADDRINT> oldKeys(keys.size() ? keys.size()*2 : 4096, 0);
+	std::vector<UINT32> oldValues(oldKeys.size(), NO_BRANCH_SLOT);
+	oldKeys.swap(keys);
+	oldValues.swap(values);
+	for (UINT32 i = 0; i < oldKeys.size(); i++) {
+		if (oldKeys[i] != 0)
+			Insert(oldKeys[i], oldValues[i]);
+	}
+}
+
+VOID Insert(ADDRINT PC, UINT32 slot)
+{
+	UINT64 mask = keys.size() - 1;
+	UINT64 i = (PC * 0x9e3779b97f4a7c15ULL) >> 20;
+	while (keys[i & mask] != 0)
+		i++;
+	keys[i & mask] = PC;
+	values[i & mask] = slot;
+}
+
+public:
+std::vector<ADDRINT> PCs;           // by slot
+std::vector<std::string> routines;  // by slot, empty if unknown
+std::vector<std::string> images;    // by slot, empty if unknown
+
+UINT32 Size() const { return PCs.size(); }
+
+/*!
+ * Slot of the branch at PC, NO_BRANCH_SLOT if it has none yet.
+ */
+inline UINT32 Find(ADDRINT PC) const
+{
+	if (keys.empty())
+		return NO_BRANCH_SLOT;
+	UINT64 mask = keys.size() - 1;
+	for (UINT64 i = (PC * 0x9e3779b97f4a7c15ULL) >> 20; keys[i & mask] != 0; i++) {
+		if (keys[i & mask] == PC)
+			return values[i & mask];
+	}
+	return NO_BRANCH_SLOT;
+}
+
+/*!
+ * Slot of the branch at PC, adding it if it is new.
+ * @param[in]   PC              address of the branch
+ * @param[out]  added           true if the branch was new
+ */
+UINT32 Add(ADDRINT PC, bool &added)
+{
+	UINT32 slot = Find(PC);
+	added = (slot == NO_BRANCH_SLOT);
+	if (!added || PCs.size() == PROFILE_CHUNKS << PROFILE_CHUNK_BITS)
+		return slot;
+	if ((PCs.size() + 1) * 2 > keys.size())   // keep the load under 1/2
+		Grow();
+	slot = PCs.size();
+	Insert(PC, slot);
+	PCs.push_back(PC);
+	routines.push_back("");
+	images.push_back("");
+	return slot;
+}
+};
+
+// Counter snapshots of an instruction stream (-interval), kept in memory
+// and only written out at the end, so taking one costs no I/O.
+// A snapshot is the cumulative counters, INTERVAL_STREAM_VALUES of the
+// stream followed by INTERVAL_BPU_VALUES for every configuration.
+static const UINT32 INTERVAL_STREAM_VALUES = 3;  // instructions, branches, taken
+static const UINT32 INTERVAL_BPU_VALUES = 5;     // correct dir, targ, both, BTB entries, RAS overflows
+
+struct INTERVAL_SERIES {
+    std::vector<UINT64> values;
+    UINT32 width;           // values per snapshot
+};
+
+// One simulated instruction stream (an application thread, or a trace):
+// its Branch Prediction Units and counters.
+struct SIM_STATE {
+    UINT64 cnt_instr;
+    UINT64 cnt_instr_detail;  // in detailed windows, all of cnt_instr without sampling
+    UINT64 cnt_branches;
+    UINT64 cnt_branches_taken;
+    UINT64 cnt_branches_class[BRANCH_CLASSES];  // cnt_branches by BRANCH_CLASS
+    BPU_INSTANCE *bpus;  // The Branch Prediction Units
+    UINT32 numBPUs;
+    BRANCH_PROFILE *profile;  // Per static branch counters, NULL without -topn
+    UINT64 nextInterval;      // cnt_instr of the next snapshot, ~0 without -interval
+    INTERVAL_SERIES *intervals;
+    bool warming;             // in a warm-up window: train, do not count
+    // Fetch-block mode (-fetchblock): the stream as aligned fetch blocks
+    UINT64 cnt_fetchBlocks;
+    UINT64 cnt_emptyBlocks;   // fetched blocks without a branch: a lookup that finds nothing
+    ADDRINT fetchBlock;       // block being fetched, after a not taken branch
+    ADDRINT fetchPC;          // target of the last branch, if it was taken
+    bool fetchBlockOpen;      // false after a taken branch: the next block is new
+};
+
+//extra statistics
+//////////////////////////////////////////////////////////
+//static UINT64 isCallCounter = 0;
+//static UINT64 isReturnCounter = 0;
+//////////////////////////////////////////////////////////
+
+template <class POLICY, class GEOMETRY, bool COUNT>
+static VOID SimulateInstance(BPU_INSTANCE &instance, BRANCH_STATS *stats,
+                             ADDRINT PC, ADDRINT targetPC, bool brTaken,
+                             ADDRINT fallThroughAddr, bool isCall,
+                             bool isReturn, bool isIndirect,
+                             bool isControlFlow);
+
+/*!
+ *  Use the SimulateInstance of POLICY compiled for GEOMETRY, if it fits
+ *  the configuration of the instance.
+ * @param[in,out]  instance     configuration, its simulate and warm are set
+ */
+template <class POLICY, class GEOMETRY>
+static bool UseGeometry(BPU_INSTANCE &instance)
+{
+    if (!GEOMETRY::Is(instance.btbSize, instance.btbAssoc, instance.tagSize))
+        return false;
+    instance.simulate = SimulateInstance<POLICY, GEOMETRY, true>;
+    instance.warm     = SimulateInstance<POLICY, GEOMETRY, false>;
+    return true;
+}
+
+// Sweeps of many BTB sizes and policies run faster on the shared generic
+// path than on one compiled copy per variant competing for the I-cache
+static const UINT32 MAX_COMPILED_VARIANTS = 4;
+
+/*!
+ *  Set the simulate and warm functions of an instance using POLICY:
+ *  compiled for its geometry if it is a common one, generic otherwise.
+ * @param[in,out]  instance     configuration
+ * @param[in]      compiled     false to use the generic path for any geometry
+ */
+template <class POLICY>
+static VOID SelectInstance(BPU_INSTANCE &instance, bool compiled)
+{
+    // Fetch-block mode indexes the BTB by block
+    if (UseGeometry<POLICY, BTB_BLOCK_GEOMETRY>(instance))
+        return;
+    // log2(sets), ways and tag bits: 512 to 4096 entries, 1 to 8 ways, -tags 12
+    if (compiled
+        && (UseGeometry<POLICY, BTB_GEOMETRY<9, 1, 12> >(instance)
+            || UseGeometry<POLICY, BTB_GEOMETRY<8, 2, 12> >(instance)
+            || UseGeometry<POLICY, BTB_GEOMETRY<7, 4, 12> >(instance)
+            || UseGeometry<POLICY, BTB_GEOMETRY<6, 8, 12> >(instance)
+            || UseGeometry<POLICY, BTB_GEOMETRY<10, 1, 12> >(instance)
+            || UseGeometry<POLICY, BTB_GEOMETRY<9, 2, 12> >(instance)
+            || UseGeometry<POLICY, BTB_GEOMETRY<8, 4, 12> >(instance)
+            || UseGeometry<POLICY, BTB_GEOMETRY<7, 8, 12> >(instance)
+            || UseGeometry<POLICY, BTB_GEOMETRY<11, 1, 12> >(instance)
+            || UseGeometry<POLICY, BTB_GEOMETRY<10, 2, 12> >(instance)
+            || UseGeometry<POLICY, BTB_GEOMETRY<9, 4, 12> >(instance)
+            || UseGeometry<POLICY, BTB_GEOMETRY<8, 8, 12> >(instance)
+            || UseGeometry<POLICY, BTB_GEOMETRY<12, 1, 12> >(instance)
+            || UseGeometry<POLICY, BTB_GEOMETRY<11, 2, 12> >(instance)
+            || UseGeometry<POLICY, BTB_GEOMETRY<10, 4, 12> >(instance)
+            || UseGeometry<POLICY, BTB_GEOMETRY<9, 8, 12> >(instance)))
+        return;
+    UseGeometry<POLICY, BTB_ANY_GEOMETRY>(instance);
+}
+
+// The -repl values
+struct REPL_POLICY_INFO {
+    const char *name;
+    VOID (*select)(BPU_INSTANCE &instance, bool compiled);   // SelectInstance<POLICY>
+    REPL_BITS_FN stateBits;                                  // POLICY::StateBits
+};
+
+static const REPL_POLICY_INFO REPL_POLICIES[] = {
+    { "fifo",   SelectInstance<REPL_FIFO>,   REPL_FIFO::StateBits },
+    { "lru",    SelectInstance<REPL_LRU>,    REPL_LRU::StateBits },
+    { "plru",   SelectInstance<REPL_PLRU>,   REPL_PLRU::StateBits },
+    { "srrip",  SelectInstance<REPL_SRRIP>,  REPL_SRRIP::StateBits },
+    { "brrip",  SelectInstance<REPL_BRRIP>,  REPL_BRRIP::StateBits },
+    { "random", SelectInstance<REPL_RANDOM>, REPL_RANDOM::StateBits },
+};
+
+/*!
+ *  Number of -btbs values: one with -budget-kb, which picks the size.
+ */
+UINT32 NumberOfBTBSizes()
+{
+    return (KnobBudgetKB.Value() > 0) ? 1 : KnobBTBsize.NumberOfValues();
+}
+
+/*!
+ *  Number of combinations of the -btbs, -btba, -tags, -ras and -repl values.
+ */
+UINT32 NumberOfConfigurations()
+{
+    return NumberOfBTBSizes() * KnobBTBassoc.NumberOfValues()
+         * KnobBTBTagSize.NumberOfValues() * KnobRASsize.NumberOfValues()
+         * KnobBTBRepl.NumberOfValues();
+}
+
+/*!
+ *  Find a -repl policy by name. Exits on unknown names.
+ * @param[in]   name            policy name
+ */
+const REPL_POLICY_INFO& FindReplacementPolicy(const std::string &name)
+{
+    for (UINT32 i = 0; i < sizeof(REPL_POLICIES)/sizeof(REPL_POLICIES[0]); i++) {
+        if (name == REPL_POLICIES[i].name)
+            return REPL_POLICIES[i];
+    }
+    cerr << "ERROR: unknown BTB replacement policy " << name << endl;
+    exit(-1);
+}
+
+/*!
+ *  The most BTB entries, a power of two number of sets, that fit in the
+ *  -budget-kb storage budget. Exits if not even one set fits.
+ * @param[in]   ways            BTB associativity
+ * @param[in]   tagSize         tag bits
+ * @param[in]   policy          BTB replacement policy
+ */
+UINT64 BudgetEntries(UINT64 ways, UINT64 tagSize, const REPL_POLICY_INFO &policy)
+{
+    if (ways == 0)
+        return 0;   // rejected by CheckConfiguration
+    UINT64 budget = (UINT64) KnobBudgetKB.Value() * 8192;
+    UINT64 entries = 0;
+    for (UINT64 sets = 1; sets <= ((UINT64)1 << 32); sets *= 2) {
+        if (BTBStorageBits(sets * ways, ways, tagSize + FetchBlockBits(), policy.stateBits) > budget)
+            break;
+        entries = sets * ways;
+    }
+    if (entries == 0) {
+        cerr << "ERROR: a BTB set of " << ways << " ways and " << tagSize
+             << " bit tags does not fit in " << KnobBudgetKB.Value() << " KB" << endl;
+        exit(-1);
+    }
+    return entries;
+}
+
+/*!
+ *  Check the geometry of a configuration. Exits if it cannot be simulated.
+ * @param[in]   instance        configuration
+ */
+VOID CheckConfiguration(const BPU_INSTANCE &instance)
+{
+    UINT64 sets = (instance.btbAssoc == 0) ? 0 : instance.btbSize / instance.btbAssoc;
+    if (sets == 0 || sets * instance.btbAssoc != instance.btbSize || (sets & (sets - 1)) != 0) {
+        cerr << "ERROR: BTB of " << instance.btbSize << " entries and "
+             << instance.btbAssoc << " ways: the number of sets must be a power of two" << endl;
+        exit(-1);
+    }
+    if (instance.tagSize == 0 || instance.tagSize > 63) {
+        cerr << "ERROR: BTB tag size must be 1 to 63 bits, not " << instance.tagSize << endl;
+        exit(-1);
+    }
+    if (instance.rasSize == 0) {
+        cerr << "ERROR: RAS size must be at least 1" << endl;
+        exit(-1);
+    }
+    // Fetch-block mode looks up one BTB level, with the block offset in the tags
+    if (FetchBlockBits() != 0
+        && (KnobBTBL0Size.Value() > 0 || KnobBTBL2Size.Value() > 0 || instance.tagSize + FetchBlockBits() > 63)) {
+        cerr << "ERROR: -fetchblock needs a single BTB level and tags of at most "
+             << 63 - FetchBlockBits() << " bits" << endl;
+        exit(-1);
+    }
+    if (KnobTargetBits.Value() >= BTB_VA_BITS
+        || (KnobTargetBits.Value() > 0 && KnobRegions.Value() == 0)) {
+        cerr << "ERROR: BTB targets need fewer than " << BTB_VA_BITS
+             << " offset bits and at least one region" << endl;
+        exit(-1);
+    }
+    if (strcmp(instance.repl, "plru") == 0
+        && (instance.btbAssoc & (instance.btbAssoc - 1)) != 0) {
+        cerr << "ERROR: plru needs a power of two BTB associativity" << endl;
+        exit(-1);
+    }
+
+    // The L0 BTB is fully associative, the L2 BTB set associative
+    UINT64 l0Size = KnobBTBL0Size.Value();
+    UINT64 l2Size = KnobBTBL2Size.Value();
+    UINT64 l2Assoc = KnobBTBL2Assoc.Value();
+    UINT64 l2Sets = (l2Assoc == 0) ? 0 : l2Size / l2Assoc;
+    if (l2Size > 0 && (l2Sets == 0 || l2Sets * l2Assoc != l2Size || (l2Sets & (l2Sets - 1)) != 0)) {
+        cerr << "ERROR: L2 BTB of " << l2Size << " entries and " << l2Assoc
+             << " ways: the number of sets must be a power of two" << endl;
+        exit(-1);
+    }
+    if (strcmp(instance.repl, "plru") == 0
+        && ((l0Size & (l0Size - 1)) != 0 || (l2Size > 0 && (l2Assoc & (l2Assoc - 1)) != 0))) {
+        cerr << "ERROR: plru needs a power of two L0 BTB size and L2 BTB associativity" << endl;
+        exit(-1);
+    }
+}
+
+/*!
+ *  Read the costs of the front-end model from the KNOBs. Exits if they are invalid.
+ */
+VOID SetFrontEndModel()
+{
+    frontEnd.levelLatency[BTB_L0] = KnobL0Latency.Value();
+    frontEnd.levelLatency[BTB_L1] = KnobL1Latency.Value();
+    frontEnd.levelLatency[BTB_L2] = KnobL2Latency.Value();
+    frontEnd.levelLatency[BTB_LEVELS] = 0;
+    frontEnd.targetPenalty = KnobTargetPenalty.Value();
+    frontEnd.directionPenalty = KnobDirPenalty.Value();
+    frontEnd.rasPenalty = KnobRASPenalty.Value();
+    frontEnd.fetchWidth = KnobFetchWidth.Value();
+    if (frontEnd.fetchWidth == 0) {
+        cerr << "ERROR: fetch width must be at least 1" << endl;
+        exit(-1);
+    }
+    UINT32 blockBytes = KnobFetchBlock.Value();
+    if (blockBytes != 0 && (blockBytes < 4 || blockBytes > 4096 || (blockBytes & (blockBytes - 1)) != 0)) {
+        cerr << "ERROR: fetch block must be a power of two of 4 to 4096 bytes, not " << blockBytes << endl;
+        exit(-1);
+    }
+    frontEnd.fetchBlockBits = FetchBlockBits();
+}
+
+/*!
+ *  Create one BPU for every combination of the -btbs, -btba, -tags,
+ *  -ras and -repl values, and clear the counters.
+ * @param[out]  sim             simulation state to initialise
+ * @param[in]   sharedBTBs      NULL for private BTBs, or one BTB per
+ *                              configuration shared by all SIM_STATEs;
+ *                              NULL entries are created and filled in
+ */
+VOID CreateBPUs(SIM_STATE &sim, BTB **sharedBTBs)
+{
+    SetFrontEndModel();
+    UINT32 variants = NumberOfBTBSizes() * KnobBTBassoc.NumberOfValues()
+                      * KnobBTBTagSize.NumberOfValues() * KnobBTBRepl.NumberOfValues();
+    std::vector<BPU_INSTANCE> grid;
+    for (UINT32 s = 0; s < NumberOfBTBSizes(); s++)
+    for (UINT32 a = 0; a < KnobBTBassoc.NumberOfValues(); a++)
+    for (UINT32 t = 0; t < KnobBTBTagSize.NumberOfValues(); t++)
+    for (UINT32 r = 0; r < KnobRASsize.NumberOfValues(); r++)
+    for (UINT32 p = 0; p < KnobBTBRepl.NumberOfValues(); p++) {
+        BPU_INSTANCE instance;
+        const REPL_POLICY_INFO &policy = FindReplacementPolicy(KnobBTBRepl.Value(p));
+        instance.btbAssoc = KnobBTBassoc.Value(a);
+        instance.tagSize  = KnobBTBTagSize.Value(t);
+        instance.btbSize  = (KnobBudgetKB.Value() > 0)
+                          ? BudgetEntries(instance.btbAssoc, instance.tagSize, policy)
+                          : KnobBTBsize.Value(s);
+        instance.rasSize  = KnobRASsize.Value(r);
+        instance.repl     = policy.name;
+        CheckConfiguration(instance);
+        policy.select(instance, variants <= MAX_COMPILED_VARIANTS);
+        BTB *btb = (sharedBTBs != NULL) ? sharedBTBs[grid.size()] : NULL;
+        instance.bpu = new BPU(instance.btbSize, instance.btbAssoc,
+                               instance.tagSize, instance.rasSize, policy.stateBits, btb);
+        if (sharedBTBs != NULL && btb == NULL) {
+            sharedBTBs[grid.size()] = instance.bpu->GetBTB();
+            sharedBTBs[grid.size()]->Share();
+        }
+        instance.cnt_correctPredDir  = 0;
+        instance.cnt_correctPredTarg = 0;
+        instance.cnt_correctPred     = 0;
+        for (UINT32 c = 0; c < BRANCH_CLASSES; c++)
+            instance.cnt_correctPredClass[c] = 0;
+        for (UINT32 k = 0; k < LOST_KINDS; k++)
+            instance.cnt_lostCycles[k] = 0;
+        instance.cnt_blockLookups = 0;
+        grid.push_back(instance);
+    }
+
+    sim.cnt_instr = 0;
+    sim.cnt_instr_detail = 0;
+    sim.cnt_branches = 0;
+    sim.cnt_branches_taken = 0;
+    for (UINT32 c = 0; c < BRANCH_CLASSES; c++)
+        sim.cnt_branches_class[c] = 0;
+    sim.numBPUs = grid.size();
+    sim.bpus = (BPU_INSTANCE*) AllocateCacheAligned(sim.numBPUs*sizeof(BPU_INSTANCE));
+    for (UINT32 i = 0; i < sim.numBPUs; i++)
+        sim.bpus[i] = grid[i];
+    sim.profile = (KnobTopN.Value() > 0) ? new BRANCH_PROFILE() : NULL;
+    sim.nextInterval = ~(UINT64)0;
+    sim.intervals = NULL;
+    sim.warming = false;
+    sim.cnt_fetchBlocks = 0;
+    sim.cnt_emptyBlocks = 0;
+    sim.fetchBlock = 0;
+    sim.fetchPC = 0;
+    sim.fetchBlockOpen = false;
+    if (KnobInterval.Value() > 0) {
+        sim.nextInterval = KnobInterval.Value();
+        sim.intervals = new INTERVAL_SERIES();
+        sim.intervals->width = INTERVAL_STREAM_VALUES + INTERVAL_BPU_VALUES*sim.numBPUs;
+    }
+}
+
+/*!
+ *  Add the counters of one simulation state to another with the same
+ *  configurations.
+ * @param[in,out]  total        merged counters
+ * @param[in]      sim          counters to add
+ * @param[in]      numSlots     static branches profiled (-topn)
+ */
+VOID MergeResults(SIM_STATE &total, const SIM_STATE &sim, UINT32 numSlots)
+{
+    total.cnt_instr += sim.cnt_instr;
+    total.cnt_instr_detail += sim.cnt_instr_detail;
+    total.cnt_branches += sim.cnt_branches;
+    total.cnt_branches_taken += sim.cnt_branches_taken;
+    for (UINT32 c = 0; c < BRANCH_CLASSES; c++)
+        total.cnt_branches_class[c] += sim.cnt_branches_class[c];
+    total.cnt_fetchBlocks += sim.cnt_fetchBlocks;
+    total.cnt_emptyBlocks += sim.cnt_emptyBlocks;
+    for (UINT32 i = 0; i < total.numBPUs; i++) {
+        total.bpus[i].cnt_correctPredDir  += sim.bpus[i].cnt_correctPredDir;
+        total.bpus[i].cnt_correctPredTarg += sim.bpus[i].cnt_correctPredTarg;
+        total.bpus[i].cnt_correctPred     += sim.bpus[i].cnt_correctPred;
+        for (UINT32 c = 0; c < BRANCH_CLASSES; c++)
+            total.bpus[i].cnt_correctPredClass[c] += sim.bpus[i].cnt_correctPredClass[c];
+        for (UINT32 k = 0; k < LOST_KINDS; k++)
+            total.bpus[i].cnt_lostCycles[k] += sim.bpus[i].cnt_lostCycles[k];
+        total.bpus[i].cnt_blockLookups += sim.bpus[i].cnt_blockLookups;
+        total.bpus[i].bpu->MergeCounters(*sim.bpus[i].bpu);
+    }
+    if (total.profile != NULL)
+        total.profile->Merge(*sim.profile, numSlots);
+}
+
+/*!
+ *  Save the predictor state of every BPU of a simulation state (-save-state).
+ *  Prints the reason and returns false on failure.
+ * @param[in]   fileName        checkpoint file
+ * @param[in]   sim             simulation state whose predictors are saved
+ */
+bool SaveBPUState(const std::string &fileName, const SIM_STATE &sim)
+{
+    STATE_WRITER out;
+    STATE_FILE_HEADER header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, STATE_MAGIC, sizeof(header.magic));
+    header.version = STATE_VERSION;
+    header.numBPUs = sim.numBPUs;
+    out.Put(header);
+
+    for (UINT32 i = 0; i < sim.numBPUs; i++) {
+        const BPU_INSTANCE &instance = sim.bpus[i];
+        out.Put(instance.btbSize);
+        out.Put(instance.btbAssoc);
+        out.Put(instance.tagSize);
+        out.Put(instance.rasSize);
+        out.PutString(instance.repl);
+        instance.bpu->SaveState(out);
+    }
+
+    if (!out.Write(fileName)) {
+        cerr << "ERROR: cannot write predictor state " << fileName << endl;
+        return false;
+    }
+    return true;
+}
+
+/*!
+ *  Load the predictor state of every BPU of a simulation state from a
+ *  checkpoint of the same configurations (-load-state). Exits on a mismatch.
+ * @param[in,out]  in           checkpoint, read from its start
+ * @param[in,out]  sim          simulation state created by CreateBPUs
+ * @param[in]      loadBTBs     false if the BTBs are shared and were
+ *                              already loaded for another thread
+ */
+VOID LoadBPUState(STATE_READER &in, SIM_STATE &sim, bool loadBTBs)
+{
+    in.Rewind();
+    STATE_FILE_HEADER header;
+    if (!in.Get(header) || memcmp(header.magic, STATE_MAGIC, sizeof(header.magic)) != 0
+        || header.version != STATE_VERSION) {
+        cerr << "ERROR: not a version " << STATE_VERSION << " predictor state" << endl;
+        exit(-1);
+    }
+    if (header.numBPUs != sim.numBPUs) {
+        cerr << "ERROR: predictor state has " << header.numBPUs
+             << " configurations, not " << sim.numBPUs << endl;
+        exit(-1);
+    }
+
+    for (UINT32 i = 0; i < sim.numBPUs; i++) {
+        BPU_INSTANCE &instance = sim.bpus[i];
+        UINT64 btbSize = 0, btbAssoc = 0, tagSize = 0, rasSize = 0;
+        std::string repl;
+        in.Get(btbSize);
+        in.Get(btbAssoc);
+        in.Get(tagSize);
+        in.Get(rasSize);
+        in.GetString(repl);
+        if (in.Ok() && (btbSize != instance.btbSize || btbAssoc != instance.btbAssoc
+                        || tagSize != instance.tagSize || rasSize != instance.rasSize
+                        || repl != instance.repl)) {
+            cerr << "ERROR: predictor state configuration " << i << " is BTB "
+                 << btbSize << "/" << btbAssoc << "/" << tagSize << " RAS " << rasSize
+                 << " " << repl << ", not BTB " << instance.btbSize << "/"
+                 << instance.btbAssoc << "/" << instance.tagSize << " RAS "
+                 << instance.rasSize << " " << instance.repl << endl;
+            exit(-1);
+        }
+        instance.bpu->LoadState(in, loadBTBs);
+    }
+
+    if (!in.Ok() || !in.AtEnd()) {
+        cerr << "ERROR: predictor state is truncated or corrupt" << endl;
+        exit(-1);
+    }
+}
+
+
+/* ===================================================================== */
+// Interval statistics (-interval)
+/* ===================================================================== */
+
+/*!
+ * Append a snapshot of the counters of the stream to its series.
+ * Called from the analysis path: no I/O, only a vector append.
+ * @param[in,out]  sim          simulation state of the instruction stream
+ */
+VOID RecordInterval(SIM_STATE &sim)
+{
+    std::vector<UINT64> &values = sim.intervals->values;
+    values.push_back(sim.cnt_instr);
+    values.push_back(sim.cnt_branches);
+    values.push_back(sim.cnt_branches_taken);
+    for (UINT32 i = 0; i < sim.numBPUs; i++) {
+        BPU_INSTANCE &instance = sim.bpus[i];
+        values.push_back(instance.cnt_correctPredDir);
+        values.push_back(instance.cnt_correctPredTarg);
+        values.push_back(instance.cnt_correctPred);
+        values.push_back(instance.bpu->GetBTB()->ValidEntries());
+        values.push_back(instance.bpu->RASOverflows());
+    }
+
+    UINT64 interval = KnobInterval.Value();
+    sim.nextInterval = (sim.cnt_instr / interval + 1) * interval;
+}
+
+/*!
+ * Snapshot the last, partial interval of the stream at its end.
+ * @param[in,out]  sim          simulation state of the instruction stream
+ */
+VOID FinishIntervals(SIM_STATE &sim)
+{
+    if (sim.intervals == NULL)
+        return;
+    const std::vector<UINT64> &values = sim.intervals->values;
+    UINT64 last = values.empty() ? 0 : values[values.size() - sim.intervals->width];
+    if (sim.cnt_instr > last)
+        RecordInterval(sim);
+}
+
+/*!
+ * Write the interval series of the streams, one row per interval and
+ *  configuration, as CSV or as a JSON array. Counts are per interval,
+ *  the BTB occupancy is the one at the end of the interval.
+ * @param[in]   out             output stream
+ * @param[in]   json            JSON instead of CSV
+ * @param[in]   streams         the streams, numbered as threads in order
+ */
+VOID WriteIntervals(std::ostream &out, bool json, const std::vector<SIM_STATE*> &streams)
+{
+    std::ios::fmtflags flags = out.flags();
+    std::streamsize precision = out.precision();
+    out << std::fixed << std::setprecision(3);
+    if (json)
+        out << "[" << endl;
+    else
+        out << "thread,interval,config,instructions,interval_instructions,branches,taken,"
+            << "dir_accuracy,targ_accuracy,accuracy,btb_occupancy,ras_overflows" << endl;
+
+    bool first = true;
+    for (UINT32 t = 0; t < streams.size(); t++) {
+        const SIM_STATE &sim = *streams[t];
+        if (sim.intervals == NULL)
+            continue;
+        const std::vector<UINT64> &values = sim.intervals->values;
+        UINT32 width = sim.intervals->width;
+        for (UINT64 n = 0; n * width < values.size(); n++) {
+            const UINT64 *cur = &values[n * width];
+            const UINT64 *prev = (n == 0) ? NULL : &values[(n-1) * width];
+            UINT64 instructions = cur[0] - (prev ? prev[0] : 0);
+            UINT64 branches = cur[1] - (prev ? prev[1] : 0);
+            UINT64 taken = cur[2] - (prev ? prev[2] : 0);
+
+            for (UINT32 i = 0; i < sim.numBPUs; i++) {
+                const BPU_INSTANCE &instance = sim.bpus[i];
+                UINT32 k = INTERVAL_STREAM_VALUES + i*INTERVAL_BPU_VALUES;
+                double accuracy[3];
+                for (UINT32 a = 0; a < 3; a++) {
+                    UINT64 correct = cur[k+a] - (prev ? prev[k+a] : 0);
+                    accuracy[a] = branches ? correct*100.0/branches : 0;
+                }
+                double occupancy = cur[k+3]*100.0/instance.bpu->GetBTB()->Capacity();
+                UINT64 overflows = cur[k+4] - (prev ? prev[k+4] : 0);
+
+                std::ostringstream config;
+                config << instance.btbSize << "/" << instance.btbAssoc << "/"
+                       << instance.tagSize << "/" << instance.rasSize << "/" << instance.repl;
+                if (json) {
+                    out << (first ? "" : ",\n")
+                        << "{\"thread\":" << t << ",\"interval\":" << n
+                        << ",\"config\":\"" << config.str() << "\""
+                        << ",\"instructions\":" << cur[0]
+                        << ",\"interval_instructions\":" << instructions
+                        << ",\"branches\":" << branches << ",\"taken\":" << taken
+                        << ",\"dir_accuracy\":" << accuracy[0]
+                        << ",\"targ_accuracy\":" << accuracy[1]
+                        << ",\"accuracy\":" << accuracy[2]
+                        << ",\"btb_occupancy\":" << occupancy
+                        << ",\"ras_overflows\":" << overflows << "}";
+                } else {
+                    out << t << "," << n << "," << config.str() << "," << cur[0] << ","
+                        << instructions << "," << branches << "," << taken << ","
+                        << accuracy[0] << "," << accuracy[1] << "," << accuracy[2] << ","
+                        << occupancy << "," << overflows << endl;
+                }
+                first = false;
+            }
+        }
+    }
+    if (json)
+        out << endl << "]" << endl;
+    out.flags(flags);
+    out.precision(precision);
+}
+
+/* ===================================================================== */
+// Live counters (-live)
+/* ===================================================================== */
+
+/*!
+ * Name of every configuration, for the live file.
+ * @param[in]   sim             simulation state of any stream
+ */
+std::vector<std::string> LiveNames(const SIM_STATE &sim)
+{
+    std::vector<std::string> names;
+    for (UINT32 i = 0; i < sim.numBPUs; i++) {
+        const BPU_INSTANCE &instance = sim.bpus[i];
+        std::ostringstream name;
+        name << instance.btbSize << "/" << instance.btbAssoc << "/" << instance.tagSize
+             << "/" << instance.rasSize << "/" << instance.repl;
+        names.push_back(name.str());
+    }
+    return names;
+}
+
+static inline UINT64 LiveLoad(const UINT64 &counter)
+{
+    return __atomic_load_n(&counter, __ATOMIC_RELAXED);
+}
+
+/*!
+ * Sum the counters of all the streams into a live snapshot.
+ * The streams may be simulating meanwhile: every counter is loaded once,
+ *  with a relaxed atomic load, and the simulation is never stopped.
+ * @param[in]   streams         simulation states, created by CreateBPUs
+ * @param[in]   finished        true for the last snapshot of the run
+ * @param[out]  values          LIVE_STREAM_VALUES, then LIVE_BPU_VALUES per configuration
+ */
+VOID CollectLiveValues(const std::vector<SIM_STATE*> &streams, bool finished,
+                       std::vector<UINT64> &values)
+{
+    UINT32 numBPUs = streams[0]->numBPUs;
+    values.assign(LIVE_STREAM_VALUES + numBPUs*LIVE_BPU_VALUES, 0);
+    values[LIVE_TIME] = LiveNowNanos();
+    values[LIVE_FINISHED] = finished;
+    values[LIVE_THREADS] = streams.size();
+    for (UINT32 s = 0; s < streams.size(); s++) {
+        const SIM_STATE &sim = *streams[s];
+        values[LIVE_INSTR] += LiveLoad(sim.cnt_instr);
+        values[LIVE_BRANCHES] += LiveLoad(sim.cnt_branches);
+        values[LIVE_TAKEN] += LiveLoad(sim.cnt_branches_taken);
+        for (UINT32 i = 0; i < numBPUs; i++) {
+            const BPU_INSTANCE &instance = sim.bpus[i];
+            UINT64 *v = &values[LIVE_STREAM_VALUES + i*LIVE_BPU_VALUES];
+            v[LIVE_CORRECT_DIR] += LiveLoad(instance.cnt_correctPredDir);
+            v[LIVE_CORRECT_TARG] += LiveLoad(instance.cnt_correctPredTarg);
+            v[LIVE_CORRECT] += LiveLoad(instance.cnt_correctPred);
+            for (UINT32 k = 0; k < LOST_KINDS; k++)
+                v[LIVE_LOST_CYCLES] += LiveLoad(instance.cnt_lostCycles[k]);
+            v[LIVE_RAS_OVERFLOWS] += instance.bpu->RASOverflows();
+
+            // A shared BTB counts once, with the first stream
+            const BTB *btb = instance.bpu->GetBTB();
+            if (s > 0 && btb == streams[0]->bpus[i].bpu->GetBTB())
+                continue;
+            v[LIVE_BTB_HITS] += btb->Hits();
+            v[LIVE_BTB_FILLS] += btb->Fills();
+            v[LIVE_BTB_EVICTIONS] += btb->Evictions();
+            v[LIVE_BTB_VALID] += btb->ValidEntries();
+        }
+    }
+}
+
+/* ===================================================================== */
+// Sampled simulation (-skip, -warmup, -detail, -period, -simpoints)
+/* ===================================================================== */
+enum SIM_PHASE {
+    PHASE_SKIP,     // fast-forward: count instructions only
+    PHASE_WARMUP,   // train the predictors, do not count
+    PHASE_DETAIL    // simulate and count
+};
+
+/*!
+ * Which instructions of a stream are skipped, used for warm-up or
+ *  simulated in detail. Window k is -warmup instructions of warm-up
+ *  followed by -detail instructions of detail, starting after -skip:
+ *    periodic   at k * -period
+ *    SimPoint   -warmup before the k-th SimPoint interval, which is the
+ *               detailed window
+ */
+class SAMPLING_SCHEDULE {
+UINT64 skip, warmup, detail, period, pointLength;
+std::vector<UINT64> points;     // SimPoint intervals, sorted
+bool enabled;
+
+// Bounds of window k; false if there is none
+bool Window(UINT64 k, UINT64 &warmStart, UINT64 &detailStart, UINT64 &detailEnd) const
+{
+	if (!points.empty()){
+		if (k >= points.size())
+			return false;
+		detailStart = skip + points[k]*pointLength;
+		detailEnd = detailStart + pointLength;
+	} else {
+		if (k > 0 && (period == 0 || detail == 0))
+			return false;
+		detailStart = skip + k*period + warmup;
+		detailEnd = (detail == 0) ? ~(UINT64)0 : detailStart + detail;
+	}
+	warmStart = (detailStart - skip > warmup) ? detailStart - warmup : skip;
+	return true;
+}
+
+public:
+/*!
+ * Read the schedule from the knobs. Exits on an invalid schedule.
+ */
+SAMPLING_SCHEDULE()
+	: skip(KnobSkip.Value()), warmup(KnobWarmup.Value()), detail(KnobDetail.Value()),
+	  period(KnobPeriod.Value()), pointLength(KnobSimPointLength.Value())
+{
+	if (!KnobSimPoints.Value().empty()){
+		//one "interval cluster" pair per line, as written by SimPoint
+		std::ifstream in(KnobSimPoints.Value().c_str());
+		if (!in || pointLength == 0){
+			cerr << "ERROR: cannot read SimPoints from " << KnobSimPoints.Value() << endl;
+			exit(-1);
+		}
+		UINT64 interval, cluster;
+		while (in >> interval >> cluster)
+			points.push_back(interval);
+		std::sort(points.begin(), points.end());
+	}
+	if (period != 0 && period < warmup + detail){
+		cerr << "ERROR: -period must cover -warmup and -detail" << endl;
+		exit(-1);
+	}
+	enabled = skip || warmup || detail || period || !points.empty();
+}
+
+bool Enabled() const { return enabled; }
+
+/*!
+ * Phase of the instruction stream after n instructions.
+ * @param[in]   n               instructions executed
+ * @param[out]  end             instruction count where the phase ends
+ */
+SIM_PHASE PhaseAt(UINT64 n, UINT64 &end) const
+{
+	end = ~(UINT64)0;
+	if (!enabled)
+		return PHASE_DETAIL;
+
+	//first window that has not ended yet
+	UINT64 k = 0;
+	if (points.empty()){
+		if (period != 0 && n >= skip)
+			k = (n - skip) / period;
+	} else {
+		k = std::upper_bound(points.begin(), points.end(),
+		                     n >= skip ? (n - skip) / pointLength : 0) - points.begin();
+		k = (k > 0) ? k - 1 : 0;
+	}
+	UINT64 warmStart, detailStart, detailEnd;
+	for (;; k++){
+		if (!Window(k, warmStart, detailStart, detailEnd))
+			return PHASE_SKIP;
+		if (detailEnd > n)
+			break;
+	}
+
+	if (n < warmStart){
+		end = warmStart;
+		return PHASE_SKIP;
+	}
+	if (n < detailStart){
+		end = detailStart;
+		return PHASE_WARMUP;
+	}
+	end = detailEnd;
+	return PHASE_DETAIL;
+}
+};
+
+/*!
+ * Current phase of an instruction stream, and its detailed instructions.
+ */
+struct SAMPLING_STATE {
+	UINT64 nextPhase;           // instruction count where the phase ends
+	SIM_PHASE phase;
+	UINT64 phaseStart;
+	UINT64 cnt_instr_detail;    // instructions of the finished detailed windows
+
+	VOID Start(const SAMPLING_SCHEDULE &schedule)
+	{
+		phase = schedule.PhaseAt(0, nextPhase);
+		phaseStart = 0;
+		cnt_instr_detail = 0;
+	}
+
+	// called once cnt_instr reaches nextPhase
+	VOID Advance(const SAMPLING_SCHEDULE &schedule, UINT64 cnt_instr)
+	{
+		cnt_instr_detail = Detailed(cnt_instr);
+		phase = schedule.PhaseAt(cnt_instr, nextPhase);
+		phaseStart = cnt_instr;
+	}
+
+	UINT64 Detailed(UINT64 cnt_instr) const
+	{
+		return cnt_instr_detail + ((phase == PHASE_DETAIL) ? cnt_instr - phaseStart : 0);
+	}
+};
+
+/* ===================================================================== */
+// Simulation
+/* ===================================================================== */
+
+/*!
+ * Predict one instruction on one configuration at Fetch, check prediction
+ *  and update prediction structures at Execute stage.
+ * @param[in]   instance        the configuration
+ * @param[in]   stats           profile counters of the branch, or NULL
+ * @param[in]   PC              address of current instruction
+ * @param[in]   targetPC        the next PC, **if taken**
+ * @param[in]   brTaken         the branch direction, 0 - not taken, 1 - taken
+ * @param[in]   fallThroughAddr address of next, sequential instruction
+ * @param[in]   isCall          true if the instruction is a subroutine call
+ * @param[in]   isReturn        true if the instruction is a subroutine return
+ * @param[in]   isIndirect      true if the instruction is an indirect jump or call
+ * @param[in]   isConstrolFlow  true if the instruction is branch, jump, return, ...
+ * COUNT is false in warm-up windows: the predictor is trained, nothing is counted.
+ * GEOMETRY gives the BTB set and tag of PC (BTB_GEOMETRY or BTB_ANY_GEOMETRY).
+ */
+template <class POLICY, class GEOMETRY, bool COUNT>
+static VOID SimulateInstance(BPU_INSTANCE &instance, BRANCH_STATS *stats,
+                             ADDRINT PC, ADDRINT targetPC, bool brTaken,
+                             ADDRINT fallThroughAddr, bool isCall,
+                             bool isReturn, bool isIndirect,
+                             bool isControlFlow)
+{
+    BPU     *bpu = instance.bpu;
+    bool    correctDir  = false;
+    bool    correctTarg = false;
+    bool    predictDir;
+    ADDRINT predictPC;
+
+    // ------------------------------------------
+    // Make your prediction:  (@ Fetch stage)
+    predictDir = bpu->PredictDirection(PC, isControlFlow, brTaken);
+    predictPC  = bpu->PredictTarget<POLICY, GEOMETRY>(PC, fallThroughAddr, predictDir,
+                                                      isCall, isReturn, isIndirect);
+    // ------------------------------------------
+
+
+    // ------------------------------------------
+    // Update counters, check prediction
+    if (predictDir == brTaken) { // Correct prediction of branch direction
+        correctDir = true;
+        if (COUNT && isControlFlow) {
+            instance.cnt_correctPredDir++; // Count correct predictions for actual branches
+        }
+    }
+
+    if (brTaken) { // brach was actually taken
+        if (predictPC == targetPC) { // Target predicted
+            correctTarg = true;
+            if (COUNT && isControlFlow) {
+                instance.cnt_correctPredTarg++;
+            }
+        }
+    } else { // not actually taken
+        if (predictPC == fallThroughAddr) {
+            correctTarg = true;
+            if (COUNT && isControlFlow) {
+                instance.cnt_correctPredTarg++;
+            }
+        }
+    }
+    if (COUNT && correctTarg && correctDir && isControlFlow) {
+        instance.cnt_correctPred++;
+        instance.cnt_correctPredClass[ClassOfBranch(isReturn, isIndirect)]++;
+    }
+
+    // Front-end cycles lost to this branch
+    if (COUNT && isControlFlow) {
+        if (!correctDir)
+            instance.cnt_lostCycles[LOST_DIRECTION] += frontEnd.directionPenalty;
+        else if (!correctTarg && isReturn)
+            instance.cnt_lostCycles[LOST_RAS] += frontEnd.rasPenalty;
+        else if (!correctTarg)
+            instance.cnt_lostCycles[LOST_TARGET] += isIndirect ? frontEnd.directionPenalty
+                                                               : frontEnd.targetPenalty;
+        else if (brTaken)
+            instance.cnt_lostCycles[LOST_BUBBLES] += frontEnd.levelLatency[bpu->TargetLevel()];
+    }
+
+    if (COUNT && stats != NULL) {
+        stats->executed++;
+        stats->taken += brTaken;
+        stats->dirMisses += !correctDir;
+        stats->targMisses += !correctTarg;
+        stats->mispredicted += !(correctDir && correctTarg);
+    }
+    // ------------------------------------------
+
+    // ------------------------------------------
+    if (isControlFlow) {
+        // Update the state of the predictor:  (@ execute stage only)
+        bpu->UpdatePredictor<POLICY, GEOMETRY>(
+                PC,               // address of instruction executing now
+                brTaken,          // the actual direction
+                targetPC,         // the next PC, **if taken**
+                fallThroughAddr,  // return address for subroutine calls,
+                //     DO NOT STORE IN BTB!
+                isCall,           // is a subroutine call
+                isReturn,         // is a return from subroutine
+                isIndirect,       // is an indirect jump or call
+                correctDir,       // my direction prediction was correct
+                correctTarg       // my target prediction was correct
+        );
+        if (COUNT)
+            instance.cnt_blockLookups += bpu->BlockLookups();
+        
+        //extra statistics
+        //////////////////////////////////////////////////////////////////////////////
+        //if (isCall){isCallCounter++;}
+        //if (isReturn && correctTarg){isReturnCounter++;}
+        /////////////////////////////////////////////////////////////////////////////
+    }
+    // ------------------------------------------
+}
+
+// Longest straight line run counted as fetched blocks; a longer jump
+// between two branches is code that was not simulated (filters, -skip)
+static const ADDRINT MAX_SEQUENTIAL_BLOCKS = 1024;
+
+/*!
+ * Count the fetch blocks up to the branch at PC (-fetchblock). A fetch
+ *  block is the aligned block read in one cycle with one BTB lookup, which
+ *  returns the first predicted taken branch after the fetch address: it
+ *  ends at a taken branch or at the block boundary. Not taken branches
+ *  stay in the block of the branches before them.
+ * @param[in]   sim             simulation state of the instruction stream
+ * @param[in]   PC              address of the branch
+ * @param[in]   targetPC        the next PC, **if taken**
+ * @param[in]   brTaken         the branch direction
+ */
+static inline VOID CountFetchBlocks(SIM_STATE &sim, ADDRINT PC, ADDRINT targetPC, bool brTaken)
+{
+    ADDRINT block = PC >> frontEnd.fetchBlockBits;
+    ADDRINT first = sim.fetchBlockOpen ? sim.fetchBlock : (sim.fetchPC >> frontEnd.fetchBlockBits);
+    UINT64 blocks = 1;
+    if (block >= first && block - first < MAX_SEQUENTIAL_BLOCKS)
+        blocks = block - first + !sim.fetchBlockOpen;
+    if (!sim.warming) {
+        sim.cnt_fetchBlocks += blocks;
+        // All blocks but the branch's own, which the BPUs look up, are empty
+        sim.cnt_emptyBlocks += (blocks == 0) ? 0 : blocks - 1;
+    }
+
+    sim.fetchBlockOpen = !brTaken;
+    sim.fetchBlock = block;
+    sim.fetchPC = targetPC;
+}
+
+/*!
+ * Predict one instruction at Fetch, check prediction and update prediction
+ *  structures at Execute stage. Does not count the instruction itself:
+ *  sim.cnt_instr must already include it, for the -interval snapshots.
+ * @param[in]   sim             simulation state of the instruction stream
+ * @param[in]   PC              address of current instruction
+ * @param[in]   targetPC        the next PC, **if taken**
+ * @param[in]   brTaken         the branch direction, 0 - not taken, 1 - taken
+ * @param[in]   size            the instruction size in bytes
+ * @param[in]   isCall          true if the instruction is a subroutine call
+ * @param[in]   isReturn        true if the instruction is a subroutine return
+ * @param[in]   isIndirect      true if the instruction is an indirect jump or call
+ * @param[in]   isConstrolFlow  true if the instruction is branch, jump, return, ...
+ * @param[in]   slot            profile slot of the branch, or NO_BRANCH_SLOT
+ */
+static inline VOID SimulateBranch(SIM_STATE &sim,
+                                  ADDRINT PC,
+                                  ADDRINT targetPC,
+                                  bool brTaken,
+                                  UINT32 size,
+                                  bool isCall,
+                                  bool isReturn,
+                                  bool isIndirect,
+                                  bool isControlFlow,
+                                  UINT32 slot)
+{
+   /*
+   *outFile << "PC: "          << PC 
+            << " targetPC: "   << targetPC 
+            << " taken: "      << brTaken
+            << " isCall: "     << isCall
+            << " isRet: "      << isReturn
+            << " isBrOrCall: " << isControlFlow
+            << " PC+size: " << PC+size
+           << endl;
+    */
+    ADDRINT fallThroughAddr = PC + size;
+
+    if (sim.cnt_instr >= sim.nextInterval)
+        RecordInterval(sim);
+
+    // Fetch-block mode: other instructions are covered by the lookup of
+    // their block, and predict nothing
+    if (frontEnd.fetchBlockBits != 0) {
+        if (!isControlFlow)
+            return;
+        CountFetchBlocks(sim, PC, targetPC, brTaken);
+    }
+
+    if (sim.warming) {
+        for (UINT32 i = 0; i < sim.numBPUs; i++) {
+            BPU_INSTANCE &instance = sim.bpus[i];
+            instance.warm(instance, NULL, PC, targetPC, brTaken,
+                          fallThroughAddr, isCall, isReturn, isIndirect, isControlFlow);
+        }
+        return;
+    }
+
+    if (isControlFlow) {
+        sim.cnt_branches++; 
+        if (brTaken)
+            sim.cnt_branches_taken++;
+        sim.cnt_branches_class[ClassOfBranch(isReturn, isIndirect)]++;
+    }
+
+    // The profile follows the first configuration
+    BRANCH_STATS *stats = NULL;
+    if (sim.profile != NULL && slot != NO_BRANCH_SLOT)
+        stats = &sim.profile->Slot(slot);
+
+    for (UINT32 i = 0; i < sim.numBPUs; i++) {
+        BPU_INSTANCE &instance = sim.bpus[i];
+        instance.simulate(instance, (i == 0) ? stats : NULL, PC, targetPC, brTaken,
+                          fallThroughAddr, isCall, isReturn, isIndirect, isControlFlow);
+    }
+}
+
+// part of whole in percent, 0 if whole is 0
+static inline double Percent(UINT64 part, UINT64 whole)
+{
+    return (whole == 0) ? 0.0 : part*100.0/whole;
+}
+
+/*!
+ * Print the front-end model estimates: fetch cycles of the detailed
+ *  instructions at -fetchw per cycle plus the cycles lost to control flow.
+ * @param[in]   out             output stream
+ * @param[in]   sim             simulation state (merged over all threads)
+ */
+VOID ReportFrontEnd(std::ostream &out, SIM_STATE &sim)
+{
+    std::ios::fmtflags flags = out.flags();
+    std::streamsize precision = out.precision();
+    out << std::fixed << std::setprecision(3);
+    UINT64 fetchCycles = (sim.cnt_instr_detail + frontEnd.fetchWidth - 1) / frontEnd.fetchWidth;
+    double instructions = (sim.cnt_instr_detail == 0) ? 1.0 : (double) sim.cnt_instr_detail;
+    double blocks = (sim.cnt_fetchBlocks == 0) ? 1.0 : (double) sim.cnt_fetchBlocks;
+    bool blockMode = (frontEnd.fetchBlockBits != 0);
+    if (blockMode) {
+        out << "Front-end: one " << (1 << frontEnd.fetchBlockBits)
+            << "-byte block per cycle, one BTB lookup per block" << endl;
+        out << " Fetch blocks: " << sim.cnt_fetchBlocks
+            << " (without branches: " << sim.cnt_emptyBlocks << ")"
+            << " instructions/block: " << sim.cnt_instr_detail / blocks
+            << " branches/block: " << sim.cnt_branches / blocks
+            << " taken branches/block: " << sim.cnt_branches_taken / blocks << endl;
+    }
+    else
+        out << "Front-end: " << fetchCycles << " fetch cycles (width " << frontEnd.fetchWidth << ")" << endl;
+    if (sim.numBPUs == 1) {
+        BPU_INSTANCE &instance = sim.bpus[0];
+        UINT64 lost = 0;
+        for (UINT32 k = 0; k < LOST_KINDS; k++)
+            lost += instance.cnt_lostCycles[k];
+        // A block without branches still takes its cycle, with a BTB miss
+        if (blockMode)
+            fetchCycles = instance.cnt_blockLookups + sim.cnt_emptyBlocks;
+        out << " Lost cycles: " << lost << "(" << Percent(lost, fetchCycles + lost) << "%)";
+        for (UINT32 k = 0; k < LOST_KINDS; k++)
+            out << " " << LOST_CYCLES_NAMES[k] << ": " << instance.cnt_lostCycles[k];
+        out << endl;
+        out << " Front-end CPI: " << (fetchCycles + lost) / instructions << endl;
+        if (blockMode)
+            out << " Fetch blocks/cycle: " << sim.cnt_fetchBlocks / (double) std::max(fetchCycles + lost, (UINT64)1)
+                << " BTB lookups/block: " << fetchCycles / blocks << endl;
+    } else {
+        out << std::setw(8) << "btbs" << std::setw(6) << "btba"
+            << std::setw(6) << "tags" << std::setw(6) << "ras" << std::setw(7) << "repl"
+            << std::setw(8) << "CPI";
+        if (blockMode)
+            out << std::setw(9) << "blk/cyc" << std::setw(9) << "lkp/blk";
+        out << std::setw(14) << "lost cycles";
+        for (UINT32 k = 0; k < LOST_KINDS; k++)
+            out << std::setw(12) << LOST_CYCLES_NAMES[k];
+        out << endl;
+        for (UINT32 i = 0; i < sim.numBPUs; i++) {
+            BPU_INSTANCE &instance = sim.bpus[i];
+            UINT64 lost = 0;
+            for (UINT32 k = 0; k < LOST_KINDS; k++)
+                lost += instance.cnt_lostCycles[k];
+            if (blockMode)
+                fetchCycles = instance.cnt_blockLookups + sim.cnt_emptyBlocks;
+            out << std::setw(8) << instance.btbSize << std::setw(6) << instance.btbAssoc
+                << std::setw(6) << instance.tagSize << std::setw(6) << instance.rasSize
+                << std::setw(7) << instance.repl
+                << std::setw(8) << (fetchCycles + lost) / instructions;
+            if (blockMode)
+                out << std::setw(9) << sim.cnt_fetchBlocks / (double) std::max(fetchCycles + lost, (UINT64)1)
+                    << std::setw(9) << fetchCycles / blocks;
+            out << std::setw(14) << lost;
+            for (UINT32 k = 0; k < LOST_KINDS; k++)
+                out << std::setw(12) << instance.cnt_lostCycles[k];
+            out << endl;
+        }
+    }
+    out.flags(flags);
+    out.precision(precision);
+}
+
+/*!
+ * Print the simulation counters of all configurations.
+ * @param[in]   out             output stream
+ * @param[in]   sim             simulation state (merged over all threads)
+ */
+VOID ReportResults(std::ostream &out, SIM_STATE &sim)
+{
+    out << "Instructions: " << sim.cnt_instr << endl;
+    if (sim.cnt_instr_detail < sim.cnt_instr)
+        out << " detailed: " << sim.cnt_instr_detail << "("
+            << sim.cnt_instr_detail*100.0/sim.cnt_instr << "%)" << endl;
+    out << "Branches: " << sim.cnt_branches << endl;
+    out << " taken: " << sim.cnt_branches_taken << "(" << sim.cnt_branches_taken*100.0/sim.cnt_branches << "%)" << endl;
+    if (sim.numBPUs == 1) {
+        BPU_INSTANCE &instance = sim.bpus[0];
+        out << " Predicted (direction & target): " << instance.cnt_correctPred << "(" << instance.cnt_correctPred*100.0 /sim.cnt_branches << "%)" << endl;
+        out << " Predicted direction: " << instance.cnt_correctPredDir << "(" << instance.cnt_correctPredDir*100.0 /sim.cnt_branches << "%)" << endl;
+        out << " Predicted target: " << instance.cnt_correctPredTarg << "(" << instance.cnt_correctPredTarg*100.0 /sim.cnt_branches << "%)" << endl;
+    } else {
+        // One row per configuration
+        std::ios::fmtflags flags = out.flags();
+        std::streamsize precision = out.precision();
+        out << std::fixed << std::setprecision(3);
+        out << "Configurations: " << sim.numBPUs << endl;
+        out << std::setw(8) << "btbs" << std::setw(6) << "btba"
+            << std::setw(6) << "tags" << std::setw(6) << "ras" << std::setw(7) << "repl"
+            << std::setw(22) << "Predicted (dir&targ)"
+            << std::setw(22) << "Predicted direction"
+            << std::setw(22) << "Predicted target" << endl;
+        for (UINT32 i = 0; i < sim.numBPUs; i++) {
+            BPU_INSTANCE &instance = sim.bpus[i];
+            out << std::setw(8) << instance.btbSize << std::setw(6) << instance.btbAssoc
+                << std::setw(6) << instance.tagSize << std::setw(6) << instance.rasSize
+                << std::setw(7) << instance.repl
+                << std::setw(13) << instance.cnt_correctPred
+                << std::setw(8) << instance.cnt_correctPred*100.0 /sim.cnt_branches << "%"
+                << std::setw(13) << instance.cnt_correctPredDir
+                << std::setw(8) << instance.cnt_correctPredDir*100.0 /sim.cnt_branches << "%"
+                << std::setw(13) << instance.cnt_correctPredTarg
+                << std::setw(8) << instance.cnt_correctPredTarg*100.0 /sim.cnt_branches << "%" << endl;
+        }
+        out.flags(flags);
+        out.precision(precision);
+    }
+
+    // Direct, indirect and return branches predicted (direction & target)
+    std::ios::fmtflags flags = out.flags();
+    std::streamsize precision = out.precision();
+    out << std::fixed << std::setprecision(3);
+    out << "Branch classes:";
+    for (UINT32 c = 0; c < BRANCH_CLASSES; c++)
+        out << " " << BRANCH_CLASS_NAMES[c] << ": " << sim.cnt_branches_class[c];
+    out << endl;
+    if (sim.numBPUs == 1) {
+        BPU_INSTANCE &instance = sim.bpus[0];
+        for (UINT32 c = 0; c < BRANCH_CLASSES; c++)
+            out << " Predicted " << BRANCH_CLASS_NAMES[c] << ": " << instance.cnt_correctPredClass[c]
+                << "(" << Percent(instance.cnt_correctPredClass[c], sim.cnt_branches_class[c]) << "%)" << endl;
+    } else {
+        out << std::setw(8) << "btbs" << std::setw(6) << "btba"
+            << std::setw(6) << "tags" << std::setw(6) << "ras" << std::setw(7) << "repl";
+        for (UINT32 c = 0; c < BRANCH_CLASSES; c++)
+            out << std::setw(22) << BRANCH_CLASS_NAMES[c];
+        out << endl;
+        for (UINT32 i = 0; i < sim.numBPUs; i++) {
+            BPU_INSTANCE &instance = sim.bpus[i];
+            out << std::setw(8) << instance.btbSize << std::setw(6) << instance.btbAssoc
+                << std::setw(6) << instance.tagSize << std::setw(6) << instance.rasSize
+                << std::setw(7) << instance.repl;
+            for (UINT32 c = 0; c < BRANCH_CLASSES; c++)
+                out << std::setw(13) << instance.cnt_correctPredClass[c]
+                    << std::setw(8) << Percent(instance.cnt_correctPredClass[c], sim.cnt_branches_class[c]) << "%";
+            out << endl;
+        }
+    }
+    out.flags(flags);
+    out.precision(precision);
+
+    ReportFrontEnd(out, sim);
+    
+    // -------------------------------------------
+    //  Output any extra counters/statistics here
+    // -------------------------------------------
+    /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    //out << "\n Calls: " << isCallCounter  << endl;
+    //out << " Correct TargetPredicted Returns: " << isReturnCounter << endl;
+	/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+    //  Report any predictor internal counters
+    for (UINT32 i = 0; i < sim.numBPUs; i++) {
+        std::string s = sim.bpus[i].bpu->ReportCounters();
+        if (s.empty())
+            continue;
+        if (sim.numBPUs > 1)
+            out << "Configuration " << sim.bpus[i].btbSize << "/" << sim.bpus[i].btbAssoc
+                << "/" << sim.bpus[i].tagSize << "/" << sim.bpus[i].rasSize
+                << "/" << sim.bpus[i].repl << ":" << endl;
+        else
+            out << " BTB replacement: " << sim.bpus[i].repl << endl;
+        out << s;
+    }
+}
+
+/*!
+ * Print the static branches of the first configuration with the most
+ *  mispredictions (-topn).
+ * @param[in]   out             output stream
+ * @param[in]   sim             simulation state (merged over all threads)
+ * @param[in]   sites           static branches and their names
+ */
+VOID ReportBranchProfile(std::ostream &out, SIM_STATE &sim, const BRANCH_SITES &sites)
+{
+    if (sim.profile == NULL)
+        return;
+
+    // Order the executed branches by mispredictions, ties by address
+    std::vector<std::pair<UINT64, UINT32> > order;
+    for (UINT32 slot = 0; slot < sites.Size(); slot++) {
+        const BRANCH_STATS *stats = sim.profile->Find(slot);
+        if (stats != NULL && stats->executed > 0)
+            order.push_back(std::make_pair(~stats->mispredicted, slot));
+    }
+    UINT32 n = std::min((size_t) KnobTopN.Value(), order.size());
+    std::partial_sort(order.begin(), order.begin() + n, order.end());
+
+    std::ios::fmtflags flags = out.flags();
+    std::streamsize precision = out.precision();
+    out << "Static branches: " << order.size() << ", top " << n << " mispredicted";
+    if (sim.numBPUs > 1)
+        out << " (configuration " << sim.bpus[0].btbSize << "/" << sim.bpus[0].btbAssoc
+            << "/" << sim.bpus[0].tagSize << "/" << sim.bpus[0].rasSize
+            << "/" << sim.bpus[0].repl << ")";
+    out << ":" << endl;
+    out << std::setw(18) << "PC" << std::setw(13) << "executed" << std::setw(8) << "taken"
+        << std::setw(13) << "mispredicted" << std::setw(12) << "dir misses"
+        << std::setw(12) << "targ misses" << "  routine (image)" << endl;
+    out << std::fixed << std::setprecision(1);
+    for (UINT32 i = 0; i < n; i++) {
+        UINT32 slot = order[i].second;
+        const BRANCH_STATS *stats = sim.profile->Find(slot);
+        out << std::setw(18) << std::hex << std::showbase << sites.PCs[slot]
+            << std::dec << std::noshowbase
+            << std::setw(13) << stats->executed
+            << std::setw(7) << stats->taken*100.0/stats->executed << "%"
+            << std::setw(13) << stats->mispredicted
+            << std::setw(12) << stats->dirMisses
+            << std::setw(12) << stats->targMisses
+            << "  " << (sites.routines[slot].empty() ? "?" : sites.routines[slot]);
+        if (!sites.images[slot].empty())
+            out << " (" << sites.images[slot] << ")";
+        out << endl;
+    }
+    out.flags(flags);
+    out.precision(precision);
+}
+
+#endif // BPU_H
@@ -0,0 +1,388 @@
+//Tsalesis Evangelos
+//AM: 1779
+/*! @file
+ *  Measures the speed of the simulator core (bpu.h) without PIN. Drives
+ *  the BPUs with synthetic branch streams and reports branches/sec,
+ *  ns/branch and, where perf_event_open is allowed, cycles, instructions
+ *  and cache misses per branch. Accepts the same predictor switches.
+ *
+ *  Build:  g++ -O2 -o bpu_bench bpu_bench.cpp
+ *  Run:    ./bpu_bench -stream all -branches 2000000 -btbs 2048 -btba 8
+ */
+
+#include "pin_shim.h"
+#include <iomanip>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "bpu.h"
+#include "trace.h"
+
+/* ===================================================================== */
+// Command line switches
+/* ===================================================================== */
+KNOB<string> KnobStream(KNOB_MODE_APPEND, "bench",
+    "stream", "all", "synthetic stream: loops, random, calls, indirect, footprint or all");
+
+KNOB<UINT64> KnobBranches(KNOB_MODE_WRITEONCE, "bench",
+    "branches", "2000000", "branches in every stream");
+
+KNOB<UINT32> KnobRepeat(KNOB_MODE_WRITEONCE, "bench",
+    "repeat", "5", "passes over every stream, the fastest one is reported");
+
+KNOB<UINT32> KnobSites(KNOB_MODE_WRITEONCE, "bench",
+    "sites", "1048576", "static branches of the footprint stream");
+
+KNOB<UINT64> KnobSeed(KNOB_MODE_WRITEONCE, "bench",
+    "seed", "1", "seed of the stream generators");
+
+/* ===================================================================== */
+// Synthetic branch streams
+/* ===================================================================== */
+
+static const ADDRINT CODE_BASE = 0x400000;
+static const UINT32 BRANCH_SIZE = 2;
+static const UINT32 CALL_SIZE = 5;
+
+// xorshift64*: fast, and the same stream on every host for a given seed
+static UINT64 rngState;
+
+static inline UINT64 Random()
+{
+    rngState ^= rngState >> 12;
+    rngState ^= rngState << 25;
+    rngState ^= rngState >> 27;
+    return rngState * 0x2545F4914F6CDD1DULL;
+}
+
+static inline UINT32 Random(UINT32 n) { return Random() % n; }
+
+static VOID Add(std::vector<BRANCH_RECORD> &stream, ADDRINT PC, ADDRINT targetPC,
+                bool taken, UINT32 size, bool isCall, bool isReturn, bool isIndirect)
+{
+    BRANCH_RECORD r;
+    r.PC = PC;
+    r.targetPC = targetPC;
+    r.instructions = 1 + Random(8);
+    r.size = size;
+    r.brTaken = taken;
+    r.isCall = isCall;
+    r.isReturn = isReturn;
+    r.isIndirect = isIndirect;
+    stream.push_back(r);
+}
+
+/*!
+ * 64 loops with trip counts 1 to 64, nested in an outer loop: almost
+ *  perfectly predictable, the best case of the simulator.
+ */
+static VOID GenerateLoops(std::vector<BRANCH_RECORD> &stream, UINT64 branches)
+{
+    while (stream.size() < branches) {
+        for (UINT32 l = 0; l < 64 && stream.size() < branches; l++) {
+            ADDRINT head = CODE_BASE + l*0x100;
+            ADDRINT back = head + 0x40;
+            for (UINT32 i = 0; i <= l; i++)
+                Add(stream, back, head, i < l, BRANCH_SIZE, false, false, false);
+        }
+        Add(stream, CODE_BASE + 0x10000, CODE_BASE, true, BRANCH_SIZE, false, false, false);
+    }
+}
+
+/*!
+ * 4096 conditional branches visited at random, each taken with its own
+ *  random probability.
+ */
+static VOID GenerateRandom(std::vector<BRANCH_RECORD> &stream, UINT64 branches)
+{
+    static const UINT32 SITES = 4096;
+    std::vector<UINT32> bias(SITES);
+    for (UINT32 s = 0; s < SITES; s++)
+        bias[s] = Random(101);
+    while (stream.size() < branches) {
+        UINT32 s = Random(SITES);
+        ADDRINT PC = CODE_BASE + s*0x20;
+        Add(stream, PC, PC + 0x10, Random(100) < bias[s], BRANCH_SIZE, false, false, false);
+    }
+}
+
+/*!
+ * Random walk of calls and returns up to 256 deep, deeper than any RAS.
+ */
+static VOID GenerateCalls(std::vector<BRANCH_RECORD> &stream, UINT64 branches)
+{
+    static const UINT32 FUNCTIONS = 1024;
+    static const UINT32 MAX_DEPTH = 256;
+    std::vector<ADDRINT> returnAddr;
+    ADDRINT function = CODE_BASE;
+    while (stream.size() < branches) {
+        bool call = returnAddr.empty()
+                 || (returnAddr.size() < MAX_DEPTH && Random(100) < 52);
+        if (call) {
+            ADDRINT PC = function + 0x10 + Random(8)*0x10;
+            ADDRINT callee = CODE_BASE + Random(FUNCTIONS)*0x1000;
+            Add(stream, PC, callee, true, CALL_SIZE, true, false, false);
+            returnAddr.push_back(PC + CALL_SIZE);
+            function = callee;
+        }
+        else {
+            ADDRINT target = returnAddr.back();
+            returnAddr.pop_back();
+            Add(stream, function + 0xff0, target, true, 1, false, true, false);
+            function = target & ~(ADDRINT)0xfff;
+        }
+    }
+}
+
+/*!
+ * 256 virtual call sites with 1 to 16 receivers each: every site cycles
+ *  through a pattern of its receivers, or picks one at random. Every call
+ *  returns at once.
+ */
+static VOID GenerateIndirect(std::vector<BRANCH_RECORD> &stream, UINT64 branches)
+{
+    static const UINT32 SITES = 256;
+    std::vector<UINT32> receivers(SITES), next(SITES, 0);
+    for (UINT32 s = 0; s < SITES; s++)
+        receivers[s] = 1 + Random(16);
+    while (stream.size() < branches) {
+        UINT32 s = Random(SITES);
+        ADDRINT PC = CODE_BASE + s*0x40;
+        UINT32 receiver = (s & 1) ? Random(receivers[s]) : next[s]++ % receivers[s];
+        ADDRINT callee = CODE_BASE + 0x100000 + (s*16 + receiver)*0x100;
+        Add(stream, PC, callee, true, CALL_SIZE, true, false, true);
+        Add(stream, callee + 0x80, PC + CALL_SIZE, true, 1, false, true, false);
+    }
+}
+
+/*!
+ * -sites taken branches, swept in order: a code footprint far larger than
+ *  the BTB, every lookup misses.
+ */
+static VOID GenerateFootprint(std::vector<BRANCH_RECORD> &stream, UINT64 branches)
+{
+    UINT32 sites = std::max(KnobSites.Value(), (UINT32)1);
+    for (UINT32 s = 0; stream.size() < branches; s = (s + 1) % sites) {
+        ADDRINT PC = CODE_BASE + (ADDRINT)s*0x40;
+        Add(stream, PC, PC + 0x40, true, BRANCH_SIZE, false, false, false);
+    }
+}
+
+struct STREAM_INFO {
+    const char *name;
+    VOID (*generate)(std::vector<BRANCH_RECORD> &stream, UINT64 branches);
+};
+
+static const STREAM_INFO STREAMS[] = {
+    { "loops",     GenerateLoops },
+    { "random",    GenerateRandom },
+    { "calls",     GenerateCalls },
+    { "indirect",  GenerateIndirect },
+    { "footprint", GenerateFootprint },
+};
+static const UINT32 NUM_STREAMS = sizeof(STREAMS)/sizeof(STREAMS[0]);
+
+/* ===================================================================== */
+// Hardware counters
+/* ===================================================================== */
+
+enum PERF_COUNTER {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_COUNTERS
+};
+
+/*!
+ * One perf_event_open group of this process's hardware counters. Not
+ *  available in containers or under a strict perf_event_paranoid: then
+ *  the benchmark reports times only.
+ */
+class PERF_GROUP {
+int fds[PERF_COUNTERS];
+
+public:
+PERF_GROUP()
+{
+    static const UINT64 configs[PERF_COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+    };
+    for (UINT32 c = 0; c < PERF_COUNTERS; c++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[c];
+        attr.disabled = (c == 0);
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+        fds[c] = syscall(__NR_perf_event_open, &attr, 0, -1, (c == 0) ? -1 : fds[0], 0);
+        if (fds[c] < 0) {
+            for (UINT32 o = 0; o < c; o++)
+                close(fds[o]);
+            fds[0] = -1;
+            return;
+        }
+    }
+}
+
+~PERF_GROUP()
+{
+    if (Available()) {
+        for (UINT32 c = 0; c < PERF_COUNTERS; c++)
+            close(fds[c]);
+    }
+}
+
+bool Available() const { return fds[0] >= 0; }
+
+VOID Start()
+{
+    if (!Available())
+        return;
+    ioctl(fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+/*!
+ * Stop counting and read the group.
+ * @param[out]  values          PERF_COUNTERS values, all 0 if not available
+ */
+VOID Stop(UINT64 *values)
+{
+    memset(values, 0, PERF_COUNTERS*sizeof(UINT64));
+    if (!Available())
+        return;
+    ioctl(fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    UINT64 buffer[1 + PERF_COUNTERS];
+    if (read(fds[0], buffer, sizeof(buffer)) == (ssize_t) sizeof(buffer))
+        memcpy(values, &buffer[1], PERF_COUNTERS*sizeof(UINT64));
+}
+};
+
+/* ===================================================================== */
+// Utilities
+/* ===================================================================== */
+
+/*!
+ *  Print out help message.
+ */
+INT32 Usage()
+{
+    cerr << "This tool measures the speed of the Branch Target Simulator on" << endl <<
+            "synthetic branch streams." << endl << endl;
+    cerr << KNOB_BASE::StringKnobSummary() << endl;
+    return -1;
+}
+
+static inline UINT64 Nanos()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (UINT64)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+/*!
+ * Simulate one stream -repeat times on the same BPUs and print the
+ *  fastest pass, and the accuracy of the first pass: later passes start
+ *  with warm predictors.
+ * @param[in]   info            the stream
+ * @param[in]   stream          its branches
+ * @param[in]   perf            hardware counters
+ */
+static VOID Run(const STREAM_INFO &info, const std::vector<BRANCH_RECORD> &stream,
+                PERF_GROUP &perf)
+{
+    SIM_STATE sim;
+    CreateBPUs(sim, NULL);
+
+    UINT64 bestNanos = ~(UINT64)0;
+    UINT64 best[PERF_COUNTERS] = { 0 };
+    UINT64 firstCorrect = 0, firstBranches = 0;
+    for (UINT32 pass = 0; pass < std::max(KnobRepeat.Value(), (UINT32)1); pass++) {
+        UINT64 counters[PERF_COUNTERS];
+        UINT64 start = Nanos();
+        perf.Start();
+        for (size_t b = 0; b < stream.size(); b++) {
+            const BRANCH_RECORD &r = stream[b];
+            sim.cnt_instr += r.instructions;
+            SimulateBranch(sim, r.PC, r.targetPC, r.brTaken, r.size, r.isCall, r.isReturn,
+                           r.isIndirect, true, NO_BRANCH_SLOT);
+        }
+        perf.Stop(counters);
+        UINT64 nanos = Nanos() - start;
+        if (pass == 0) {
+            firstCorrect = sim.bpus[0].cnt_correctPred;
+            firstBranches = sim.cnt_branches;
+        }
+        if (nanos < bestNanos) {
+            bestNanos = nanos;
+            memcpy(best, counters, sizeof(best));
+        }
+    }
+
+    double branches = stream.size();
+    cout << left << setw(10) << info.name << right << fixed
+         << setw(10) << setprecision(2) << branches / bestNanos * 1e3 << " M/s"
+         << setw(9) << setprecision(2) << bestNanos / branches << " ns";
+    if (perf.Available())
+        cout << setw(9) << setprecision(1) << best[PERF_CYCLES] / branches
+             << setw(9) << best[PERF_INSTRUCTIONS] / branches
+             << setw(9) << setprecision(3) << best[PERF_CACHE_MISSES] / branches
+             << setw(9) << best[PERF_BRANCH_MISSES] / branches;
+    cout << setw(9) << setprecision(2)
+         << Percent(firstCorrect, firstBranches) << "%" << endl;
+}
+
+/*!
+ * The main procedure of the tool.
+ * @param[in]   argc            total number of elements in the argv array
+ * @param[in]   argv            array of command line arguments
+ */
+int main(int argc, char * argv[])
+{
+    if (ParseKnobs(argc, argv))
+        return Usage();
+
+    std::vector<const STREAM_INFO*> selected;
+    for (UINT32 k = 0; k < KnobStream.NumberOfValues(); k++) {
+        const std::string &name = KnobStream.Value(k);
+        bool found = false;
+        for (UINT32 s = 0; s < NUM_STREAMS; s++) {
+            if (name == "all" || name == STREAMS[s].name) {
+                selected.push_back(&STREAMS[s]);
+                found = true;
+            }
+        }
+        if (!found) {
+            cerr << "ERROR: unknown stream " << name << endl;
+            return -1;
+        }
+    }
+
+    PERF_GROUP perf;
+    if (!perf.Available())
+        cout << "perf_event_open is not available: no hardware counters" << endl;
+    cout << left << setw(10) << "stream" << right << setw(14) << "branches/s"
+         << setw(12) << "ns/branch";
+    if (perf.Available())
+        cout << setw(9) << "cyc/br" << setw(9) << "ins/br" << setw(9) << "miss/br"
+             << setw(9) << "brmis/br";
+    cout << setw(10) << "correct" << endl;
+
+    for (UINT32 s = 0; s < selected.size(); s++) {
+        std::vector<BRANCH_RECORD> stream;
+        stream.reserve(KnobBranches.Value() + 1);
+        rngState = KnobSeed.Value() | 1;
+        selected[s]->generate(stream, KnobBranches.Value());
+        Run(*selected[s], stream, perf);
+    }
+    return 0;
+}
+/* ===================================================================== */
+/* eof */
+/* ===================================================================== */
@@ -0,0 +1,134 @@
+//Tsalesis Evangelos
+//AM: 1779
+/*! @file
+ *  Shows the live counters (-live) of a running simulation: instruction
+ *  and branch rates, and the accuracy of every configuration, overall and
+ *  since the previous snapshot. Reads the shared file only: the simulator
+ *  is never stopped or signalled.
+ *
+ *  Build:  g++ -O2 -o bpu_monitor bpu_monitor.cpp
+ *  Run:    ./bpu_monitor -live /dev/shm/bpu.live -period 1000
+ */
+
+#include "pin_shim.h"
+#include <iomanip>
+#include <errno.h>
+#include <signal.h>
+#include "live.h"
+
+/* ===================================================================== */
+// Command line switches
+/* ===================================================================== */
+KNOB<string> KnobLiveFile(KNOB_MODE_WRITEONCE, "monitor",
+    "live", "", "specify live counters file written with -live");
+
+KNOB<UINT32> KnobPeriod(KNOB_MODE_WRITEONCE, "monitor",
+    "period", "1000", "milliseconds between two reports");
+
+KNOB<UINT64> KnobCount(KNOB_MODE_WRITEONCE, "monitor",
+    "count", "0", "stop after this many reports (0: until the simulation ends)");
+
+/* ===================================================================== */
+// Utilities
+/* ===================================================================== */
+
+/*!
+ *  Print out help message.
+ */
+INT32 Usage()
+{
+    cerr << "This tool shows the live counters of a running Branch Target Simulator" << endl <<
+            "started with -live." << endl << endl;
+    cerr << KNOB_BASE::StringKnobSummary() << endl;
+    return -1;
+}
+
+static double Percent(UINT64 part, UINT64 total)
+{
+    return total ? 100.0 * part / total : 0.0;
+}
+
+/*!
+ * Print one report: rates since the previous snapshot and the accuracy of
+ *  every configuration, overall and for the interval.
+ * @param[in]   reader          the mapped live file
+ * @param[in]   cur             current snapshot
+ * @param[in]   prev            previous snapshot, or all zero for the first one
+ */
+static VOID Report(const LIVE_READER& reader, const std::vector<UINT64>& cur,
+                   const std::vector<UINT64>& prev)
+{
+    double seconds = (cur[LIVE_TIME] - prev[LIVE_TIME]) / 1e9;
+    if (prev[LIVE_TIME] == 0 || seconds <= 0)
+        seconds = 0;
+    UINT64 instr = cur[LIVE_INSTR] - prev[LIVE_INSTR];
+    UINT64 branches = cur[LIVE_BRANCHES] - prev[LIVE_BRANCHES];
+
+    cout << "instructions " << cur[LIVE_INSTR] << "  branches " << cur[LIVE_BRANCHES]
+         << "  taken " << fixed << setprecision(2) << Percent(cur[LIVE_TAKEN], cur[LIVE_BRANCHES])
+         << "%  threads " << cur[LIVE_THREADS];
+    if (seconds > 0)
+        cout << "  " << setprecision(1) << instr / seconds / 1e6 << " MIPS  "
+             << branches / seconds / 1e6 << " M branches/s";
+    cout << endl;
+
+    for (UINT32 i = 0; i < reader.NumBPUs(); i++) {
+        const UINT64* c = &cur[LIVE_STREAM_VALUES + i*LIVE_BPU_VALUES];
+        const UINT64* p = &prev[LIVE_STREAM_VALUES + i*LIVE_BPU_VALUES];
+        cout << "  " << left << setw(24) << reader.names[i] << right << setprecision(3)
+             << "  correct " << setw(7) << Percent(c[LIVE_CORRECT], cur[LIVE_BRANCHES]) << "%"
+             << " (last " << setw(7) << Percent(c[LIVE_CORRECT] - p[LIVE_CORRECT], branches) << "%)"
+             << "  dir " << setw(7) << Percent(c[LIVE_CORRECT_DIR], cur[LIVE_BRANCHES]) << "%"
+             << "  targ " << setw(7) << Percent(c[LIVE_CORRECT_TARG], cur[LIVE_BRANCHES]) << "%"
+             << "  lost/KI " << setprecision(1)
+             << (cur[LIVE_INSTR] ? 1000.0 * c[LIVE_LOST_CYCLES] / cur[LIVE_INSTR] : 0.0)
+             << "  BTB valid " << c[LIVE_BTB_VALID]
+             << " fills " << c[LIVE_BTB_FILLS] << " evictions " << c[LIVE_BTB_EVICTIONS]
+             << "  RAS overflows " << c[LIVE_RAS_OVERFLOWS] << endl;
+    }
+    cout << endl;
+}
+
+/*!
+ * The main procedure of the tool.
+ * @param[in]   argc            total number of elements in the argv array
+ * @param[in]   argv            array of command line arguments
+ */
+int main(int argc, char * argv[])
+{
+    if (ParseKnobs(argc, argv) || KnobLiveFile.Value().empty())
+        return Usage();
+
+    LIVE_READER reader;
+    if (!reader.Open(KnobLiveFile.Value()))
+        return -1;
+
+    std::vector<UINT64> cur, prev(LIVE_STREAM_VALUES + reader.NumBPUs()*LIVE_BPU_VALUES, 0);
+    UINT64 reports = 0;
+    for (;;) {
+        if (reader.Snapshot(cur) && cur[LIVE_TIME] != prev[LIVE_TIME]) {
+            Report(reader, cur, prev);
+            prev = cur;
+            reports++;
+            if (cur[LIVE_FINISHED]) {
+                cout << "Simulation finished" << endl;
+                break;
+            }
+        }
+        if (KnobCount.Value() > 0 && reports >= KnobCount.Value())
+            break;
+
+        // The last snapshot stays readable after a killed run
+        if (kill((pid_t) reader.Pid(), 0) != 0 && errno == ESRCH) {
+            if (reports == 0 && reader.Snapshot(cur))
+                Report(reader, cur, prev);
+            cout << "Simulator " << reader.Pid() << " is gone" << endl;
+            break;
+        }
+        usleep(KnobPeriod.Value() * 1000);
+    }
+    return 0;
+}
+/* ===================================================================== */
+/* eof */
+/* ===================================================================== */
@@ -0,0 +1,181 @@
+//Tsalesis Evangelos
+//AM: 1779
+/*! @file
+ *  Replays a branch trace recorded with the PIN tool (-record) through the
+ *  same BPU simulator, without PIN. Accepts the same predictor switches.
+ *  ChampSim and CBP traces are replayed too (-format, see ingest.h).
+ *
+ *  Build:  g++ -O2 -pthread -o bpu_replay bpu_replay.cpp
+ *  Run:    ./bpu_replay -trace app.trace -btbs 2048 -btba 8 -o btb.out
+ *          ./bpu_replay -format champsim -trace 600.perlbench.champsimtrace.xz
+ */
+
+#include "pin_shim.h"
+#include <fstream>
+#include "bpu.h"
+#include "trace.h"
+#include "ingest.h"
+
+/* ===================================================================== */
+// Command line switches
+/* ===================================================================== */
+KNOB<string> KnobOutputFile(KNOB_MODE_WRITEONCE, "replay",
+    "o", "btb.out", "specify output file name for BTB simulator");
+
+KNOB<string> KnobTraceFile(KNOB_MODE_WRITEONCE, "replay",
+    "trace", "", "specify branch trace file recorded with -record");
+
+KNOB<string> KnobFormat(KNOB_MODE_WRITEONCE, "replay",
+    "format", "bpu", "specify trace format: bpu (-record), champsim, cbp (BT9); .xz and .gz are decompressed");
+
+/* ===================================================================== */
+// Utilities
+/* ===================================================================== */
+
+/*!
+ *  Print out help message.
+ */
+INT32 Usage()
+{
+    cerr << "This tool replays a branch trace through the Branch Target Simulator." << endl <<
+            "It prints out the number of dynamically executed branches," << endl <<
+            "their target prediction ratio, and other metrics." << endl << endl;
+    cerr << KNOB_BASE::StringKnobSummary() << endl;
+    return -1;
+}
+
+/*!
+ * Simulate every record of a trace, in the fast-forward, warm-up and
+ *  detailed windows of the schedule.
+ * @param[in,out]  reader       TRACE_READER or INGEST_READER
+ * @param[in,out]  sim          simulation state created by CreateBPUs
+ * @param[in,out]  sites        static branches, for -topn
+ * @param[in,out]  live         -live counters file, if open
+ */
+template <class READER>
+static VOID Replay(READER &reader, SIM_STATE &sim, BRANCH_SITES &sites, LIVE_WRITER &live)
+{
+    // The trace has no symbols: branches are profiled by PC only (-topn)
+    bool profile = (sim.profile != NULL);
+
+    // Live counters, published every -live-period milliseconds
+    std::vector<SIM_STATE*> streams(1, &sim);
+    std::vector<UINT64> liveValues;
+    UINT64 livePeriod = (UINT64) KnobLivePeriod.Value() * 1000000;
+    UINT64 nextLive = LiveNowNanos() + livePeriod;
+    UINT64 records = 0;
+
+    // Fast-forward, warm-up and detailed windows
+    SAMPLING_SCHEDULE schedule;
+    SAMPLING_STATE sampling;
+    sampling.Start(schedule);
+    sim.warming = (sampling.phase == PHASE_WARMUP);
+
+    BRANCH_RECORD r;
+    while (reader.Next(r)) {
+        sim.cnt_instr += r.instructions;
+        if (sim.cnt_instr >= sampling.nextPhase) {
+            sampling.Advance(schedule, sim.cnt_instr);
+            sim.warming = (sampling.phase == PHASE_WARMUP);
+        }
+        if (sampling.phase == PHASE_SKIP)
+            continue;
+
+        UINT32 slot = NO_BRANCH_SLOT;
+        if (profile) {
+            bool added;
+            slot = sites.Add(r.PC, added);
+        }
+        SimulateBranch(sim, r.PC, r.targetPC, r.brTaken, r.size, r.isCall, r.isReturn,
+                       r.isIndirect, true, slot);
+
+        // Look at the clock once every 64K branches
+        if (live.IsOpen() && (++records & 0xffff) == 0 && LiveNowNanos() >= nextLive) {
+            CollectLiveValues(streams, false, liveValues);
+            live.Publish(liveValues);
+            nextLive += livePeriod;
+        }
+    }
+    sim.cnt_instr += reader.TailInstructions();
+    sim.cnt_instr_detail = sampling.Detailed(sim.cnt_instr);
+    FinishIntervals(sim);
+    if (live.IsOpen()) {
+        CollectLiveValues(streams, true, liveValues);
+        live.Publish(liveValues);
+    }
+}
+
+/*!
+ * The main procedure of the tool.
+ * @param[in]   argc            total number of elements in the argv array
+ * @param[in]   argv            array of command line arguments
+ */
+int main(int argc, char * argv[])
+{
+    if (ParseKnobs(argc, argv) || KnobTraceFile.Value().empty())
+        return Usage();
+
+    std::string fileName = KnobOutputFile.Value();
+    if (fileName.empty()) {
+        cerr << "ERROR: must have an output file.";
+        return -1;
+    }
+    std::ofstream outFile(fileName.c_str());
+
+    SIM_STATE sim;
+    CreateBPUs(sim, NULL); // Initialise the Branch Prediction Units
+    if (!KnobLoadState.Value().empty()) {
+        STATE_READER state;
+        if (!state.Open(KnobLoadState.Value()))
+            return -1;
+        LoadBPUState(state, sim, true);
+    }
+
+    LIVE_WRITER live;
+    if (!KnobLive.Value().empty() && !live.Open(KnobLive.Value(), LiveNames(sim)))
+        return -1;
+
+    BRANCH_SITES sites;
+    if (KnobFormat.Value() == "bpu") {
+        TRACE_READER reader;
+        if (!reader.Open(KnobTraceFile.Value()))
+            return -1;
+        Replay(reader, sim, sites, live);
+        if (!reader.Error().empty()) {
+            cerr << "ERROR: " << KnobTraceFile.Value() << ": " << reader.Error() << endl;
+            return -1;
+        }
+    }
+    else {
+        INGEST_READER reader;
+        if (!reader.Open(KnobTraceFile.Value(), KnobFormat.Value()))
+            return -1;
+        Replay(reader, sim, sites, live);
+        if (!reader.Error().empty()) {
+            cerr << "ERROR: " << KnobTraceFile.Value() << ": " << reader.Error() << endl;
+            return -1;
+        }
+    }
+
+    if (!KnobSaveState.Value().empty() && !SaveBPUState(KnobSaveState.Value(), sim))
+        return -1;
+
+    if (KnobInterval.Value() > 0) {
+        const std::string &name = KnobIntervalFile.Value();
+        bool json = name.size() >= 5 && name.compare(name.size() - 5, 5, ".json") == 0;
+        std::ofstream intervalFile(name.c_str());
+        WriteIntervals(intervalFile, json, std::vector<SIM_STATE*>(1, &sim));
+    }
+
+    outFile <<  "===================================================" << endl;
+    outFile <<  "This trace is replayed by BTBsim" << endl;
+
+    ReportResults(outFile, sim);
+    ReportBranchProfile(outFile, sim, sites);
+
+    outFile <<  "===================================================" << endl;
+    return 0;
+}
+/* ===================================================================== */
+/* eof */
+/* ===================================================================== */
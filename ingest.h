@@ -0,0 +1,546 @@
+//Tsalesis Evangelos
+//AM: 1779
+/*! @file
+ *  Branch traces of other simulators, replayed by bpu_replay (-format):
+ *
+ *    champsim   ChampSim instruction traces: one 64-byte input_instr per
+ *               executed instruction. Branch kinds are told from the
+ *               registers read and written, as ChampSim does; targets
+ *               are the next record's IP.
+ *    cbp        CBP 2016 BT9 traces: a table of branch nodes and edges,
+ *               then the sequence of edges taken.
+ *
+ *  Files ending in .xz or .gz are decompressed by xz or gzip through a
+ *  pipe. A decoder thread converts the input into blocks of
+ *  BRANCH_RECORDs ahead of the simulation, which only takes full blocks
+ *  from a queue.
+ */
+
+#ifndef INGEST_H
+#define INGEST_H
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+static const UINT32 INGEST_BLOCKS = 4;   // blocks decoded ahead of the simulation
+
+/* ===================================================================== */
+// Input files
+/* ===================================================================== */
+
+/*!
+ * A trace file, read through xz or gzip if it is compressed.
+ */
+class INPUT_FILE {
+FILE* file;
+bool piped;
+
+static bool EndsWith(const std::string& s, const char* suffix)
+{
+    size_t n = strlen(suffix);
+    return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+public:
+INPUT_FILE() : file(NULL), piped(false) {}
+~INPUT_FILE() { Close(); }
+
+/*!
+ * Open the file, or start its decompressor. Returns false on failure.
+ */
+bool Open(const std::string& fileName)
+{
+    const char* tool = EndsWith(fileName, ".xz") ? "xz" : EndsWith(fileName, ".gz") ? "gzip" : NULL;
+    if (tool == NULL) {
+        file = fopen(fileName.c_str(), "rb");
+        return file != NULL;
+    }
+    if (access(fileName.c_str(), R_OK) != 0)
+        return false;
+
+    // Single quotes keep the name from the shell; a quote in it is closed and escaped
+    std::string command = std::string(tool) + " -dc '";
+    for (size_t i = 0; i < fileName.size(); i++)
+        command += (fileName[i] == '\'') ? std::string("'\\''") : std::string(1, fileName[i]);
+    command += "'";
+    file = popen(command.c_str(), "r");
+    piped = true;
+    return file != NULL;
+}
+
+FILE* Get() const { return file; }
+
+/*!
+ * Close the file. Returns false if the decompressor failed.
+ */
+bool Close()
+{
+    if (file == NULL)
+        return true;
+    int status = piped ? pclose(file) : fclose(file);
+    file = NULL;
+    return status == 0;
+}
+};
+
+/* ===================================================================== */
+// Decoders
+/* ===================================================================== */
+
+/*!
+ * Converts a trace format into BRANCH_RECORDs, a block at a time.
+ */
+class TRACE_DECODER {
+public:
+std::string error;          // why decoding stopped early, empty at the end of the input
+
+virtual ~TRACE_DECODER() {}
+
+/*!
+ * Decode up to max records into block. Returns false, with no records,
+ *  at the end of the input or on an error.
+ */
+virtual bool Decode(std::vector<BRANCH_RECORD>& block, UINT32 max) = 0;
+
+// Instructions after the last branch, once Decode returned false
+virtual UINT64 TailInstructions() const = 0;
+};
+
+/*!
+ * ChampSim input_instr records. Taken branch targets and not taken branch
+ *  sizes come from the next record, so one branch is held back. Calls
+ *  have no size in the trace: like ChampSim's RAS, the size of each call
+ *  is learned from the return address of its return.
+ */
+class CHAMPSIM_DECODER : public TRACE_DECODER {
+// ChampSim's trace_instr_format.h
+struct INPUT_INSTR {
+    UINT64 ip;
+    UINT8 isBranch;
+    UINT8 branchTaken;
+    UINT8 destinationRegisters[2];
+    UINT8 sourceRegisters[4];
+    UINT64 destinationMemory[2];
+    UINT64 sourceMemory[4];
+};
+
+static const UINT8 REG_STACK_POINTER = 6;
+static const UINT8 REG_FLAGS = 25;
+static const UINT8 REG_INSTRUCTION_POINTER = 26;
+static const UINT32 DEFAULT_CALL_SIZE = 5;   // x86 call rel32
+static const UINT32 MAX_INSTRUCTION_SIZE = 15;
+static const UINT32 MAX_CALL_DEPTH = 1024;
+
+FILE* file;
+std::vector<INPUT_INSTR> buffer;
+size_t bufferPos, bufferEnd;
+BRANCH_RECORD pending;      // branch waiting for the next IP
+bool hasPending;
+UINT64 instructions;        // since the last branch, including it
+std::map<ADDRINT, UINT32> callSizes;
+std::vector<ADDRINT> calls; // IPs of the calls not returned from yet
+
+bool Read(INPUT_INSTR& instr)
+{
+    if (bufferPos == bufferEnd) {
+        bufferEnd = fread(&buffer[0], sizeof(INPUT_INSTR), buffer.size(), file);
+        bufferPos = 0;
+        if (bufferEnd == 0)
+            return false;
+    }
+    instr = buffer[bufferPos++];
+    return true;
+}
+
+static bool Has(const UINT8* regs, UINT32 n, UINT8 reg)
+{
+    for (UINT32 i = 0; i < n; i++) {
+        if (regs[i] == reg)
+            return true;
+    }
+    return false;
+}
+
+// The branch kind, by ChampSim's rules on the registers of the instruction
+static VOID Classify(const INPUT_INSTR& instr, BRANCH_RECORD& r)
+{
+    bool readsSP = Has(instr.sourceRegisters, 4, REG_STACK_POINTER);
+    bool readsFlags = Has(instr.sourceRegisters, 4, REG_FLAGS);
+    bool readsIP = Has(instr.sourceRegisters, 4, REG_INSTRUCTION_POINTER);
+    bool writesSP = Has(instr.destinationRegisters, 2, REG_STACK_POINTER);
+    bool readsOther = false;
+    for (UINT32 i = 0; i < 4; i++) {
+        UINT8 reg = instr.sourceRegisters[i];
+        if (reg != 0 && reg != REG_STACK_POINTER && reg != REG_FLAGS && reg != REG_INSTRUCTION_POINTER)
+            readsOther = true;
+    }
+    r.isCall = readsSP && readsIP && writesSP && !readsFlags;
+    r.isReturn = readsSP && !readsIP && writesSP;
+    r.isIndirect = !r.isReturn && readsOther && !readsFlags;   // returns are not indirect
+}
+
+// Write the held back branch, now that the next IP is known
+VOID Complete(ADDRINT nextIP, std::vector<BRANCH_RECORD>& block)
+{
+    BRANCH_RECORD& r = pending;
+    if (r.brTaken) {
+        r.targetPC = nextIP;
+        if (r.isReturn && !calls.empty()) {
+            ADDRINT call = calls.back();
+            calls.pop_back();
+            if (nextIP > call && nextIP - call <= MAX_INSTRUCTION_SIZE)
+                callSizes[call] = nextIP - call;
+        }
+        if (r.isCall) {
+            std::map<ADDRINT, UINT32>::const_iterator size = callSizes.find(r.PC);
+            r.size = (size != callSizes.end()) ? size->second : DEFAULT_CALL_SIZE;
+            if (calls.size() == MAX_CALL_DEPTH)
+                calls.erase(calls.begin());
+            calls.push_back(r.PC);
+        }
+    }
+    else if (nextIP > r.PC && nextIP - r.PC <= MAX_INSTRUCTION_SIZE) {
+        r.size = nextIP - r.PC;
+    }
+    block.push_back(r);
+    hasPending = false;
+}
+
+public:
+CHAMPSIM_DECODER(FILE* input)
+    : file(input), buffer(4096), bufferPos(0), bufferEnd(0), hasPending(false), instructions(0) {}
+
+bool Decode(std::vector<BRANCH_RECORD>& block, UINT32 max)
+{
+    block.clear();
+    INPUT_INSTR instr;
+    while (block.size() < max && Read(instr)) {
+        if (hasPending)
+            Complete(instr.ip, block);
+        instructions++;
+        if (!instr.isBranch)
+            continue;
+        BRANCH_RECORD& r = pending;
+        r.PC = instr.ip;
+        r.targetPC = 0;
+        r.instructions = instructions;
+        r.size = DEFAULT_CALL_SIZE;
+        r.brTaken = instr.branchTaken;
+        Classify(instr, r);
+        hasPending = true;
+        instructions = 0;
+    }
+    // The last branch of the trace has no next IP: it is dropped
+    if (block.empty() && hasPending) {
+        instructions += pending.instructions;
+        hasPending = false;
+    }
+    return !block.empty();
+}
+
+UINT64 TailInstructions() const { return instructions; }
+};
+
+/*!
+ * CBP 2016 BT9 text traces. Every edge of the sequence is the execution of
+ *  the branch at its source node. Edges leaving node 0, which is not a
+ *  branch, only count their instructions.
+ */
+class BT9_DECODER : public TRACE_DECODER {
+struct NODE {
+    ADDRINT address;
+    UINT32 size;
+    bool isCall;
+    bool isReturn;
+    bool isIndirect;
+};
+
+struct EDGE {
+    UINT32 source;
+    bool taken;
+    ADDRINT target;
+    UINT64 nonBranches;     // instructions after the branch, before the next one
+};
+
+FILE* file;
+char* line;
+size_t lineSize;
+UINT64 lineNumber;
+std::vector<NODE> nodes;
+std::vector<EDGE> edges;
+bool started;               // the node and edge tables were read
+UINT64 instructions;        // since the last branch
+
+// The next line without its newline, NULL at the end of the input
+const char* NextLine()
+{
+    ssize_t n = getline(&line, &lineSize, file);
+    if (n < 0)
+        return NULL;
+    while (n > 0 && (line[n-1] == '\n' || line[n-1] == '\r'))
+        line[--n] = 0;
+    lineNumber++;
+    return line;
+}
+
+bool Fail(const std::string& what)
+{
+    std::ostringstream message;
+    message << "line " << lineNumber << ": " << what;
+    error = message.str();
+    return false;
+}
+
+static bool StartsWith(const char* s, const char* prefix)
+{
+    return strncmp(s, prefix, strlen(prefix)) == 0;
+}
+
+// Read the node and edge tables, up to BT9_EDGE_SEQUENCE
+bool ReadTables()
+{
+    const char* s;
+    while ((s = NextLine()) != NULL && !StartsWith(s, "BT9_EDGE_SEQUENCE")) {
+        if (StartsWith(s, "NODE ")) {
+            UINT32 id;
+            unsigned long long address;
+            char physical[64], opcode[64], className[64] = "";
+            UINT32 size;
+            if (sscanf(s, "NODE %u %llx %63s %63s %u class: %63s", &id, &address,
+                       physical, opcode, &size, className) < 5 || id != nodes.size())
+                return Fail("bad BT9 node");
+            NODE node;
+            node.address = address;
+            node.size = size;
+            node.isCall = strstr(className, "CALL") != NULL;
+            node.isReturn = strstr(className, "RET") != NULL;
+            node.isIndirect = !node.isReturn && strstr(className, "IND") != NULL;
+            nodes.push_back(node);
+        }
+        else if (StartsWith(s, "EDGE ")) {
+            UINT32 id, source, destination;
+            char taken;
+            unsigned long long target, nonBranches;
+            char physical[64];
+            if (sscanf(s, "EDGE %u %u %u %c %llx %63s %llu", &id, &source, &destination,
+                       &taken, &target, physical, &nonBranches) != 7
+                || id != edges.size() || source >= nodes.size())
+                return Fail("bad BT9 edge");
+            EDGE edge;
+            edge.source = source;
+            edge.taken = (taken == 'T');
+            edge.target = target;
+            edge.nonBranches = nonBranches;
+            edges.push_back(edge);
+        }
+    }
+    if (s == NULL)
+        return Fail("no BT9_EDGE_SEQUENCE");
+    started = true;
+    return true;
+}
+
+public:
+BT9_DECODER(FILE* input)
+    : file(input), line(NULL), lineSize(0), lineNumber(0), started(false), instructions(0) {}
+
+~BT9_DECODER() { free(line); }
+
+bool Decode(std::vector<BRANCH_RECORD>& block, UINT32 max)
+{
+    block.clear();
+    if (!started && !ReadTables())
+        return false;
+    const char* s;
+    while (block.size() < max && (s = NextLine()) != NULL) {
+        if (s[0] == 0 || s[0] == '#')
+            continue;
+        if (StartsWith(s, "EOF"))
+            break;
+        char* end;
+        unsigned long id = strtoul(s, &end, 10);
+        if (end == s || id >= edges.size()) {
+            Fail("bad BT9 edge id");
+            block.clear();
+            return false;
+        }
+        const EDGE& edge = edges[id];
+        const NODE& node = nodes[edge.source];
+        if (edge.source != 0) {
+            BRANCH_RECORD r;
+            r.PC = node.address;
+            r.targetPC = edge.target;
+            r.instructions = instructions + 1;
+            r.size = node.size;
+            r.brTaken = edge.taken;
+            r.isCall = node.isCall;
+            r.isReturn = node.isReturn;
+            r.isIndirect = node.isIndirect;
+            block.push_back(r);
+            instructions = 0;
+        }
+        instructions += edge.nonBranches;
+    }
+    return !block.empty();
+}
+
+UINT64 TailInstructions() const { return instructions; }
+};
+
+/* ===================================================================== */
+// Pipelined reader
+/* ===================================================================== */
+
+/*!
+ * Runs a decoder on its own thread, INGEST_BLOCKS blocks ahead, and hands
+ *  out its records in order with the interface of TRACE_READER.
+ */
+class INGEST_READER {
+INPUT_FILE input;
+TRACE_DECODER* decoder;
+std::thread thread;
+std::mutex lock;
+std::condition_variable changed;
+std::deque<std::vector<BRANCH_RECORD>*> full;   // decoded, in order
+std::vector<std::vector<BRANCH_RECORD>*> empty;
+bool finished;              // the decoder thread is done
+bool stopping;              // the reader is being destroyed
+std::string error;
+std::vector<BRANCH_RECORD>* current;
+size_t position;
+
+VOID DecodeAll()
+{
+    for (;;) {
+        std::vector<BRANCH_RECORD>* block;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            while (empty.empty() && !stopping)
+                changed.wait(guard);
+            if (stopping)
+                break;
+            block = empty.back();
+            empty.pop_back();
+        }
+        bool more = decoder->Decode(*block, TRACE_BLOCK_RECORDS);
+        std::lock_guard<std::mutex> guard(lock);
+        if (!more) {
+            empty.push_back(block);
+            break;
+        }
+        full.push_back(block);
+        changed.notify_all();
+    }
+    bool closed = input.Close();
+    std::lock_guard<std::mutex> guard(lock);
+    if (!decoder->error.empty())
+        error = decoder->error;
+    else if (!closed && !stopping)
+        error = "the decompressor failed";
+    finished = true;
+    changed.notify_all();
+}
+
+bool NextBlock()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    if (current != NULL) {
+        empty.push_back(current);
+        current = NULL;
+        changed.notify_all();
+    }
+    while (full.empty() && !finished)
+        changed.wait(guard);
+    if (full.empty())
+        return false;
+    current = full.front();
+    full.pop_front();
+    position = 0;
+    return true;
+}
+
+public:
+INGEST_READER() : decoder(NULL), finished(false), stopping(false), current(NULL), position(0) {}
+
+~INGEST_READER()
+{
+    if (thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+            changed.notify_all();
+        }
+        thread.join();
+    }
+    for (UINT32 i = 0; i < full.size(); i++)
+        delete full[i];
+    for (UINT32 i = 0; i < empty.size(); i++)
+        delete empty[i];
+    delete current;
+    delete decoder;
+}
+
+/*!
+ * Open the trace and start decoding it. Prints the reason and returns
+ *  false on failure.
+ * @param[in]   fileName        trace file, may end in .xz or .gz
+ * @param[in]   format          champsim or cbp
+ */
+bool Open(const std::string& fileName, const std::string& format)
+{
+    if (format != "champsim" && format != "cbp") {
+        cerr << "ERROR: unknown trace format " << format << endl;
+        return false;
+    }
+    if (!input.Open(fileName)) {
+        cerr << "ERROR: cannot open trace " << fileName << endl;
+        return false;
+    }
+    if (format == "champsim")
+        decoder = new CHAMPSIM_DECODER(input.Get());
+    else
+        decoder = new BT9_DECODER(input.Get());
+    for (UINT32 i = 0; i < INGEST_BLOCKS; i++) {
+        empty.push_back(new std::vector<BRANCH_RECORD>());
+        empty.back()->reserve(TRACE_BLOCK_RECORDS);
+    }
+    thread = std::thread(&INGEST_READER::DecodeAll, this);
+    return true;
+}
+
+/*!
+ * Why the trace ended early, empty if it was read to its end.
+ */
+std::string Error()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return error;
+}
+
+// Only valid once Next returned false
+UINT64 TailInstructions() const { return decoder->TailInstructions(); }
+
+/*!
+ * The next record. Returns false at the end of the trace.
+ */
+inline bool Next(BRANCH_RECORD& r)
+{
+    while (current == NULL || position == current->size()) {
+        if (!NextBlock())
+            return false;
+    }
+    r = (*current)[position++];
+    return true;
+}
+};
+
+#endif // INGEST_H
@@ -0,0 +1,97 @@
+//Tsalesis Evangelos
+//AM: 1779
+/*! @file
+ *  Checks the ChampSim decoder of ingest.h on a hand-made trace: calls,
+ *  returns, indirect jumps and calls, and conditional branches must be
+ *  told apart as the PIN tool records them. Returns are not indirect.
+ *
+ *  Build:  g++ -O2 -pthread -o ingest_test ingest_test.cpp
+ *  Run:    ./ingest_test
+ */
+
+#include "pin_shim.h"
+#include "bpu.h"
+#include "trace.h"
+#include "ingest.h"
+
+// ChampSim's trace_instr_format.h, as a tracer writes it
+struct CHAMPSIM_INSTR {
+    UINT64 ip;
+    UINT8 isBranch;
+    UINT8 branchTaken;
+    UINT8 destinationRegisters[2];
+    UINT8 sourceRegisters[4];
+    UINT64 destinationMemory[2];
+    UINT64 sourceMemory[4];
+};
+
+static const UINT8 SP = 6, FLAGS = 25, IP = 26, OTHER = 3;
+
+static VOID Write(FILE* file, ADDRINT ip, bool isBranch, bool taken,
+                  UINT8 dst0, UINT8 dst1, UINT8 src0, UINT8 src1, UINT8 src2)
+{
+    CHAMPSIM_INSTR instr;
+    memset(&instr, 0, sizeof(instr));
+    instr.ip = ip;
+    instr.isBranch = isBranch;
+    instr.branchTaken = taken;
+    instr.destinationRegisters[0] = dst0;
+    instr.destinationRegisters[1] = dst1;
+    instr.sourceRegisters[0] = src0;
+    instr.sourceRegisters[1] = src1;
+    instr.sourceRegisters[2] = src2;
+    fwrite(&instr, sizeof(instr), 1, file);
+}
+
+static int failures = 0;
+
+static VOID Check(const BRANCH_RECORD& r, const char* name, ADDRINT PC, ADDRINT targetPC,
+                  bool isCall, bool isReturn, bool isIndirect)
+{
+    if (r.PC != PC || r.targetPC != targetPC || r.isCall != isCall
+        || r.isReturn != isReturn || r.isIndirect != isIndirect) {
+        cerr << "FAIL: " << name << hex << " PC 0x" << r.PC << " target 0x" << r.targetPC << dec
+             << " call " << r.isCall << " return " << r.isReturn
+             << " indirect " << r.isIndirect << endl;
+        failures++;
+    }
+}
+
+/*!
+ * The main procedure of the test.
+ */
+int main()
+{
+    FILE* file = tmpfile();
+    if (file == NULL) {
+        cerr << "ERROR: cannot create a temporary file" << endl;
+        return -1;
+    }
+    Write(file, 0x1000, true, true,  IP, SP, SP, IP, 0);         // call
+    Write(file, 0x2000, true, true,  IP, 0,  OTHER, 0, 0);       // indirect jump
+    Write(file, 0x3000, true, true,  IP, SP, SP, 0, 0);          // return
+    Write(file, 0x1005, true, false, IP, 0,  FLAGS, IP, 0);      // conditional, not taken
+    Write(file, 0x1007, true, true,  IP, SP, SP, IP, OTHER);     // indirect call
+    Write(file, 0x4000, false, false, 0, 0,  0, 0, 0);
+    rewind(file);
+
+    CHAMPSIM_DECODER decoder(file);
+    std::vector<BRANCH_RECORD> block;
+    if (!decoder.Decode(block, 16) || block.size() != 5) {
+        cerr << "FAIL: decoded " << block.size() << " branches, not 5" << endl;
+        return 1;
+    }
+    Check(block[0], "call",          0x1000, 0x2000, true,  false, false);
+    Check(block[1], "indirect jump", 0x2000, 0x3000, false, false, true);
+    Check(block[2], "return",        0x3000, 0x1005, false, true,  false);
+    Check(block[3], "conditional",   0x1005, 0,      false, false, false);
+    Check(block[4], "indirect call", 0x1007, 0x4000, true,  false, true);
+    fclose(file);
+
+    if (failures == 0)
+        cout << "ingest_test: all branches classified" << endl;
+    return failures == 0 ? 0 : 1;
+}
+/* ===================================================================== */
+/* eof */
+/* ===================================================================== */
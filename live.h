@@ -0,0 +1,248 @@
+//Tsalesis Evangelos
+//AM: 1779
+/*! @file
+ *  Live counters of a running simulation (-live), published in a shared
+ *  memory mapped file and read by bpu_monitor.
+ *
+ *  The file is a header, the name of every configuration, and an array
+ *  of counters:
+ *
+ *    LIVE_HEADER
+ *    char names[numBPUs][LIVE_NAME_SIZE]   btbs/btba/tags/ras/repl
+ *    UINT64 values[LIVE_STREAM_VALUES + numBPUs*LIVE_BPU_VALUES]
+ *
+ *  The values are written as a seqlock snapshot: the sequence is odd
+ *  while a snapshot is written. Readers copy the values and retry if the
+ *  sequence was odd or changed meanwhile. Only the publisher writes, and
+ *  it never blocks on readers.
+ */
+
+#ifndef LIVE_H
+#define LIVE_H
+
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char LIVE_MAGIC[8] = { 'B', 'P', 'U', 'L', 'I', 'V', 'E', 0 };
+static const UINT32 LIVE_VERSION = 1;
+static const UINT32 LIVE_NAME_SIZE = 48;
+
+// Counters of all the instruction streams together
+enum LIVE_STREAM_VALUE {
+    LIVE_TIME,              // CLOCK_MONOTONIC nanoseconds of the snapshot
+    LIVE_FINISHED,          // 1 in the last snapshot of the run
+    LIVE_THREADS,
+    LIVE_INSTR,
+    LIVE_BRANCHES,
+    LIVE_TAKEN,
+    LIVE_STREAM_VALUES
+};
+
+// Counters of every configuration, after the stream values
+enum LIVE_BPU_VALUE {
+    LIVE_CORRECT_DIR,
+    LIVE_CORRECT_TARG,
+    LIVE_CORRECT,           // direction & target
+    LIVE_LOST_CYCLES,       // front-end model
+    LIVE_BTB_HITS,
+    LIVE_BTB_FILLS,
+    LIVE_BTB_EVICTIONS,
+    LIVE_BTB_VALID,
+    LIVE_RAS_OVERFLOWS,
+    LIVE_BPU_VALUES
+};
+
+struct LIVE_HEADER {
+    char magic[8];
+    UINT32 version;
+    UINT32 numBPUs;
+    UINT64 pid;             // of the simulator
+    UINT64 sequence;        // odd while a snapshot is written
+};
+
+static inline UINT64 LiveNowNanos()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (UINT64)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+static inline size_t LiveFileSize(UINT32 numBPUs)
+{
+    return sizeof(LIVE_HEADER) + numBPUs*LIVE_NAME_SIZE
+         + (LIVE_STREAM_VALUES + numBPUs*LIVE_BPU_VALUES)*sizeof(UINT64);
+}
+
+/* ===================================================================== */
+// Writer
+/* ===================================================================== */
+
+/*!
+ * Creates the live file and publishes snapshots into it.
+ */
+class LIVE_WRITER {
+LIVE_HEADER* header;
+UINT64* values;
+UINT32 numValues;
+size_t size;
+
+public:
+LIVE_WRITER() : header(NULL), values(NULL), numValues(0), size(0) {}
+
+~LIVE_WRITER()
+{
+    if (header != NULL)
+        munmap(header, size);
+}
+
+/*!
+ * Create (or truncate) and map the live file. Prints the reason and
+ *  returns false on failure.
+ * @param[in]   fileName        e.g. /dev/shm/bpu.live
+ * @param[in]   names           name of every configuration
+ */
+bool Open(const std::string& fileName, const std::vector<std::string>& names)
+{
+    UINT32 numBPUs = names.size();
+    size = LiveFileSize(numBPUs);
+    int fd = open(fileName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, size) != 0) {
+        cerr << "ERROR: cannot create live counters file " << fileName << endl;
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        cerr << "ERROR: cannot map live counters file " << fileName << endl;
+        return false;
+    }
+
+    // ftruncate zeroed the file: the sequence starts even, all counters 0
+    header = (LIVE_HEADER*) map;
+    char* nameTable = (char*) map + sizeof(LIVE_HEADER);
+    for (UINT32 i = 0; i < numBPUs; i++)
+        strncpy(nameTable + i*LIVE_NAME_SIZE, names[i].c_str(), LIVE_NAME_SIZE - 1);
+    values = (UINT64*)(nameTable + numBPUs*LIVE_NAME_SIZE);
+    numValues = LIVE_STREAM_VALUES + numBPUs*LIVE_BPU_VALUES;
+    header->version = LIVE_VERSION;
+    header->numBPUs = numBPUs;
+    header->pid = getpid();
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(header->magic, LIVE_MAGIC, sizeof(header->magic));   // valid from now on
+    return true;
+}
+
+bool IsOpen() const { return header != NULL; }
+
+/*!
+ * Publish a snapshot of all the counters.
+ * @param[in]   snapshot        LIVE_STREAM_VALUES, then LIVE_BPU_VALUES per configuration
+ */
+VOID Publish(const std::vector<UINT64>& snapshot)
+{
+    UINT64 sequence = header->sequence;
+    __atomic_store_n(&header->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for (UINT32 i = 0; i < numValues; i++)
+        __atomic_store_n(&values[i], snapshot[i], __ATOMIC_RELAXED);
+    __atomic_store_n(&header->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+};
+
+/* ===================================================================== */
+// Reader
+/* ===================================================================== */
+
+/*!
+ * Maps a live file read-only and takes consistent snapshots of it.
+ */
+class LIVE_READER {
+const LIVE_HEADER* header;
+const UINT64* values;
+size_t size;
+
+public:
+std::vector<std::string> names;     // of every configuration
+
+LIVE_READER() : header(NULL), values(NULL), size(0) {}
+
+~LIVE_READER()
+{
+    if (header != NULL)
+        munmap((void*) header, size);
+}
+
+/*!
+ * Map the live file. Prints the reason and returns false on failure.
+ */
+bool Open(const std::string& fileName)
+{
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0) {
+        cerr << "ERROR: cannot open live counters file " << fileName << endl;
+        return false;
+    }
+    struct stat st;
+    LIVE_HEADER h;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(h)
+        || pread(fd, &h, sizeof(h), 0) != (ssize_t) sizeof(h)
+        || memcmp(h.magic, LIVE_MAGIC, sizeof(h.magic)) != 0 || h.version != LIVE_VERSION
+        || (size_t) st.st_size < LiveFileSize(h.numBPUs)) {
+        cerr << "ERROR: " << fileName << " is not a version " << LIVE_VERSION
+             << " live counters file" << endl;
+        close(fd);
+        return false;
+    }
+    size = LiveFileSize(h.numBPUs);
+    void* map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        cerr << "ERROR: cannot map live counters file " << fileName << endl;
+        return false;
+    }
+    header = (const LIVE_HEADER*) map;
+    const char* nameTable = (const char*) map + sizeof(LIVE_HEADER);
+    for (UINT32 i = 0; i < h.numBPUs; i++)
+        names.push_back(std::string(nameTable + i*LIVE_NAME_SIZE,
+                                    strnlen(nameTable + i*LIVE_NAME_SIZE, LIVE_NAME_SIZE)));
+    values = (const UINT64*)(nameTable + h.numBPUs*LIVE_NAME_SIZE);
+    return true;
+}
+
+UINT32 NumBPUs() const { return header->numBPUs; }
+UINT64 Pid() const { return header->pid; }
+
+/*!
+ * Copy a consistent snapshot of the counters. Returns false if no
+ *  snapshot was published yet.
+ * @param[out]  snapshot        LIVE_STREAM_VALUES, then LIVE_BPU_VALUES per configuration
+ */
+bool Snapshot(std::vector<UINT64>& snapshot) const
+{
+    UINT32 numValues = LIVE_STREAM_VALUES + header->numBPUs*LIVE_BPU_VALUES;
+    snapshot.resize(numValues);
+    for (;;) {
+        UINT64 before = __atomic_load_n(&header->sequence, __ATOMIC_ACQUIRE);
+        if (before & 1) {
+            sched_yield();
+            continue;
+        }
+        for (UINT32 i = 0; i < numValues; i++)
+            snapshot[i] = __atomic_load_n(&values[i], __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&header->sequence, __ATOMIC_RELAXED) == before)
+            return before != 0;
+    }
+}
+};
+
+#endif // LIVE_H
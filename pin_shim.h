@@ -0,0 +1,184 @@
+//Tsalesis Evangelos
+//AM: 1779
+/*! @file
+ *  Minimal stand-in for the parts of pin.H used by the simulator core
+ *  (bpu.h), so the standalone tools can be built without PIN:
+ *  the basic types and command line KNOBs.
+ */
+
+#ifndef PIN_SHIM_H
+#define PIN_SHIM_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+typedef uint8_t  UINT8;
+typedef uint16_t UINT16;
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+typedef int8_t   INT8;
+typedef int16_t  INT16;
+typedef int32_t  INT32;
+typedef int64_t  INT64;
+typedef uintptr_t ADDRINT;
+typedef bool     BOOL;
+typedef void     VOID;
+
+#define PIN_FAST_ANALYSIS_CALL
+
+/* ===================================================================== */
+// Command line switches
+/* ===================================================================== */
+
+enum KNOB_MODE {
+    KNOB_MODE_WRITEONCE,    // may be given once
+    KNOB_MODE_OVERWRITE,    // may be given many times, the last one wins
+    KNOB_MODE_APPEND        // may be given many times, all values are kept
+};
+
+/*!
+ * Untyped part of a KNOB: name, default and the values given on the
+ *  command line. All KNOBs register themselves for ParseKnobs.
+ */
+class KNOB_BASE {
+protected:
+KNOB_MODE mode;
+std::string name;
+std::string defaultValue;
+std::string purpose;
+std::vector<std::string> values;
+
+static std::vector<KNOB_BASE*>& Knobs()
+{
+    static std::vector<KNOB_BASE*> knobs;
+    return knobs;
+}
+
+public:
+KNOB_BASE(KNOB_MODE knobMode, const std::string& family, const std::string& knobName,
+          const std::string& knobDefault, const std::string& knobPurpose)
+    : mode(knobMode), name(knobName), defaultValue(knobDefault), purpose(knobPurpose)
+{
+    Knobs().push_back(this);
+}
+
+virtual ~KNOB_BASE() {}
+
+virtual bool IsBool() const { return false; }
+
+UINT32 NumberOfValues() const
+{
+    return values.empty() ? 1 : values.size();
+}
+
+const std::string& ValueString(UINT32 index) const
+{
+    return values.empty() ? defaultValue : values[index];
+}
+
+/*!
+ * Parse -name value switches into the registered KNOBs.
+ * Boolean KNOBs may be given without a value.
+ * Returns true on error, like PIN_Init.
+ */
+static bool Parse(int argc, char* argv[])
+{
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-h" || arg == "-help" || arg.size() < 2 || arg[0] != '-')
+            return true;
+
+        KNOB_BASE* knob = NULL;
+        for (UINT32 k = 0; k < Knobs().size(); k++) {
+            if (Knobs()[k]->name == arg.substr(1))
+                knob = Knobs()[k];
+        }
+        if (knob == NULL) {
+            cerr << "ERROR: unknown switch " << arg << endl;
+            return true;
+        }
+
+        std::string value;
+        if (knob->IsBool() && (i+1 == argc || argv[i+1][0] == '-'))
+            value = "1";
+        else if (i+1 < argc)
+            value = argv[++i];
+        else {
+            cerr << "ERROR: missing value for " << arg << endl;
+            return true;
+        }
+
+        if (knob->mode == KNOB_MODE_WRITEONCE && !knob->values.empty()) {
+            cerr << "ERROR: " << arg << " may only be given once" << endl;
+            return true;
+        }
+        if (knob->mode != KNOB_MODE_APPEND)
+            knob->values.clear();
+        knob->values.push_back(value);
+    }
+    return false;
+}
+
+static std::string StringKnobSummary()
+{
+    std::ostringstream out;
+    for (UINT32 k = 0; k < Knobs().size(); k++) {
+        KNOB_BASE* knob = Knobs()[k];
+        out << "-" << knob->name << "  [default " << knob->defaultValue << "]" << endl
+            << "\t" << knob->purpose << endl;
+    }
+    return out.str();
+}
+};
+
+/*!
+ * Typed KNOB: values are converted from their strings when read.
+ */
+template <class T>
+class KNOB : public KNOB_BASE {
+public:
+KNOB(KNOB_MODE knobMode, const std::string& family, const std::string& knobName,
+     const std::string& knobDefault, const std::string& knobPurpose)
+    : KNOB_BASE(knobMode, family, knobName, knobDefault, knobPurpose) {}
+
+bool IsBool() const;
+
+T Value(UINT32 index = 0) const
+{
+    T value = T();
+    std::istringstream in(ValueString(index));
+    in >> value;
+    return value;
+}
+};
+
+template <class T> inline bool KNOB<T>::IsBool() const { return false; }
+template <> inline bool KNOB<BOOL>::IsBool() const { return true; }
+
+template <> inline std::string KNOB<std::string>::Value(UINT32 index) const
+{
+    return ValueString(index);
+}
+
+template <> inline BOOL KNOB<BOOL>::Value(UINT32 index) const
+{
+    const std::string& value = ValueString(index);
+    return value == "1" || value == "true";
+}
+
+/*!
+ * Parse the command line of a standalone tool into the KNOBs.
+ * Returns true if the command line is invalid or help was requested.
+ */
+inline bool ParseKnobs(int argc, char* argv[])
+{
+    return KNOB_BASE::Parse(argc, argv);
+}
+
+#endif // PIN_SHIM_H
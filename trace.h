@@ -0,0 +1,327 @@
+//Tsalesis Evangelos
+//AM: 1779
+/*! @file
+ *  Compact branch trace format, written by the PIN tool (-record) and
+ *  replayed by bpu_replay without PIN.
+ *
+ *  The file is a header followed by independent blocks of records:
+ *
+ *    TRACE_FILE_HEADER
+ *    TRACE_BLOCK_HEADER, payload       (TRACE_BLOCK_RECORDS records)
+ *    TRACE_BLOCK_HEADER, payload ...
+ *
+ *  Every record is one flags byte and three LEB128 varints:
+ *    flags          taken, call, return, indirect bits and the instruction size
+ *    instructions   instructions executed since the previous record,
+ *                   including this branch
+ *    PC             zigzag delta from the previous record's next PC
+ *                   (its target if taken, its fall through otherwise)
+ *    target         zigzag delta from the fall through address
+ *  Deltas restart at every block, so blocks decode independently.
+ *
+ *  Version 1 traces have no indirect bit: their indirect jumps and calls
+ *  replay as direct ones.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <string.h>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char TRACE_MAGIC[8] = { 'B', 'P', 'U', 'T', 'R', 'A', 'C', 'E' };
+static const UINT32 TRACE_VERSION = 2;
+static const UINT32 TRACE_MIN_VERSION = 1;   // oldest version still replayed
+static const UINT32 TRACE_BLOCK_RECORDS = 16384;
+
+static const UINT8 TRACE_FLAG_TAKEN  = 0x1;
+static const UINT8 TRACE_FLAG_CALL   = 0x2;
+static const UINT8 TRACE_FLAG_RETURN = 0x4;
+static const UINT8 TRACE_FLAG_INDIRECT = 0x8;   // since version 2
+static const UINT32 TRACE_SIZE_SHIFT = 4;   // instruction size in the upper 4 bits
+
+struct TRACE_FILE_HEADER {
+    char magic[8];
+    UINT32 version;
+    UINT32 blockRecords;
+    UINT64 records;             // branch records in the file
+    UINT64 blocks;
+    UINT64 tailInstructions;    // instructions after the last branch
+};
+
+struct TRACE_BLOCK_HEADER {
+    UINT32 records;
+    UINT32 payloadBytes;
+};
+
+/*!
+ * One executed control flow instruction, as passed to SimulateBranch
+ */
+struct BRANCH_RECORD {
+    ADDRINT PC;
+    ADDRINT targetPC;
+    UINT64 instructions;        // instructions since the previous record
+    UINT32 size;
+    bool brTaken;
+    bool isCall;
+    bool isReturn;
+    bool isIndirect;            // indirect jump or call
+};
+
+static inline UINT8* PutVarint(UINT8* p, UINT64 value)
+{
+    while (value >= 0x80) {
+        *p++ = (UINT8)(value | 0x80);
+        value >>= 7;
+    }
+    *p++ = (UINT8)value;
+    return p;
+}
+
+static const UINT32 MAX_VARINT_BYTES = 10;   // of a UINT64
+
+// Returns NULL if the varint does not end before end or within MAX_VARINT_BYTES
+static inline const UINT8* GetVarint(const UINT8* p, const UINT8* end, UINT64& value)
+{
+    if (end - p > (ptrdiff_t) MAX_VARINT_BYTES)
+        end = p + MAX_VARINT_BYTES;
+    UINT64 result = 0;
+    for (UINT32 shift = 0; p < end; shift += 7) {
+        UINT8 byte = *p++;
+        result |= (UINT64)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            value = result;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static inline UINT64 ZigZag(INT64 value)   { return ((UINT64)value << 1) ^ (UINT64)(value >> 63); }
+static inline INT64 UnZigZag(UINT64 value) { return (INT64)(value >> 1) ^ -(INT64)(value & 1); }
+
+/* ===================================================================== */
+// Writer
+/* ===================================================================== */
+
+/*!
+ * Encodes records into a block buffer and writes whole blocks to the file.
+ */
+class TRACE_WRITER {
+std::ofstream file;
+TRACE_FILE_HEADER header;
+std::vector<UINT8> payload;
+UINT8* cursor;
+UINT32 blockRecords;
+ADDRINT nextPC;
+
+VOID FlushBlock()
+{
+    if (blockRecords == 0)
+        return;
+    TRACE_BLOCK_HEADER block;
+    block.records = blockRecords;
+    block.payloadBytes = cursor - &payload[0];
+    file.write((const char*) &block, sizeof(block));
+    file.write((const char*) &payload[0], block.payloadBytes);
+    header.blocks++;
+    cursor = &payload[0];
+    blockRecords = 0;
+    nextPC = 0;
+}
+
+public:
+// Worst case: flags byte and three 10-byte varints per record
+TRACE_WRITER() : payload(TRACE_BLOCK_RECORDS * 31) {}
+
+bool Open(const std::string& fileName)
+{
+    file.open(fileName.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!file)
+        return false;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.blockRecords = TRACE_BLOCK_RECORDS;
+    file.write((const char*) &header, sizeof(header));  // rewritten by Close
+    cursor = &payload[0];
+    blockRecords = 0;
+    nextPC = 0;
+    return true;
+}
+
+VOID Append(const BRANCH_RECORD& r)
+{
+    ADDRINT fallThroughAddr = r.PC + r.size;
+    *cursor++ = (r.brTaken ? TRACE_FLAG_TAKEN : 0)
+              | (r.isCall ? TRACE_FLAG_CALL : 0)
+              | (r.isReturn ? TRACE_FLAG_RETURN : 0)
+              | (r.isIndirect ? TRACE_FLAG_INDIRECT : 0)
+              | (UINT8)(r.size << TRACE_SIZE_SHIFT);
+    cursor = PutVarint(cursor, r.instructions);
+    cursor = PutVarint(cursor, ZigZag((INT64)(r.PC - nextPC)));
+    cursor = PutVarint(cursor, ZigZag((INT64)(r.targetPC - fallThroughAddr)));
+    nextPC = r.brTaken ? r.targetPC : fallThroughAddr;
+
+    header.records++;
+    if (++blockRecords == TRACE_BLOCK_RECORDS)
+        FlushBlock();
+}
+
+VOID Close(UINT64 tailInstructions)
+{
+    FlushBlock();
+    header.tailInstructions = tailInstructions;
+    file.seekp(0);
+    file.write((const char*) &header, sizeof(header));
+    file.close();
+}
+};
+
+/* ===================================================================== */
+// Reader
+/* ===================================================================== */
+
+/*!
+ * Maps a trace file and decodes its records in order.
+ */
+class TRACE_READER {
+const UINT8* data;
+size_t size;
+TRACE_FILE_HEADER header;
+const UINT8* cursor;        // next record of the current block
+const UINT8* blockEnd;
+const UINT8* nextBlock;
+UINT32 blockRecords;        // records left in the current block
+ADDRINT nextPC;
+std::string error;          // why the trace ended early
+
+bool Fail(const char* what)
+{
+    std::ostringstream message;
+    message << what << " at byte " << (cursor - data);
+    error = message.str();
+    blockRecords = 0;
+    nextBlock = data + size;
+    return false;
+}
+
+bool NextBlock()
+{
+    TRACE_BLOCK_HEADER block;
+    if (nextBlock == data + size)
+        return false;
+    cursor = nextBlock;
+    if (nextBlock + sizeof(block) > data + size)
+        return Fail("truncated block header");
+    memcpy(&block, nextBlock, sizeof(block));
+    cursor = nextBlock + sizeof(block);
+    if (block.payloadBytes > (size_t)(data + size - cursor))
+        return Fail("truncated block");
+    blockEnd = cursor + block.payloadBytes;
+    nextBlock = blockEnd;
+    blockRecords = block.records;
+    nextPC = 0;
+    return true;
+}
+
+public:
+TRACE_READER() : data(NULL), size(0) {}
+
+~TRACE_READER()
+{
+    if (data != NULL)
+        munmap((void*) data, size);
+}
+
+/*!
+ * Map the trace file. Prints the reason and returns false on failure.
+ */
+bool Open(const std::string& fileName)
+{
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0) {
+        cerr << "ERROR: cannot open trace " << fileName << endl;
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(header)) {
+        cerr << "ERROR: " << fileName << " is not a branch trace" << endl;
+        close(fd);
+        return false;
+    }
+    size = st.st_size;
+    void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        cerr << "ERROR: cannot map trace " << fileName << endl;
+        return false;
+    }
+    data = (const UINT8*) map;
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0
+        || header.version < TRACE_MIN_VERSION || header.version > TRACE_VERSION) {
+        cerr << "ERROR: " << fileName << " is not a version " << TRACE_MIN_VERSION
+             << " to " << TRACE_VERSION << " branch trace" << endl;
+        return false;
+    }
+    nextBlock = data + sizeof(header);
+    blockRecords = 0;
+    return true;
+}
+
+UINT64 Records() const { return header.records; }
+UINT64 TailInstructions() const { return header.tailInstructions; }
+
+/*!
+ * Why the trace ended early, empty if it was read to its end.
+ */
+std::string Error() const { return error; }
+
+/*!
+ * Decode the next record. Returns false at the end of the trace, or at
+ *  a corrupt block (see Error).
+ */
+inline bool Next(BRANCH_RECORD& r)
+{
+    while (blockRecords == 0) {
+        if (!NextBlock())
+            return false;
+    }
+    blockRecords--;
+
+    if (cursor == blockEnd)
+        return Fail("block ends before its records");
+    UINT8 flags = *cursor++;
+    UINT64 value, targetDelta;
+    const UINT8* end = GetVarint(cursor, blockEnd, r.instructions);
+    if (end != NULL)
+        end = GetVarint(end, blockEnd, value);
+    if (end != NULL)
+        end = GetVarint(end, blockEnd, targetDelta);
+    if (end == NULL)
+        return Fail("bad record");
+    cursor = end;
+    r.PC = nextPC + UnZigZag(value);
+    r.size = flags >> TRACE_SIZE_SHIFT;
+    r.brTaken = flags & TRACE_FLAG_TAKEN;
+    r.isCall = flags & TRACE_FLAG_CALL;
+    r.isReturn = flags & TRACE_FLAG_RETURN;
+    r.isIndirect = flags & TRACE_FLAG_INDIRECT;
+    ADDRINT fallThroughAddr = r.PC + r.size;
+    r.targetPC = fallThroughAddr + UnZigZag(targetDelta);
+    nextPC = r.brTaken ? r.targetPC : fallThroughAddr;
+    return true;
+}
+};
+
+#endif // TRACE_H